@@ -72,6 +72,104 @@ static void ffs_fflush(FILE *fp)
 }
 #endif
 
+// 导出到宿主的文件描述符: 写入n个byte，失败时返回0
+#if defined(WIN32) || defined(_WIN32) || defined(__CYGWIN__)
+static unsigned char ffs_write_fd(int fd, const unsigned char *buf, size_t n)
+{
+	int r;
+	while ( n > 0 ) {
+		r = _write(fd, buf, n > 0x40000000 ? 0x40000000 : (unsigned int)n);
+		if ( r <= 0 ) return 0;
+		buf += r;
+		n -= r;
+	}
+	return 1;
+}
+// 从宿主的文件描述符读取，*got不足n时已到文件尾
+static unsigned char ffs_read_fd(int fd, unsigned char *buf, size_t n, size_t *got)
+{
+	int r;
+	*got = 0;
+	while ( n > 0 ) {
+		r = _read(fd, buf, n > 0x40000000 ? 0x40000000 : (unsigned int)n);
+		if ( r < 0 ) return 0;
+		if ( r == 0 ) break;
+		buf += r;
+		n -= r;
+		*got += r;
+	}
+	return 1;
+}
+// 修改fp的文件长度
+static unsigned char ffs_fsetsize(FILE *fp, unsigned long long size)
+{
+	fflush(fp);
+	return _chsize_s(_fileno(fp), (__int64)size) == 0;
+}
+// 预读提示，没有对应的接口
+static void ffs_prefetch(FILE *fp, unsigned long long pos, size_t len)
+{
+	(void)fp; (void)pos; (void)len;
+}
+#else
+	#include <sys/uio.h>
+	#include <fcntl.h>
+	// 可以用writev一次写入多个block的payload
+	#define FFS_WRITEV
+static unsigned char ffs_write_fd(int fd, const unsigned char *buf, size_t n)
+{
+	ssize_t r;
+	while ( n > 0 ) {
+		r = write(fd, buf, n);
+		if ( r < 0 && errno == EINTR ) continue;
+		if ( r <= 0 ) return 0;
+		buf += r;
+		n -= (size_t)r;
+	}
+	return 1;
+}
+static unsigned char ffs_read_fd(int fd, unsigned char *buf, size_t n, size_t *got)
+{
+	ssize_t r;
+	*got = 0;
+	while ( n > 0 ) {
+		r = read(fd, buf, n);
+		if ( r < 0 && errno == EINTR ) continue;
+		if ( r < 0 ) return 0;
+		if ( r == 0 ) break;
+		buf += r;
+		n -= (size_t)r;
+		*got += (size_t)r;
+	}
+	return 1;
+}
+static unsigned char ffs_fsetsize(FILE *fp, unsigned long long size)
+{
+	fflush(fp);
+	return ftruncate(fileno(fp), (off_t)size) == 0;
+}
+// 预读提示: 告诉系统之后会读取[pos, pos+len)，读取时已在page cache中
+static void ffs_prefetch(FILE *fp, unsigned long long pos, size_t len)
+{
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(fileno(fp), (off_t)pos, (off_t)len, POSIX_FADV_WILLNEED);
+#else
+	(void)fp; (void)pos; (void)len;
+#endif
+}
+#endif
+
+// SSE2: 块去重时计算block的hash，目录块中按名称查找目录项
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define FFS_SSE2
+#endif
+// AVX2: 目录块中一次比较8个目录项名称的前4 byte(gather)
+#if defined(FFS_SSE2) && defined(__AVX2__)
+	#include <immintrin.h>
+	#define FFS_AVX2
+#endif
+
 // =====================================
 // platform depend stop
 // =====================================
@@ -97,8 +195,131 @@ static void ffs_fflush(FILE *fp)
 // .->listsize在block中的位置, head 12 + state 1 + name 14 + start 4 + stop + 4
 #define BLOCK_OFFSET 35
 
+// ..->stop_blockindex在block中的位置，保存目录当前的pack block, head 12 + . 25 + state 1 + name 14 + start 4
+#define BLOCK_PACK_BLOCKINDEX 56
+
+// block中可存放文件内容的长度
+#define BLOCK_DATASIZE (BLOCKSIZE - BLOCK_HEAD)
+
+// 目录项state
+// bit0: 0-目录,1-文件
+#define ITEM_FILE 0x01
+// bit1: 文件内容以块映射(map)存储，支持空洞；否则为block链
+#define ITEM_MAP 0x02
+// bit2: 文件内容直接存放在目录项中(inline)
+#define ITEM_INLINE 0x04
+// bit3: 块映射文件的内容按extent压缩存储
+#define ITEM_COMPRESS 0x08
+// bit4-6: 块映射的层数
+#define ITEM_DEPTH_SHIFT 4
+#define ITEM_DEPTH_MASK 0x70
+// bit7: 不是独立的目录项，ITEM_CONT-inline文件的后续slot，ITEM_FILLER-空slot
+#define ITEM_SLOT 0x80
+#define ITEM_CONT 0x80
+#define ITEM_FILLER 0xC0
+
+/*
+inline文件:
+第一个slot: state(1) name(14) 文件长度(2) 数据(8)
+之后的ITEM_CONT slot: state(1) 0(1) 数据(23)，name的第一个byte为0，搜索名称时不会匹配
+一个目录项的全部slot位于同一个block中，block尾部放不下时用ITEM_FILLER填满
+新建的文件都是inline文件，超出INLINE_MAXSIZE时转换为块映射文件，打开和读取只需读取目录块
+*/
+#define INLINE_HEADSIZE 8
+#define INLINE_CONTSIZE 23
+#define INLINE_MAXSLOTS 8
+#define INLINE_MAXSIZE (INLINE_HEADSIZE + INLINE_CONTSIZE * (INLINE_MAXSLOTS - 1))
+
+/*
+块映射文件:
+目录项的start_blockindex指向根块(root)，stop_blockindex和offset保留为0
+depth=0时，root就是第0个数据块；depth>0时，root是索引块
+索引块在BLOCK_HEAD之后存放MAP_ITEM_MAXCOUNT个blockindex，值为0表示空洞，读取时返回0
+root块的4-11字节存放文件长度(8 byte)，其它索引块和数据块的头部无意义
+inline文件超出INLINE_MAXSIZE后使用块映射，定位到任意位置最多读取MAP_MAXDEPTH个索引块；旧的block链文件在以可写方式打开时转换
+*/
+#define MAP_ITEM_MAXCOUNT 125
+#define MAP_MAXDEPTH 5
+
+/*
+reflink:
+FileFS_copy复制块映射文件时，新的目录项直接使用原来的root，之后写入时才复制
+引用计数表记录block额外的引用数量(不在表中为0)，结构和块映射相同，以blockindex为序号，叶子中保存引用数量
+表块中的引用数量全部为0时释放，整个表为空时root为0
+引用计数表的root和层数保存在block[0]的12-16字节
+共享是分层的: 共享的索引块下的所有block也是共享的，写入时沿路径复制共享的块，复制索引块时子块的引用数量加1
+释放时引用数量大于0只减1，不再向下释放
+*/
+
+/*
+尾部打包(tail packing):
+块映射文件最后一个不完整的block(长度不超过PACK_MAXSIZE)可以放在pack block中，和其它文件的尾部共用一个block
+此时目录项的stop_blockindex为pack block，offset为片段在pack block中的位置，映射中最后一个block为0
+depth=0且root为0时，文件只有一个片段，片段长度就是文件长度
+pack block: 4-5字节为已使用的尾部位置，6-7字节为片段数量，8-11字节为所属目录的第一个block(0-目录已删除)
+片段: 长度(2) 数据，新的片段追加到目录..->stop_blockindex指向的pack block
+片段数量为0时释放，是目录当前的pack block时同时清除..->stop_blockindex，container可以恢复原来的大小
+打开FileFS_settailpack后，关闭可写的文件时打包，再次写入时先恢复为普通的block
+*/
+#define PACK_MAXSIZE 250
+
+/*
+压缩文件(compress):
+块映射文件按CMP_EXTSIZE(CMP_EXTBLOCKS个block的数据长度)分为extent，每个extent独立压缩(LZ4格式)
+第e个extent对应映射中[e*CMP_EXTBLOCKS, (e+1)*CMP_EXTBLOCKS)的位置，映射本身就是逻辑位置到压缩数据的索引
+extent的长度为L(文件最后一个extent可能不完整)，需要N=(L+499)/500个block:
+  映射中有N个block时未压缩，数据直接存放；少于N个时为压缩数据: 压缩长度(2) 压缩数据，依次存放在前几个block中
+  没有block时为空洞，全部为0的extent写入时也成为空洞
+只有能节省block时才压缩；文件变长时，原来最后一个不完整的extent按完整长度重新写入
+读写时在内存中缓存一个解压后的extent，每次fwrite都重新压缩修改的extent，和其它文件一样在事务中写入
+压缩文件的depth至少为1，不使用延迟分配和尾部打包
+*/
+#define CMP_EXTBLOCKS 16
+#define CMP_EXTSIZE (CMP_EXTBLOCKS * BLOCK_DATASIZE)
+// LZ4格式的hash表位数
+#define LZ_HASHBITS 12
+
+/*
+目录散列索引(dir index):
+目录达到DIRINDEX_MINBLOCKS个block时建立，目录头块的prevblockindex(8-11字节，头块没有prev)指向索引的root，0为没有索引
+目录项仍按原来的方式顺序存放，readdir不受影响，索引只记录每个目录项的位置，查找、创建、删除只需读取几个block
+root: 4-7字节为桶的数量，8-11字节为记录数量，之后MAP_ITEM_MAXCOUNT个blockindex
+  桶的数量不超过MAP_ITEM_MAXCOUNT时直接指向桶，否则指向二级块，每个二级块指向MAP_ITEM_MAXCOUNT个桶
+桶: 4-7字节为溢出的下一个block，8-11字节为记录数量，记录: 名称的hash(4) 目录项所在的block(4) 目录项的起始位置(2)
+"."和".."不在索引中；平均每个桶的记录超过DIRINDEX_LOAD时增加桶的数量，重新扫描目录建立索引
+*/
+#define DIRINDEX_MINBLOCKS 8
+#define DIRINDEX_ITEMS 50
+#define DIRINDEX_LOAD 32
+#define DIRINDEX_MAXBUCKETS (MAP_ITEM_MAXCOUNT * MAP_ITEM_MAXCOUNT)
+
+// 路径解析的目录项缓存(dentry cache)的项目数量，2的幂，按(父目录, 名称)直接映射
+#define DCACHE_SIZE 1024
+
+// genblockindex_near: 在空闲链表中最多查找的block数量
+#define GENBLOCK_SCANMAX 32
+
+// 大量读写时一次读写的连续block数量
+#define BLOCK_RUNMAX 32
+
+// 导入: 一次从fd读取并直接写入container的block数量
+#define IMPORT_RUNBLOCKS 256
+
+// 块去重: 每合并DEDUP_BATCH个block提交一次事务
+#define DEDUP_BATCH 256
+
 static unsigned char magic_number[4] = {0x78, 0x11, 0x45, 0x14};
 
+// 延迟分配时，内存中保存的一个文件块
+typedef struct DirtyBlock {
+	unsigned long long fileblock;
+	unsigned int blockindex; // 已存在的block，0-尚未分配
+	unsigned char data[BLOCK_DATASIZE];
+} DirtyBlock;
+
+// 延迟分配时内存中最多保存的block数量，超出时自动fflush
+#define DELAY_MAXBLOCKS 2048
+
 typedef struct FFS_FILE {
 	/*
 	0 - "r" 	(可读，不可写，必须存在) 
@@ -110,6 +331,7 @@ typedef struct FFS_FILE {
 	*/
 	unsigned char mode;
 	
+	unsigned int dir_head_blockindex; // 文件所在目录的第一个block
 	unsigned int dir_blockindex; // 文件所在的目录块
 	unsigned short dir_offset;   // 文件在目录块中的尾部
 	
@@ -124,18 +346,66 @@ typedef struct FFS_FILE {
 	unsigned short pos_offset;
 	// 文件读写的位置，与block的具体格式无关
 	unsigned long long pos;
+	
+	// 块映射文件，此时file_start_blockindex为root，pos_blockindex/pos_offset不使用
+	unsigned char map; // 0-block链,1-块映射
+	unsigned char map_depth;
+	unsigned long long size; // 文件长度
+	// 最近使用的叶子索引块，顺序读写时无需每次从root开始查找
+	unsigned int leaf_blockindex;
+	unsigned long long leaf_base; // 叶子索引块第0项对应的文件块序号
+	unsigned char leaf[BLOCKSIZE];
+	
+	// inline文件，内容全部保存在inl_data中，写入时同步到目录项，size为文件长度
+	unsigned char inl; // 0-否,1-inline
+	unsigned char inl_data[INLINE_MAXSIZE];
+	
+	// 延迟分配: 写入的数据先保存在内存中(按fileblock排序)，fflush/fclose/commit时才分配block
+	unsigned char delay;
+	DirtyBlock *dirty;
+	int dirty_count, dirty_size;
+	FFS_FILE *delay_next; // FileFS中延迟分配的文件链表
+	FFS_FILE *open_next; // FileFS中打开的文件链表
+	
+	// 压缩文件，cmp_data缓存第cmp_extent个extent解压后的内容(CMP_EXTSIZE)，cmp_valid为0时无效
+	unsigned char compress;
+	unsigned char cmp_valid;
+	unsigned long long cmp_extent;
+	unsigned char *cmp_data;
 } FFS_FILE;
 
+// 目录项和它在目录中的位置
+typedef struct DirItem {
+	FFS_direntplus plus;
+	unsigned int blockindex; // 目录项所在的block
+	unsigned short offset; // 目录项的尾部在block中的位置
+} DirItem;
+
 typedef struct FFS_DIR {
+	unsigned int head_blockindex; // 目录的第一个block，保存了stop_blockindex和offset
 	unsigned int blockindex;
 	unsigned char block[BLOCKSIZE];
 	int searchindex; // 0 - BLOCK_ITEM_MAXCOUNT-1
 	unsigned int stop_blockindex;
 	unsigned short offset;
+	unsigned int block_gen; // 读取block时的ffs->block_gen
 	
 	FFS_dirent dirp;
+	DirItem cur; // FileFS_readdirplus返回的目录项
+	
+	// FileFS_opendir_sorted: 打开时读取的全部目录项组成按名称的最小堆，readdir每次取出最小的
+	unsigned char sorted;
+	DirItem *items;
+	int item_count;
 } FFS_DIR;
 
+// genblockindex_near: 空闲链表头部最多GENBLOCK_SCANMAX个block和它们的next，idx[0]不一定还是链表头
+// 链表只在头部增加和取出，当前的链表头在idx中时，从它开始的部分仍然有效
+typedef struct FreeCache {
+	unsigned int idx[GENBLOCK_SCANMAX], next[GENBLOCK_SCANMAX];
+	int count;
+} FreeCache;
+
 typedef struct TMP TMP;
 typedef struct TMP {
 	unsigned char state; // 0-normal, 1-auto commit, 2-manu commit
@@ -162,8 +432,26 @@ typedef struct TMP {
 	
 	unsigned int total_blocksize, unused_blockhead; // 执行fp = ffs_tmpfile()时，同步从orgfile里的block[0]读取这2个值
 	unsigned int new_total_blocksize, new_unused_blockhead; // 一开始和上面的值相同，会随着tmpfile的处理产生变化
+	
+	// 引用计数表(reflink)，同样保存在block[0]中
+	unsigned int ref_root, new_ref_root;
+	unsigned char ref_depth, new_ref_depth;
+	
+	// 直接写入fp尾部、不经过fp_add和fnj的block数量(import)，commit时必须写入block[0]
+	unsigned int direct_size;
+	
+	// 事务中的空闲链表缓存，commit后复制到ffs->free，rollback时丢弃
+	FreeCache free;
 } TMP;
 
+// 目录项缓存: 父目录parent中名称为name的项目，type: 0-不存在,1-文件,2-目录，child为目录的第一个block
+// parent为0表示空位，只在内存中，修改目录项时删除相应的项目
+typedef struct DCacheItem {
+	unsigned int parent, child;
+	unsigned char type;
+	char name[BLOCK_NAME_MAXSIZE+1];
+} DCacheItem;
+
 typedef struct FileFS {
 	char *fn;
 	FILE *fp;
@@ -186,6 +474,23 @@ typedef struct FileFS {
 	char *work;
 	int work_size;
 	unsigned int work_blockindex;
+	
+	// 延迟分配的文件，commit时一起写入
+	FFS_FILE *delay_head;
+	// 打开的文件，它们的目录项不能在目录中移动
+	FFS_FILE *open_head;
+	
+	// 尾部打包: 0-关闭,1-打开
+	unsigned char tailpack;
+	
+	// 目录项缓存，findPathBlockindex和FileFS_stat先在这里查找
+	DCacheItem dcache[DCACHE_SIZE];
+	
+	// 写入、删除block和事务结束时加1，readdir据此判断FFS_DIR中的block是否仍然有效
+	unsigned int block_gen;
+	
+	// 已提交的空闲链表缓存，tmpstart时复制到tmp.free
+	FreeCache free;
 } FileFS;
 
 // ==========================================
@@ -195,16 +500,91 @@ typedef struct BlockArray {
 	unsigned char block[BLOCKSIZE];
 	unsigned int blockindex;
 } BlockArray;
+
+// 块去重时内存中的hash表，blockindex为0表示空位
+typedef struct DedupItem {
+	unsigned long long hash;
+	unsigned int blockindex;
+} DedupItem;
+typedef struct DedupTable {
+	DedupItem *items;
+	unsigned int size, count; // size为2的幂
+} DedupTable;
+// 重建目录散列索引时内存中的记录
+typedef struct DirIndexItem {
+	unsigned int hash, blockindex, bucket;
+	unsigned short item_start;
+} DirIndexItem;
 	
 static unsigned char tmpstart(FileFS *ffs, unsigned char state);
 static void tmpstop(FileFS *ffs);
 static unsigned int genblockindex(FileFS *ffs);
+static unsigned int genblockindex_near(FileFS *ffs, unsigned int hint);
+static unsigned int addblockindex(FileFS *ffs);
+static unsigned int genblockrun(FileFS *ffs, unsigned int count, unsigned int *n);
+static void freecache_push(FileFS *ffs, unsigned int blockindex);
 static unsigned char readblock(FileFS *ffs, unsigned int blockindex, unsigned char *block);
 static unsigned char writeblock(FileFS *ffs, unsigned int blockindex, unsigned char *block);
 static unsigned char removeblock(FileFS *ffs, unsigned int blockindex);
+static unsigned char readblockrun(FileFS *ffs, unsigned int blockindex, unsigned int count, unsigned char *buf);
+static unsigned char writeblockrun(FileFS *ffs, unsigned int blockindex, unsigned int count, unsigned char *buf);
+
+static unsigned char map_open(FileFS *ffs, FFS_FILE *stream, unsigned char state);
+static unsigned char map_get(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int *blockindex);
+static unsigned char map_set(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int blockindex);
+static unsigned char map_setrun(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int blockindex, unsigned int count);
+static unsigned char map_sync(FileFS *ffs, FFS_FILE *stream);
+static unsigned char map_free(FileFS *ffs, unsigned int blockindex, unsigned char depth);
+static unsigned char map_getw(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int *blockindex);
+static unsigned char map_cowroot(FileFS *ffs, FFS_FILE *stream);
+static unsigned char ref_get(FileFS *ffs, unsigned int blockindex, unsigned int *count);
+static unsigned char ref_set(FileFS *ffs, unsigned int blockindex, unsigned int count);
+static unsigned char map_punch(FileFS *ffs, unsigned int blockindex, unsigned char depth, 
+	unsigned long long base, unsigned long long lo, unsigned long long hi, unsigned char *empty);
+static unsigned char chain2map(FileFS *ffs, FFS_FILE *stream);
+static unsigned char pack_alloc(FileFS *ffs, unsigned int dir_head_blockindex, unsigned char *data, unsigned short len, 
+	unsigned int *pack_blockindex, unsigned short *pack_offset);
+static unsigned char pack_free(FileFS *ffs, unsigned int pack_blockindex, unsigned short pack_offset);
+static unsigned char pack_copy(FileFS *ffs, unsigned int pack_blockindex, unsigned short pack_offset, unsigned int dir_head_blockindex, 
+	unsigned int *new_pack_blockindex, unsigned short *new_pack_offset);
+static unsigned char map_pack(FileFS *ffs, FFS_FILE *stream);
+static unsigned char map_unpack(FileFS *ffs, FFS_FILE *stream);
+static unsigned char cmp_load(FileFS *ffs, FFS_FILE *stream, unsigned long long extent);
+static unsigned char cmp_store(FileFS *ffs, FFS_FILE *stream);
+static int item_slots(unsigned char *item);
+static unsigned char dir_addslots(FileFS *ffs, unsigned int head_blockindex, unsigned char *slots, int n, 
+	unsigned int *blockindex, unsigned short *item_offset);
+static unsigned char dir_delslots(FileFS *ffs, unsigned int head_blockindex, unsigned int blockindex, unsigned short item_start, int n);
+static unsigned char item_isopen(FileFS *ffs, unsigned int blockindex, unsigned short item_offset);
+static int dir_find(FileFS *ffs, unsigned int head_blockindex, unsigned char *head, const char *name, 
+	unsigned char *block, unsigned int *blockindex, unsigned short *item_offset);
+static unsigned char dirindex_insert(FileFS *ffs, unsigned int head_blockindex, const unsigned char *name, unsigned int blockindex, unsigned short item_offset);
+static unsigned char dirindex_update(FileFS *ffs, unsigned int root, const unsigned char *name, 
+	unsigned int blockindex, unsigned short item_start, unsigned int new_blockindex, unsigned short new_item_start);
+static unsigned char dirindex_free(FileFS *ffs, unsigned int root);
+static int dir_lookup(FileFS *ffs, unsigned int parent, const char *name, unsigned int *child);
+static void dcache_drop(FileFS *ffs, unsigned int parent, const char *name);
+static void dcache_dropdir(FileFS *ffs, unsigned int parent);
+static void dcache_clear(FileFS *ffs);
+static unsigned char item_freecontent(FileFS *ffs, unsigned char *item);
+static unsigned char dir_freetree(FileFS *ffs, unsigned int head_blockindex);
+static unsigned char dir_unmark(FileFS *ffs, unsigned int head_blockindex, unsigned char *head);
+static void inline_open(FFS_FILE *stream, unsigned char *dir_block);
+static unsigned char inline_sync(FileFS *ffs, FFS_FILE *stream, unsigned int org_size);
+static unsigned char inline2map(FileFS *ffs, FFS_FILE *stream);
+static size_t do_fwrite_map(FileFS *ffs, const unsigned char *ptr, size_t wannasize, FFS_FILE *stream);
+static int dirty_search(FFS_FILE *stream, unsigned long long fileblock);
+static unsigned char do_fflush_delay(FileFS *ffs, FFS_FILE *stream);
+static void delay_unlink(FileFS *ffs, FFS_FILE *stream);
+static void delay_reload(FileFS *ffs, FFS_FILE *stream);
+static int delay_flushitem(FileFS *ffs, unsigned int dir_blockindex, unsigned short dir_offset);
+
+static FFS_FILE *do_fopen_item(FileFS *ffs, unsigned char *dir_block, unsigned int dir_blockindex, unsigned short dir_offset, 
+	unsigned int block_head_index, unsigned char mode);
 
 static unsigned int findPathBlockindex(FileFS *ffs, unsigned int blockindex, char *pathname);
 static void j2ffs(FileFS *ffs);
+static void fp_trim(FileFS *ffs);
 
 // ==========================================
 static unsigned int B4toU32(unsigned char byte[4])
@@ -213,7 +593,7 @@ static unsigned int B4toU32(unsigned char byte[4])
 		( byte[0]      & 0xFF)     |
 		((byte[1]<<8)  & 0xFF00)   |
 		((byte[2]<<16) & 0xFF0000) |
-		((byte[3]<<24) & 0xFF000000)
+		(((unsigned int)byte[3]<<24) & 0xFF000000)
 		);
 }
 
@@ -239,6 +619,17 @@ static void U16toB2(unsigned short v, unsigned char byte[2])
     byte[1] = (unsigned char) ((v & 0xFF00)>>8);
 }
 
+static unsigned long long B8toU64(unsigned char byte[8])
+{
+	return (unsigned long long)B4toU32(byte) | ((unsigned long long)B4toU32(byte+4) << 32);
+}
+
+static void U64toB8(unsigned long long v, unsigned char byte[8])
+{
+	U32toB4((unsigned int)(v & 0xFFFFFFFF), byte);
+	U32toB4((unsigned int)(v >> 32), byte+4);
+}
+
 // =================================
 FileFS *FileFS_create()
 {
@@ -283,6 +674,7 @@ unsigned char FileFS_mkfs(const char *filename)
 	U32toB4(n, b4);
 	memcpy(block+k, b4, 4); k += 4;
 	// unused block head,此时为0
+	// 引用计数表root(4)和层数(1)，此时为0
 	// other,皆为0
 	
 	if ( BLOCKSIZE != ffs_fwrite(block, 1, BLOCKSIZE, fp) ) {
@@ -512,9 +904,15 @@ unsigned char FileFS_mount(FileFS *ffs, const char *filename)
 	ffs->work_size = 0;
 	ffs->work_blockindex = 1;
 	
+	dcache_clear(ffs);
+	ffs->block_gen++;
+	
 	// move data of fn-j to fn;
 	j2ffs(ffs);
 	
+	// 导入时直接写入尾部但没有commit的block
+	fp_trim(ffs);
+	
 	return 1;
 }
 
@@ -522,6 +920,14 @@ void FileFS_umount(FileFS *ffs)
 {
 	if ( ffs == NULL ) return;
 	
+	// 延迟分配的文件
+	while ( ffs->delay_head != NULL ) {
+		if ( ffs->fp != NULL && ffs->tmp.state == 0 ) FileFS_fflush(ffs, ffs->delay_head);
+		delay_unlink(ffs, ffs->delay_head);
+	}
+	ffs->open_head = NULL;
+	ffs->free.count = 0;
+	
 	if ( ffs->fp != NULL ) {
 		ffs_fclose(ffs->fp);
 		ffs->fp = NULL;
@@ -577,6 +983,7 @@ void FileFS_umount(FileFS *ffs)
 		ffs->tmp.fp_add = NULL;
 	}
 	ffs->tmp.cp_size = ffs->tmp.add_size = 0;
+	ffs->tmp.direct_size = 0;
 	
 	if ( ffs->tmp.pwd != NULL ) {
 		free(ffs->tmp.pwd);
@@ -604,6 +1011,25 @@ unsigned char FileFS_ismount(FileFS *ffs)
 }
 
 // =================================
+/*
+旧的block链文件在以可写方式打开时转换为块映射文件，之后fseek不需要沿着block链移动
+只读打开时不修改文件，仍按block链读取
+*/
+static unsigned char do_fopen_chain2map(FileFS *ffs, FFS_FILE *stream)
+{
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	if ( ! chain2map(ffs, stream) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 0;
+	}
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 0;
+		}
+	}
+	
+	return 1;
+}
 static FFS_FILE *do_fopen_r(FileFS *ffs, char *lastname, unsigned char mode, unsigned int block_head_index)
 {
 	/*
@@ -619,73 +1045,40 @@ static FFS_FILE *do_fopen_r(FileFS *ffs, char *lastname, unsigned char mode, uns
 	*/
 	
 	unsigned char block[BLOCKSIZE];
-	unsigned char state, dir_file;
-	unsigned char b4[4], b2[2];
-	unsigned int stop_blockindex;
-	unsigned short offset;
-	int k;
+	unsigned int dir_blockindex = 0;
+	unsigned short dir_offset = 0;
 	
 	// block_head
 	if ( ! readblock(ffs, block_head_index, block) ) return NULL;
-	// 读取当前block的停止位置
-	memcpy(b4, block+BLOCK_STOP_BLOCKINDEX, 4);
-	stop_blockindex = B4toU32(b4);
-	memcpy(b2, block+BLOCK_OFFSET, 2);
-	offset = B2toU16(b2);
 	
 	// 搜索block，检查是否有名称相同的文件
-	unsigned char *dir_block = NULL;
-	unsigned int dir_blockindex = 0;
-	unsigned short dir_offset = 0;
+	if ( dir_find(ffs, block_head_index, block, lastname, block, &dir_blockindex, &dir_offset) != 1 ) return NULL; // file not exist
+	if ( (block[dir_offset-25] & 0x01) == 0 ) return NULL; // dir
 	
-	int i;
-	unsigned char flag = 0;
-	unsigned int index = block_head_index;
-	char s[BLOCK_NAME_MAXSIZE+1];
-	memset(s, 0, BLOCK_NAME_MAXSIZE+1);
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			if ( index == stop_blockindex && k+1 >= offset ) { // 已搜索到最后
-				return NULL; // file not exist
-			}
-				
-			state = block[k]; k++;
-			dir_file = state & 0x01;
-			if ( dir_file == 0 ) { // dir
-				k += 24;
-				continue;
-			}
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
-			}		
-			
-			dir_block = block;
-			dir_blockindex = index;
-			dir_offset = k + 10; // 位置在尾部
-			
-			flag = 1;
-			break;
-		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return NULL; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, block) ) return NULL; // 到这里说明block有问题
+	// 其它FFS_FILE中延迟分配的数据
+	switch ( delay_flushitem(ffs, dir_blockindex, dir_offset) ) {
+	case 0: break;
+	case 1: 
+		if ( ! readblock(ffs, dir_blockindex, block) ) return NULL;
+		break;
+	default: return NULL;
 	}
-	if ( dir_block == NULL ) return NULL;
-
+	
+	return do_fopen_item(ffs, block, dir_blockindex, dir_offset, block_head_index, mode);
+}
+// 根据找到的目录项创建FFS_FILE，dir_offset为目录项的尾部，mode: 0-"r",3-"r+"
+static FFS_FILE *do_fopen_item(FileFS *ffs, unsigned char *dir_block, unsigned int dir_blockindex, unsigned short dir_offset, 
+	unsigned int block_head_index, unsigned char mode)
+{
+	unsigned char b4[4], b2[2];
 	FFS_FILE *ff;
 	ff = (FFS_FILE*)malloc(sizeof(FFS_FILE));
 	if ( ff == NULL ) return NULL;
+	memset(ff, 0, sizeof(FFS_FILE));
 	
 	ff->mode = mode;
 	
+	ff->dir_head_blockindex = block_head_index;
 	ff->dir_blockindex = dir_blockindex;
 	ff->dir_offset = dir_offset;
 	
@@ -701,6 +1094,20 @@ static FFS_FILE *do_fopen_r(FileFS *ffs, char *lastname, unsigned char mode, uns
 	
 	ff->pos = 0;
 	
+	if ( dir_block[dir_offset-25] & ITEM_MAP ) {
+		if ( ! map_open(ffs, ff, dir_block[dir_offset-25]) ) {
+			free(ff);
+			return NULL;
+		}
+	} else if ( dir_block[dir_offset-25] & ITEM_INLINE ) { // 内容已在目录块中
+		inline_open(ff, dir_block);
+	} else if ( mode == 3 ) { // "r+"，block链文件转换为块映射文件
+		if ( ! do_fopen_chain2map(ffs, ff) ) {
+			free(ff);
+			return NULL;
+		}
+	}
+	
 	return ff;
 }
 // 创建文件item
@@ -754,6 +1161,7 @@ static unsigned char do_fopen_createfile(FileFS *ffs, char *lastname,
 	}
 	
 	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	dcache_drop(ffs, org_start_blockindex, lastname);
 
 	// dir_block未填满
 	if ( org_offset < BLOCKSIZE ) {
@@ -761,7 +1169,7 @@ static unsigned char do_fopen_createfile(FileFS *ffs, char *lastname,
 		k = org_offset;
 		
 		// state
-		block_stop[k] = 1; // file 
+		block_stop[k] = ITEM_FILE | ITEM_INLINE; // file，新文件为空的inline文件
 		k++; 
 		
 		memset(block_stop+k, 0, BLOCK_NAME_MAXSIZE);
@@ -784,6 +1192,10 @@ static unsigned char do_fopen_createfile(FileFS *ffs, char *lastname,
 				}
 			}
 		}
+		if ( ! dirindex_insert(ffs, org_start_blockindex, (unsigned char*)lastname, block_stop_index, new_offset) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
+		}
 			
 		if ( ffs->tmp.state == 1 ) {
 			if ( ! FileFS_commit(ffs) ) {
@@ -806,7 +1218,7 @@ static unsigned char do_fopen_createfile(FileFS *ffs, char *lastname,
 	// gen block_2 for lastname;
 	// block_2->prevblockindex = cur_blockindex;
 	// write;
-	blockindex_2 = genblockindex(ffs);
+	blockindex_2 = genblockindex_near(ffs, org_start_blockindex);
 	if ( blockindex_2 == 0 ) {
 		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 		return 0;
@@ -819,7 +1231,7 @@ static unsigned char do_fopen_createfile(FileFS *ffs, char *lastname,
 	k += 4;
 	
 	// state
-	block_2[k] = 1; // file
+	block_2[k] = ITEM_FILE | ITEM_INLINE; // file，新文件为空的inline文件
 	k++;
 	
 	memset(block_2+k, 0, BLOCK_NAME_MAXSIZE);
@@ -851,6 +1263,10 @@ static unsigned char do_fopen_createfile(FileFS *ffs, char *lastname,
 		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 		return 0;
 	}
+	if ( ! dirindex_insert(ffs, org_start_blockindex, (unsigned char*)lastname, blockindex_2, new_offset) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 0;
+	}
 			
 	if ( ffs->tmp.state == 1 ) {
 		if ( ! FileFS_commit(ffs) ) {
@@ -863,8 +1279,9 @@ static unsigned char do_fopen_createfile(FileFS *ffs, char *lastname,
 		
 	return 1;
 }
-// 删除文件内容
-static unsigned char do_fopen_cleanfilecontent(FileFS *ffs, unsigned char *dir_block, unsigned int dir_blockindex, unsigned short dir_offset)
+// 删除文件内容，恢复为空的inline文件
+static unsigned char do_fopen_cleanfilecontent(FileFS *ffs, unsigned char *dir_block, unsigned int dir_blockindex, unsigned short dir_offset, 
+	unsigned int block_head_index)
 {
 	/*
 	readblock(file->start_blockindex);
@@ -877,36 +1294,65 @@ static unsigned char do_fopen_cleanfilecontent(FileFS *ffs, unsigned char *dir_b
 	*/
 	unsigned char b4[4];
 	unsigned int file_start_blockindex, file_stop_blockindex;
+	unsigned char state = dir_block[dir_offset-25];
+	int n = item_slots(dir_block + dir_offset - 25);
 	
 	memcpy(b4, dir_block+dir_offset-10, 4);
 	file_start_blockindex = B4toU32(b4);
 	memcpy(b4, dir_block+dir_offset-6, 4);
 	file_stop_blockindex = B4toU32(b4);
-	if ( file_start_blockindex == 0 ) return 1; // 文件存在，但无内容
+	if ( (state & ITEM_INLINE) && n == 1 && B2toU16(dir_block+dir_offset-10) == 0 ) return 1; // 文件存在，但无内容
 	
 	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
 	
-	// file block_stop
-	unsigned char file_block_stop[BLOCKSIZE];
-	if ( ! readblock(ffs, file_stop_blockindex, file_block_stop) ) {
-		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-		return 0;
+	if ( state & ITEM_MAP ) { // 块映射文件，释放全部数据块和索引块
+		if ( file_start_blockindex > 0 ) {
+			if ( ! map_free(ffs, file_start_blockindex, (state & ITEM_DEPTH_MASK) >> ITEM_DEPTH_SHIFT) ) {
+				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+				return 0;
+			}
+		}
+		if ( file_stop_blockindex > 0 ) { // 打包的尾部
+			// pack block释放时会修改目录头块，dir_block可能就是头块，需要重新读取
+			if ( ! pack_free(ffs, file_stop_blockindex, B2toU16(dir_block+dir_offset-2)) 
+				|| ! readblock(ffs, dir_blockindex, dir_block) ) {
+				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+				return 0;
+			}
+		}
+	} else if ( (state & ITEM_INLINE) == 0 && file_start_blockindex > 0 ) { // block链文件
+		// file block_stop
+		unsigned char file_block_stop[BLOCKSIZE];
+		if ( ! readblock(ffs, file_stop_blockindex, file_block_stop) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
+		}
+		
+		U32toB4(ffs->tmp.new_unused_blockhead, b4);
+		memcpy(file_block_stop + 4, b4, 4);
+		ffs->tmp.new_unused_blockhead = file_start_blockindex;
+		ffs->tmp.free.count = 0; // 整个block链进入空闲链表
+		
+		if ( ! writeblock(ffs, file_stop_blockindex, file_block_stop) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
+		}
 	}
 	
-	U32toB4(ffs->tmp.new_unused_blockhead, b4);
-	memcpy(file_block_stop + 4, b4, 4);
-	ffs->tmp.new_unused_blockhead = file_start_blockindex;
-	
 	// set dir->start stop offset -> 0
+	dir_block[dir_offset-25] = ITEM_FILE | ITEM_INLINE;
 	memset(dir_block + dir_offset - 10, 0, 10);
-	
 	if ( ! writeblock(ffs, dir_blockindex, dir_block) ) {
 		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 		return 0;
 	}
-	if ( ! writeblock(ffs, file_stop_blockindex, file_block_stop) ) {
-		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-		return 0;
+	
+	// 删除inline文件的后续slot
+	if ( n > 1 ) {
+		if ( ! dir_delslots(ffs, block_head_index, dir_blockindex, dir_offset, n - 1) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
+		}
 	}
 	
 	if ( ffs->tmp.state == 1 ) {
@@ -953,11 +1399,9 @@ static FFS_FILE *do_fopen_w(FileFS *ffs, char *lastname, unsigned char mode, uns
 	*/
 	
 	unsigned char block[BLOCKSIZE];
-	unsigned char state, dir_file;
 	unsigned char b4[4], b2[2];
 	unsigned int stop_blockindex;
 	unsigned short offset;
-	int k;
 	
 	// block_head
 	if ( ! readblock(ffs, block_head_index, block) ) return NULL;
@@ -970,46 +1414,13 @@ static FFS_FILE *do_fopen_w(FileFS *ffs, char *lastname, unsigned char mode, uns
 	unsigned char *dir_block = NULL;
 	unsigned int dir_blockindex = 0;
 	unsigned short dir_offset = 0;
+	int r;
 	
-	int i;
-	unsigned char flag = 0;
-	unsigned int index = block_head_index;
-	char s[BLOCK_NAME_MAXSIZE+1];
-	memset(s, 0, BLOCK_NAME_MAXSIZE+1);
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			if ( index == stop_blockindex && k+1 >= offset ) { // 已搜索到最后
-				flag = 1;
-				break;
-			}
-				
-			state = block[k]; k++;
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
-			}
-			dir_file = state & 0x01;
-			if ( dir_file == 0 ) {
-				return NULL; // same path exist;
-			}
-			
-			dir_block = block;
-			dir_blockindex = index;
-			dir_offset = k + 10; // 位置在尾部
-			
-			flag = 1;
-			break;
-		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return NULL; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, block) ) return NULL; // 到这里说明block有问题
+	r = dir_find(ffs, block_head_index, block, lastname, block, &dir_blockindex, &dir_offset);
+	if ( r < 0 ) return NULL;
+	if ( r == 1 ) {
+		if ( (block[dir_offset-25] & 0x01) == 0 ) return NULL; // same path exist;
+		dir_block = block;
 	}
 	
 	if ( dir_block == NULL ) { // not exist
@@ -1021,7 +1432,7 @@ static FFS_FILE *do_fopen_w(FileFS *ffs, char *lastname, unsigned char mode, uns
 		// dir_block = block;
 	} else {
 		// 删除文件内容
-		if ( ! do_fopen_cleanfilecontent(ffs, dir_block, dir_blockindex, dir_offset) ) {
+		if ( ! do_fopen_cleanfilecontent(ffs, dir_block, dir_blockindex, dir_offset, block_head_index) ) {
 			return NULL;
 		}
 	}
@@ -1029,9 +1440,11 @@ static FFS_FILE *do_fopen_w(FileFS *ffs, char *lastname, unsigned char mode, uns
 	FFS_FILE *ff;
 	ff = (FFS_FILE*)malloc(sizeof(FFS_FILE));
 	if ( ff == NULL ) return NULL;
+	memset(ff, 0, sizeof(FFS_FILE));
 	
 	ff->mode = mode;
 	
+	ff->dir_head_blockindex = block_head_index;
 	ff->dir_blockindex = dir_blockindex;
 	ff->dir_offset = dir_offset;
 	
@@ -1044,6 +1457,8 @@ static FFS_FILE *do_fopen_w(FileFS *ffs, char *lastname, unsigned char mode, uns
 	
 	ff->pos = 0;
 	
+	ff->inl = 1; // 空的inline文件
+	
 	return ff;
 }
 static FFS_FILE *do_fopen_a(FileFS *ffs, char *lastname, unsigned char mode, unsigned int block_head_index)
@@ -1082,11 +1497,9 @@ static FFS_FILE *do_fopen_a(FileFS *ffs, char *lastname, unsigned char mode, uns
 		}
 	*/
 	unsigned char block[BLOCKSIZE];
-	unsigned char state, dir_file;
 	unsigned char b4[4], b2[2];
 	unsigned int stop_blockindex;
 	unsigned short offset;
-	int k;
 	
 	// block_head
 	if ( ! readblock(ffs, block_head_index, block) ) return NULL;
@@ -1099,46 +1512,13 @@ static FFS_FILE *do_fopen_a(FileFS *ffs, char *lastname, unsigned char mode, uns
 	unsigned char *dir_block = NULL;
 	unsigned int dir_blockindex = 0;
 	unsigned short dir_offset = 0;
+	int r;
 	
-	int i;
-	unsigned char flag = 0;
-	unsigned int index = block_head_index;
-	char s[BLOCK_NAME_MAXSIZE+1];
-	memset(s, 0, BLOCK_NAME_MAXSIZE+1);
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			if ( index == stop_blockindex && k+1 >= offset ) { // 已搜索到最后
-				flag = 1;
-				break;
-			}
-				
-			state = block[k]; k++;
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
-			}
-			dir_file = state & 0x01;
-			if ( dir_file == 0 ) {
-				return NULL; // same path exist;
-			}
-			
-			dir_block = block;
-			dir_blockindex = index;
-			dir_offset = k + 10; // 位置在尾部
-			
-			flag = 1;
-			break;
-		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return NULL; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, block) ) return NULL; // 到这里说明block有问题
+	r = dir_find(ffs, block_head_index, block, lastname, block, &dir_blockindex, &dir_offset);
+	if ( r < 0 ) return NULL;
+	if ( r == 1 ) {
+		if ( (block[dir_offset-25] & 0x01) == 0 ) return NULL; // same path exist;
+		dir_block = block;
 	}
 	
 	FFS_FILE *ff;
@@ -1151,9 +1531,11 @@ static FFS_FILE *do_fopen_a(FileFS *ffs, char *lastname, unsigned char mode, uns
 		//dir_block = block;
 		ff = (FFS_FILE*)malloc(sizeof(FFS_FILE));
 		if ( ff == NULL ) return NULL;
+		memset(ff, 0, sizeof(FFS_FILE));
 		
 		ff->mode = mode;
 		
+		ff->dir_head_blockindex = block_head_index;
 		ff->dir_blockindex = dir_blockindex;
 		ff->dir_offset = dir_offset;
 		
@@ -1166,6 +1548,8 @@ static FFS_FILE *do_fopen_a(FileFS *ffs, char *lastname, unsigned char mode, uns
 		
 		ff->pos = 0;
 		
+		ff->inl = 1; // 空的inline文件
+		
 		return ff;
 	}
 	
@@ -1181,28 +1565,50 @@ static FFS_FILE *do_fopen_a(FileFS *ffs, char *lastname, unsigned char mode, uns
 	memcpy(b2, dir_block+dir_offset-2, 2);
 	file_offset = B2toU16(b2);
 	
-	unsigned long long pos = 0;
-	index = file_start_blockindex;
-	while (1) {
-		if ( index == 0 ) break;
+	if ( dir_block[dir_offset-25] & ITEM_MAP ) { // 块映射文件，文件长度保存在root中
+		ff = (FFS_FILE*)malloc(sizeof(FFS_FILE));
+		if ( ff == NULL ) return NULL;
+		memset(ff, 0, sizeof(FFS_FILE));
 		
-		if ( index == file_stop_blockindex ) {
-			pos += file_offset - BLOCK_HEAD;
-			break;
+		ff->mode = mode;
+		ff->dir_head_blockindex = block_head_index;
+		ff->dir_blockindex = dir_blockindex;
+		ff->dir_offset = dir_offset;
+		ff->file_start_blockindex = file_start_blockindex;
+		ff->file_stop_blockindex = file_stop_blockindex;
+		ff->file_offset = file_offset;
+		if ( ! map_open(ffs, ff, dir_block[dir_offset-25]) ) {
+			free(ff);
+			return NULL;
 		}
+		ff->pos = ff->size;
 		
-		if ( ! readblock(ffs, index, block) ) return NULL;
-		pos += (BLOCKSIZE - BLOCK_HEAD);
+		return ff;
+	}
+	
+	if ( dir_block[dir_offset-25] & ITEM_INLINE ) { // inline文件
+		ff = (FFS_FILE*)malloc(sizeof(FFS_FILE));
+		if ( ff == NULL ) return NULL;
+		memset(ff, 0, sizeof(FFS_FILE));
 		
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
+		ff->mode = mode;
+		ff->dir_head_blockindex = block_head_index;
+		ff->dir_blockindex = dir_blockindex;
+		ff->dir_offset = dir_offset;
+		inline_open(ff, dir_block);
+		ff->pos = ff->size;
+		
+		return ff;
 	}
 	
+	// block链文件，转换为块映射文件，转换时得到文件长度
 	ff = (FFS_FILE*)malloc(sizeof(FFS_FILE));
 	if ( ff == NULL ) return NULL;
+	memset(ff, 0, sizeof(FFS_FILE));
 	
 	ff->mode = mode;
 	
+	ff->dir_head_blockindex = block_head_index;
 	ff->dir_blockindex = dir_blockindex;
 	ff->dir_offset = dir_offset;
 	
@@ -1210,24 +1616,57 @@ static FFS_FILE *do_fopen_a(FileFS *ffs, char *lastname, unsigned char mode, uns
 	ff->file_stop_blockindex = file_stop_blockindex;
 	ff->file_offset = file_offset;
 	
-	ff->pos_blockindex = file_stop_blockindex;
-	ff->pos_offset = file_offset;
-	
-	ff->pos = pos;
+	if ( ! do_fopen_chain2map(ffs, ff) ) {
+		free(ff);
+		return NULL;
+	}
+	ff->pos = ff->size;
 	
 	//printf("fopen a, pos_offset:%d\n", ff->pos_offset);
 	
 	return ff;
 }
-FFS_FILE *FileFS_fopen(FileFS *ffs, const char *filename, const char *mode)
+// return: 0-"r",1-"w",2-"a",3-"r+",4-"w+",5-"a+",-1-err
+static int fopen_mode(const char *mode)
 {
-	if ( ffs == NULL ) return NULL;
-	if ( ffs->fp == NULL ) return NULL;
-	if ( filename == NULL ) return NULL;
-	if ( mode == NULL ) return NULL;
+	if ( strcmp(mode, "r") == 0 ) return 0;
+	if ( strcmp(mode, "w") == 0 ) return 1;
+	if ( strcmp(mode, "a") == 0 ) return 2;
+	if ( strcmp(mode, "r+") == 0 ) return 3;
+	if ( strcmp(mode, "w+") == 0 ) return 4;
+	if ( strcmp(mode, "a+") == 0 ) return 5;
+	return -1;
+}
+
+// 打开blockindex目录中的文件lastname
+static FFS_FILE *do_fopen(FileFS *ffs, char *lastname, unsigned char bmode, unsigned int blockindex)
+{
+	FFS_FILE *ff = NULL;
 	
-	/*
-	0 - "r" 	(可读，不可写，必须存在)
+	if ( bmode == 0 || bmode == 3 ) { // "r" "r+"
+		ff = do_fopen_r(ffs, lastname, bmode, blockindex);
+	} else if ( bmode == 1 || bmode == 4 ) { // "w" "w+"
+		ff = do_fopen_w(ffs, lastname, bmode, blockindex);
+	} else if ( bmode == 2 || bmode == 5 ) { // "a" "a+"
+		ff = do_fopen_a(ffs, lastname, bmode, blockindex);
+	}
+	if ( ff != NULL ) {
+		ff->open_next = ffs->open_head;
+		ffs->open_head = ff;
+	}
+	
+	return ff;
+}
+
+FFS_FILE *FileFS_fopen(FileFS *ffs, const char *filename, const char *mode)
+{
+	if ( ffs == NULL ) return NULL;
+	if ( ffs->fp == NULL ) return NULL;
+	if ( filename == NULL ) return NULL;
+	if ( mode == NULL ) return NULL;
+	
+	/*
+	0 - "r" 	(可读，不可写，必须存在)
 		if not exist, return NULL;
 		new FFS_FILE;
 		pos_blockindex = start_blockindex;
@@ -1297,14 +1736,8 @@ FFS_FILE *FileFS_fopen(FileFS *ffs, const char *filename, const char *mode)
 	5 - "a+" 	(可读，可写，无须存在，追加)
 		same 2;
 	*/
-	unsigned char bmode;
-	if ( strcmp(mode, "r") == 0 ) bmode = 0;
-	else if ( strcmp(mode, "w") == 0 ) bmode = 1;
-	else if ( strcmp(mode, "a") == 0 ) bmode = 2;
-	else if ( strcmp(mode, "r+") == 0 ) bmode = 3;
-	else if ( strcmp(mode, "w+") == 0 ) bmode = 4;
-	else if ( strcmp(mode, "a+") == 0 ) bmode = 5;
-	else return NULL;
+	int bmode = fopen_mode(mode);
+	if ( bmode < 0 ) return NULL;
 	
 	int i, start, len = (int)strlen(filename);
 	unsigned int blockindex;
@@ -1350,16 +1783,488 @@ FFS_FILE *FileFS_fopen(FileFS *ffs, const char *filename, const char *mode)
 	if ( strcmp(lastname, ".") == 0 ) return NULL;
 	if ( strcmp(lastname, "..") == 0 ) return NULL;
 	
-	// ============================================
-	if ( bmode == 0 || bmode == 3 ) { // "r" "r+"
-		return do_fopen_r(ffs, lastname, bmode, blockindex);
-	} else if ( bmode == 1 || bmode == 4 ) { // "w" "w+"
-		return do_fopen_w(ffs, lastname, bmode, blockindex);
-	} else if ( bmode == 2 || bmode == 5 ) { // "a" "a+"
-		return do_fopen_a(ffs, lastname, bmode, blockindex);
+	return do_fopen(ffs, lastname, (unsigned char)bmode, blockindex);
+}
+
+// 块映射文件的读取，空洞部分返回0
+static size_t do_fread_map(FileFS *ffs, unsigned char *ptr, size_t wannasize, FFS_FILE *stream)
+{
+	size_t k = 0, n;
+	unsigned long long fileblock;
+	unsigned short off;
+	unsigned int blockindex, next, count;
+	unsigned char block[BLOCKSIZE];
+	unsigned char run[BLOCK_RUNMAX * BLOCKSIZE];
+	int i;
+	
+	while ( k < wannasize && stream->pos < stream->size ) {
+		fileblock = stream->pos / BLOCK_DATASIZE;
+		off = (unsigned short)(stream->pos % BLOCK_DATASIZE);
+		n = BLOCK_DATASIZE - off;
+		if ( n > wannasize - k ) n = wannasize - k;
+		if ( n > stream->size - stream->pos ) n = (size_t)(stream->size - stream->pos);
+		
+		if ( stream->dirty_count > 0 && (i = dirty_search(stream, fileblock)) >= 0 ) { // 延迟分配，尚未写入
+			memcpy(ptr + k, stream->dirty[i].data + off, n);
+			k += n;
+			stream->pos += n;
+			continue;
+		}
+		
+		if ( stream->file_stop_blockindex > 0 && fileblock == (stream->size - 1) / BLOCK_DATASIZE ) { // 打包的尾部
+			if ( ! readblock(ffs, stream->file_stop_blockindex, block) ) return k;
+			memcpy(ptr + k, block + stream->file_offset + 2 + off, n);
+			k += n;
+			stream->pos += n;
+			continue;
+		}
+		
+		if ( ! map_get(ffs, stream, fileblock, &blockindex) ) return k;
+		if ( blockindex == 0 ) { // 空洞
+			memset(ptr + k, 0, n);
+		} else if ( off == 0 && stream->dirty_count == 0 && wannasize - k >= 2 * BLOCK_DATASIZE 
+			&& stream->size - stream->pos >= 2 * BLOCK_DATASIZE ) {
+			// 完整的block在container中连续时一次读取
+			count = 1;
+			while ( count < BLOCK_RUNMAX && wannasize - k >= (size_t)(count + 1) * BLOCK_DATASIZE 
+				&& stream->size - stream->pos >= (unsigned long long)(count + 1) * BLOCK_DATASIZE ) {
+				if ( ! map_get(ffs, stream, fileblock + count, &next) ) return k;
+				if ( next != blockindex + count ) break;
+				count++;
+			}
+			if ( ! readblockrun(ffs, blockindex, count, run) ) return k;
+			for (i=0; i<(int)count; i++) memcpy(ptr + k + (size_t)i * BLOCK_DATASIZE, run + i * BLOCKSIZE + BLOCK_HEAD, BLOCK_DATASIZE);
+			n = (size_t)count * BLOCK_DATASIZE;
+		} else {
+			if ( ! readblock(ffs, blockindex, block) ) return k;
+			memcpy(ptr + k, block + BLOCK_HEAD + off, n);
+		}
+		k += n;
+		stream->pos += n;
+	}
+	
+	return k;
+}
+
+// 块映射文件的写入，写入空洞时才分配block
+static size_t do_fwrite_map(FileFS *ffs, const unsigned char *ptr, size_t wannasize, FFS_FILE *stream)
+{
+	size_t k = 0, n;
+	unsigned long long fileblock;
+	unsigned short off;
+	unsigned int blockindex, next, count, limit, i;
+	unsigned char block[BLOCKSIZE];
+	unsigned char run[BLOCK_RUNMAX * BLOCKSIZE];
+	unsigned int org_root = stream->file_start_blockindex;
+	unsigned char org_depth = stream->map_depth;
+	unsigned long long org_size = stream->size;
+	unsigned int org_pack = stream->file_stop_blockindex;
+	unsigned short org_pack_offset = stream->file_offset;
+	
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	
+	// 打包的尾部先恢复为普通的block
+	unsigned char ok = map_unpack(ffs, stream);
+	while ( ok && k < wannasize ) {
+		fileblock = stream->pos / BLOCK_DATASIZE;
+		off = (unsigned short)(stream->pos % BLOCK_DATASIZE);
+		n = BLOCK_DATASIZE - off;
+		if ( n > wannasize - k ) n = wannasize - k;
+		
+		if ( ! map_getw(ffs, stream, fileblock, &blockindex) ) break;
+		if ( blockindex == 0 && off == 0 && wannasize - k >= 2 * BLOCK_DATASIZE && stream->file_start_blockindex != 0 ) {
+			// 连续的空洞写入完整的block: 一次分配连续的block，一次写入，同一个叶子索引块只写入一次
+			limit = BLOCK_RUNMAX;
+			if ( (wannasize - k) / BLOCK_DATASIZE < limit ) limit = (unsigned int)((wannasize - k) / BLOCK_DATASIZE);
+			if ( MAP_ITEM_MAXCOUNT - fileblock % MAP_ITEM_MAXCOUNT < limit ) limit = (unsigned int)(MAP_ITEM_MAXCOUNT - fileblock % MAP_ITEM_MAXCOUNT);
+			for (count=1; count<limit; count++) {
+				if ( ! map_get(ffs, stream, fileblock + count, &next) ) break;
+				if ( next != 0 ) break;
+			}
+			blockindex = genblockrun(ffs, count, &count);
+			if ( blockindex == 0 ) break;
+			memset(run, 0, count * BLOCKSIZE);
+			for (i=0; i<count; i++) memcpy(run + i * BLOCKSIZE + BLOCK_HEAD, ptr + k + (size_t)i * BLOCK_DATASIZE, BLOCK_DATASIZE);
+			if ( ! writeblockrun(ffs, blockindex, count, run) ) break;
+			if ( ! map_setrun(ffs, stream, fileblock, blockindex, count) ) break;
+			n = (size_t)count * BLOCK_DATASIZE;
+		} else if ( blockindex == 0 ) {
+			// 文件的第一个block放在目录附近
+			if ( stream->file_start_blockindex == 0 ) blockindex = genblockindex_near(ffs, stream->dir_blockindex);
+			else blockindex = genblockindex(ffs);
+			if ( blockindex == 0 ) break;
+			memset(block, 0, BLOCKSIZE);
+			memcpy(block + BLOCK_HEAD + off, ptr + k, n);
+			if ( ! writeblock(ffs, blockindex, block) ) break;
+			if ( ! map_set(ffs, stream, fileblock, blockindex) ) break;
+		} else {
+			// depth=0时root的头部保存了文件长度，因此始终需要先读出block
+			if ( ! readblock(ffs, blockindex, block) ) break;
+			memcpy(block + BLOCK_HEAD + off, ptr + k, n);
+			if ( ! writeblock(ffs, blockindex, block) ) break;
+		}
+		k += n;
+		stream->pos += n;
+		if ( stream->pos > stream->size ) stream->size = stream->pos;
+	}
+	
+	if ( ! ok || k < wannasize ) {
+		if ( ffs->tmp.state == 1 ) {
+			tmpstop(ffs);
+			stream->file_start_blockindex = org_root;
+			stream->map_depth = org_depth;
+			stream->size = org_size;
+			stream->file_stop_blockindex = org_pack;
+			stream->file_offset = org_pack_offset;
+			stream->pos -= k;
+			stream->leaf_blockindex = 0;
+		}
+		return 0;
+	}
+	
+	if ( stream->size != org_size || stream->file_start_blockindex != org_root || stream->map_depth != org_depth ) {
+		if ( ! map_sync(ffs, stream) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
+		}
+	}
+	
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 0;
+		}
+	}
+	return k;
+}
+
+// 压缩文件的读取，每次解压一个extent
+static size_t do_fread_compress(FileFS *ffs, unsigned char *ptr, size_t wannasize, FFS_FILE *stream)
+{
+	size_t k = 0, n;
+	unsigned int off;
+	
+	while ( k < wannasize && stream->pos < stream->size ) {
+		off = (unsigned int)(stream->pos % CMP_EXTSIZE);
+		n = CMP_EXTSIZE - off;
+		if ( n > wannasize - k ) n = wannasize - k;
+		if ( n > stream->size - stream->pos ) n = (size_t)(stream->size - stream->pos);
+		
+		if ( ! cmp_load(ffs, stream, stream->pos / CMP_EXTSIZE) ) return k;
+		memcpy(ptr + k, stream->cmp_data + off, n);
+		k += n;
+		stream->pos += n;
+	}
+	
+	return k;
+}
+
+// 压缩文件的写入，修改缓存的extent后重新压缩写入
+static size_t do_fwrite_compress(FileFS *ffs, const unsigned char *ptr, size_t wannasize, FFS_FILE *stream)
+{
+	size_t k = 0, n;
+	unsigned long long extent, last;
+	unsigned int off;
+	unsigned int org_root = stream->file_start_blockindex;
+	unsigned char org_depth = stream->map_depth;
+	unsigned long long org_size = stream->size;
+	
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	
+	while ( k < wannasize ) {
+		extent = stream->pos / CMP_EXTSIZE;
+		// 文件变长，原来最后一个不完整的extent先按完整长度重新写入
+		if ( stream->size % CMP_EXTSIZE != 0 && extent > stream->size / CMP_EXTSIZE ) {
+			last = stream->size / CMP_EXTSIZE;
+			if ( ! cmp_load(ffs, stream, last) ) break;
+			stream->size = (last + 1) * CMP_EXTSIZE;
+			if ( ! cmp_store(ffs, stream) ) break;
+		}
+		
+		if ( ! cmp_load(ffs, stream, extent) ) break;
+		off = (unsigned int)(stream->pos % CMP_EXTSIZE);
+		n = CMP_EXTSIZE - off;
+		if ( n > wannasize - k ) n = wannasize - k;
+		memcpy(stream->cmp_data + off, ptr + k, n);
+		k += n;
+		stream->pos += n;
+		if ( stream->pos > stream->size ) stream->size = stream->pos;
+		if ( ! cmp_store(ffs, stream) ) break;
+	}
+	
+	if ( k < wannasize || ! map_sync(ffs, stream) ) {
+		if ( ffs->tmp.state == 1 ) {
+			tmpstop(ffs);
+			stream->file_start_blockindex = org_root;
+			stream->map_depth = org_depth;
+			stream->size = org_size;
+			stream->pos -= k;
+			stream->leaf_blockindex = 0;
+			stream->cmp_valid = 0;
+		}
+		return 0;
+	}
+	
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 0;
+		}
+	}
+	return k;
+}
+
+// inline文件的写入，超出INLINE_MAXSIZE时先转换为块映射文件
+static size_t do_fwrite_inline(FileFS *ffs, const unsigned char *ptr, size_t wannasize, FFS_FILE *stream)
+{
+	unsigned char org_data[INLINE_MAXSIZE];
+	unsigned int org_size = (unsigned int)stream->size;
+	unsigned int org_dir_blockindex = stream->dir_blockindex;
+	unsigned short org_dir_offset = stream->dir_offset;
+	size_t k;
+	
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	
+	if ( stream->pos > INLINE_MAXSIZE || wannasize > INLINE_MAXSIZE - stream->pos ) {
+		if ( ! inline2map(ffs, stream) ) {
+			if ( ffs->tmp.state == 1 ) {
+				tmpstop(ffs);
+				stream->inl = 1;
+				stream->map = 0;
+				stream->file_start_blockindex = 0;
+			}
+			return 0;
+		}
+		// do_fwrite_map在同一个事务中写入并commit
+		k = do_fwrite_map(ffs, ptr, wannasize, stream);
+		if ( k == 0 && ffs->tmp.state == 0 ) { // 已回滚
+			stream->inl = 1;
+			stream->map = 0;
+			stream->file_start_blockindex = 0;
+			stream->dir_blockindex = org_dir_blockindex;
+			stream->dir_offset = org_dir_offset;
+		}
+		return k;
+	}
+	
+	memcpy(org_data, stream->inl_data, INLINE_MAXSIZE);
+	memcpy(stream->inl_data + stream->pos, ptr, wannasize);
+	stream->pos += wannasize;
+	if ( stream->pos > stream->size ) stream->size = stream->pos;
+	
+	if ( ! inline_sync(ffs, stream, org_size) ) {
+		if ( ffs->tmp.state == 1 ) {
+			tmpstop(ffs);
+			memcpy(stream->inl_data, org_data, INLINE_MAXSIZE);
+			stream->size = org_size;
+			stream->pos -= wannasize;
+			stream->dir_blockindex = org_dir_blockindex;
+			stream->dir_offset = org_dir_offset;
+		}
+		return 0;
 	}
 	
-	return NULL;
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 0;
+		}
+	}
+	return wannasize;
+}
+
+// 延迟分配: 二分查找fileblock，return: 找到时为下标，否则为-(插入位置)-1
+static int dirty_search(FFS_FILE *stream, unsigned long long fileblock)
+{
+	int lo = 0, hi = stream->dirty_count - 1, mid;
+	
+	// 顺序写入时总是在尾部
+	if ( stream->dirty_count > 0 && stream->dirty[hi].fileblock < fileblock ) return -stream->dirty_count - 1;
+	while ( lo <= hi ) {
+		mid = (lo + hi) / 2;
+		if ( stream->dirty[mid].fileblock == fileblock ) return mid;
+		if ( stream->dirty[mid].fileblock < fileblock ) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -lo - 1;
+}
+
+// 取得fileblock在内存中的block，不存在时读入原来的内容
+static DirtyBlock *dirty_get(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int blockindex;
+	DirtyBlock *d;
+	int i, n;
+	
+	i = dirty_search(stream, fileblock);
+	if ( i >= 0 ) return stream->dirty + i;
+	i = -i - 1;
+	
+	if ( ! map_get(ffs, stream, fileblock, &blockindex) ) return NULL;
+	if ( blockindex == 0 ) {
+		memset(block, 0, BLOCKSIZE);
+	} else {
+		if ( ! readblock(ffs, blockindex, block) ) return NULL;
+	}
+	
+	if ( stream->dirty_count >= stream->dirty_size ) {
+		n = stream->dirty_size == 0 ? 16 : stream->dirty_size * 2;
+		d = (DirtyBlock*)realloc(stream->dirty, n * sizeof(DirtyBlock));
+		if ( d == NULL ) return NULL;
+		stream->dirty = d;
+		stream->dirty_size = n;
+	}
+	memmove(stream->dirty + i + 1, stream->dirty + i, (stream->dirty_count - i) * sizeof(DirtyBlock));
+	stream->dirty_count++;
+	
+	d = stream->dirty + i;
+	d->fileblock = fileblock;
+	d->blockindex = blockindex;
+	memcpy(d->data, block + BLOCK_HEAD, BLOCK_DATASIZE);
+	
+	return d;
+}
+
+// 延迟分配的写入，只写入内存
+static size_t do_fwrite_delay(FileFS *ffs, const unsigned char *ptr, size_t wannasize, FFS_FILE *stream)
+{
+	size_t k = 0, n;
+	unsigned short off;
+	DirtyBlock *d;
+	
+	while ( k < wannasize ) {
+		off = (unsigned short)(stream->pos % BLOCK_DATASIZE);
+		n = BLOCK_DATASIZE - off;
+		if ( n > wannasize - k ) n = wannasize - k;
+		
+		d = dirty_get(ffs, stream, stream->pos / BLOCK_DATASIZE);
+		if ( d == NULL ) break;
+		memcpy(d->data + off, ptr + k, n);
+		k += n;
+		stream->pos += n;
+		if ( stream->pos > stream->size ) stream->size = stream->pos;
+		
+		if ( stream->dirty_count >= DELAY_MAXBLOCKS ) {
+			if ( ! FileFS_fflush(ffs, stream) ) break;
+		}
+	}
+	
+	return k;
+}
+
+// 将内存中的block写入，新的block一次分配，按文件顺序连续存放，在事务中调用
+static unsigned char do_fflush_delay(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int start = 0, count = 0, n = 0, blockindex;
+	DirtyBlock *d;
+	int i;
+	
+	if ( stream->dirty_count == 0 ) return 1;
+	
+	for (i=0; i<stream->dirty_count; i++) {
+		if ( stream->dirty[i].blockindex == 0 ) count++;
+	}
+	
+	for (i=0; i<stream->dirty_count; i++) {
+		d = stream->dirty + i;
+		if ( d->blockindex == 0 ) {
+			if ( n == 0 ) { // 剩余的新block尽量一次分配
+				start = genblockrun(ffs, count, &n);
+				if ( start == 0 ) return 0;
+			}
+			blockindex = start;
+			start++;
+			n--;
+			count--;
+			memset(block, 0, BLOCK_HEAD);
+			memcpy(block + BLOCK_HEAD, d->data, BLOCK_DATASIZE);
+			if ( ! writeblock(ffs, blockindex, block) ) return 0;
+			if ( ! map_set(ffs, stream, d->fileblock, blockindex) ) return 0;
+		} else {
+			// 共享的block先复制(reflink)
+			if ( ! map_getw(ffs, stream, d->fileblock, &blockindex) ) return 0;
+			if ( blockindex == 0 ) return 0;
+			// depth=0时root的头部保存了文件长度
+			if ( blockindex == stream->file_start_blockindex ) {
+				if ( ! readblock(ffs, blockindex, block) ) return 0;
+			} else {
+				memset(block, 0, BLOCK_HEAD);
+			}
+			memcpy(block + BLOCK_HEAD, d->data, BLOCK_DATASIZE);
+			if ( ! writeblock(ffs, blockindex, block) ) return 0;
+		}
+	}
+	
+	if ( ! map_sync(ffs, stream) ) return 0;
+	
+	stream->dirty_count = 0;
+	return 1;
+}
+
+/*
+目录项(dir_blockindex, 尾部dir_offset)的文件有延迟分配的数据时先写入，直接读取文件block的操作(复制、再次打开)才能看到
+在事务之外或手动事务中调用，return: 0-没有需要写入的数据,1-已写入(目录项可能已改变，需要重新读取),-1-err
+*/
+static int delay_flushitem(FileFS *ffs, unsigned int dir_blockindex, unsigned short dir_offset)
+{
+	FFS_FILE *ff;
+	
+	for (ff=ffs->delay_head; ff!=NULL; ff=ff->delay_next) {
+		if ( ff->dir_blockindex == dir_blockindex && ff->dir_offset == dir_offset ) {
+			if ( ff->dirty_count == 0 ) return 0;
+			return FileFS_fflush(ffs, ff) ? 1 : -1;
+		}
+	}
+	return 0;
+}
+
+// 从FileFS的延迟分配链表中移除
+static void delay_unlink(FileFS *ffs, FFS_FILE *stream)
+{
+	FFS_FILE **p;
+	
+	for (p=&ffs->delay_head; *p!=NULL; p=&(*p)->delay_next) {
+		if ( *p == stream ) {
+			*p = stream->delay_next;
+			break;
+		}
+	}
+	stream->delay_next = NULL;
+	stream->delay = 0;
+	if ( stream->dirty != NULL ) free(stream->dirty);
+	stream->dirty = NULL;
+	stream->dirty_count = stream->dirty_size = 0;
+}
+
+// rollback后丢弃内存中的block，重新读取目录项
+static void delay_reload(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned char state;
+	
+	stream->dirty_count = 0;
+	stream->leaf_blockindex = 0;
+	if ( ! readblock(ffs, stream->dir_blockindex, block) ) return;
+	state = block[stream->dir_offset-25];
+	stream->file_start_blockindex = B4toU32(block + stream->dir_offset-10);
+	stream->file_stop_blockindex = B4toU32(block + stream->dir_offset-6);
+	stream->file_offset = B2toU16(block + stream->dir_offset-2);
+	if ( state & ITEM_MAP ) {
+		map_open(ffs, stream, state);
+		if ( stream->file_stop_blockindex > 0 ) delay_unlink(ffs, stream); // 尾部的恢复也被撤销了
+		return;
+	}
+	
+	// 转换为块映射文件也被撤销了
+	delay_unlink(ffs, stream);
+	if ( state & ITEM_INLINE ) {
+		inline_open(stream, block);
+		stream->pos = 0;
+		return;
+	}
+	stream->map = 0;
+	stream->pos_blockindex = stream->file_start_blockindex;
+	stream->pos_offset = BLOCK_HEAD;
+	stream->pos = 0;
 }
 
 size_t FileFS_fread(FileFS *ffs, void *ptr, size_t size, size_t nmemb, FFS_FILE *stream)
@@ -1368,11 +2273,25 @@ size_t FileFS_fread(FileFS *ffs, void *ptr, size_t size, size_t nmemb, FFS_FILE
 	if ( ffs->fp == NULL ) return 0;
 	if ( stream == NULL ) return 0;
 	if ( stream->mode == 1 || stream->mode == 2 ) return 0; // "w","a"不可读
+	if ( nmemb > 0 && size > (size_t)-1 / nmemb ) return 0; // size*nmemb溢出
+	
+	if ( stream->map ) {
+		if ( stream->compress ) return do_fread_compress(ffs, (unsigned char*)ptr, size * nmemb, stream);
+		return do_fread_map(ffs, (unsigned char*)ptr, size * nmemb, stream);
+	}
+	if ( stream->inl ) {
+		if ( stream->pos >= stream->size ) return 0;
+		size_t n = size * nmemb;
+		if ( n > stream->size - stream->pos ) n = (size_t)(stream->size - stream->pos);
+		memcpy(ptr, stream->inl_data + stream->pos, n);
+		stream->pos += n;
+		return n;
+	}
 	
 	if ( stream->pos_blockindex == 0 ) return 0; // 空文件
 	
-	int wannasize = (int)(size * nmemb);
-	int k = 0, n;
+	size_t wannasize = size * nmemb;
+	size_t k = 0, n;
 	unsigned char block[BLOCKSIZE];
 	unsigned int blockindex = stream->pos_blockindex, nextindex;
 	unsigned char b4[4];
@@ -1389,8 +2308,8 @@ size_t FileFS_fread(FileFS *ffs, void *ptr, size_t size, size_t nmemb, FFS_FILE
 			// printf("fread start stop blockindex, offset:%d %d %d\n", 
 			//	stream->file_start_blockindex, stream->file_stop_blockindex, stream->file_offset);
 			
+			if ( stream->file_offset <= stream->pos_offset ) return k;
 			n = stream->file_offset - stream->pos_offset;
-			if ( n <= 0 ) return k;
 			if ( wannasize - k < n ) n = wannasize - k;
 			memcpy((unsigned char*)ptr + k, block + stream->pos_offset, n);
 			k += n;
@@ -1428,12 +2347,24 @@ size_t FileFS_fwrite(FileFS *ffs, const void *ptr, size_t size, size_t nmemb, FF
 	if ( ffs->fp == NULL ) return 0;
 	if ( stream == NULL ) return 0;
 	if ( stream->mode == 0 ) return 0; // "r"不可写
+	if ( nmemb > 0 && size > (size_t)-1 / nmemb ) return 0; // size*nmemb溢出
+	
+	if ( stream->map ) {
+		if ( size * nmemb == 0 ) return 0;
+		if ( stream->compress ) return do_fwrite_compress(ffs, (const unsigned char*)ptr, size * nmemb, stream);
+		if ( stream->delay ) return do_fwrite_delay(ffs, (const unsigned char*)ptr, size * nmemb, stream);
+		return do_fwrite_map(ffs, (const unsigned char*)ptr, size * nmemb, stream);
+	}
+	if ( stream->inl ) {
+		if ( size * nmemb == 0 ) return 0;
+		return do_fwrite_inline(ffs, (const unsigned char*)ptr, size * nmemb, stream);
+	}
 	
 	//printf("mode:%d\n", stream->mode);
 	
-	int wannasize = (int)(size * nmemb);
-	int k, cut = 0, n;
-	if ( wannasize <= 0 ) return 0;
+	size_t wannasize = size * nmemb;
+	size_t k, cut = 0, n;
+	if ( wannasize == 0 ) return 0;
 	
 	unsigned char new_block[BLOCKSIZE];
 	unsigned char pos_block[BLOCKSIZE];
@@ -1445,8 +2376,8 @@ size_t FileFS_fwrite(FileFS *ffs, const void *ptr, size_t size, size_t nmemb, FF
 	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
 	
 	unsigned char hasnewblock = 0;
-	if ( stream->pos_blockindex == 0 ) { // 空文件
-		new_blockindex = genblockindex(ffs);
+	if ( stream->pos_blockindex == 0 ) { // 空文件，第一个block放在目录附近
+		new_blockindex = genblockindex_near(ffs, stream->dir_blockindex);
 		if ( new_blockindex == 0 ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 			return 0;
@@ -1522,12 +2453,12 @@ size_t FileFS_fwrite(FileFS *ffs, const void *ptr, size_t size, size_t nmemb, FF
 					if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 					return 0;
 				}
+				stream->pos_blockindex = next_blockindex;
+				stream->pos_offset = BLOCK_HEAD;
+				
 				// get next_blockindex;
 				memcpy(b4, pos_block+4, 4);
 				next_blockindex = B4toU32(b4);
-				
-				stream->pos_blockindex = next_blockindex;
-				stream->pos_offset = BLOCK_HEAD;
 			}
 		}
 		
@@ -1614,967 +2545,880 @@ size_t FileFS_fwrite(FileFS *ffs, const void *ptr, size_t size, size_t nmemb, FF
 	return 0;
 }
 
-void FileFS_fclose(FileFS *ffs, FFS_FILE *stream)
+// 在offset处读取，之后恢复文件的当前位置
+size_t FileFS_pread(FileFS *ffs, void *ptr, size_t size, size_t nmemb, FFS_FILE *stream, unsigned long long offset)
 {
-	if ( ffs == NULL ) return ;
-	if ( ffs->fp == NULL ) return;
-	if ( stream == NULL ) return;
+	if ( stream == NULL ) return 0;
+	if ( offset > 0x7FFFFFFFFFFFFFFFULL ) return 0;
 	
-	free(stream);
+	unsigned long long org_pos = stream->pos;
+	unsigned int org_pos_blockindex = stream->pos_blockindex;
+	unsigned short org_pos_offset = stream->pos_offset;
+	size_t n = 0;
+	
+	// 块映射文件和inline文件直接定位，block链文件需要沿block链移动
+	if ( FileFS_fseek(ffs, stream, (long long)offset, FFS_SEEK_SET) ) n = FileFS_fread(ffs, ptr, size, nmemb, stream);
+	stream->pos = org_pos;
+	stream->pos_blockindex = org_pos_blockindex;
+	stream->pos_offset = org_pos_offset;
+	
+	return n;
 }
 
-unsigned char FileFS_fseek(FileFS *ffs, FFS_FILE *stream, long long offset, int whence)
+// 在offset处写入，之后恢复文件的当前位置
+size_t FileFS_pwrite(FileFS *ffs, const void *ptr, size_t size, size_t nmemb, FFS_FILE *stream, unsigned long long offset)
+{
+	if ( stream == NULL ) return 0;
+	if ( offset > 0x7FFFFFFFFFFFFFFFULL ) return 0;
+	
+	unsigned long long org_pos = stream->pos;
+	unsigned int org_pos_blockindex = stream->pos_blockindex;
+	unsigned short org_pos_offset = stream->pos_offset;
+	size_t n = 0;
+	
+	if ( FileFS_fseek(ffs, stream, (long long)offset, FFS_SEEK_SET) ) n = FileFS_fwrite(ffs, ptr, size, nmemb, stream);
+	stream->pos = org_pos;
+	if ( ! stream->map && ! stream->inl ) { // 仍是block链文件时恢复链上的位置，已转换为块映射时不再使用
+		stream->pos_blockindex = org_pos_blockindex;
+		stream->pos_offset = org_pos_offset;
+	}
+	
+	return n;
+}
+
+// 依次读取到多个缓冲区，读取的长度不足时停止
+size_t FileFS_readv(FileFS *ffs, FFS_FILE *stream, const FFS_iovec *iov, int iovcnt)
+{
+	size_t total = 0, n;
+	int i;
+	
+	if ( iov == NULL ) return 0;
+	for (i=0; i<iovcnt; i++) {
+		if ( iov[i].iov_len == 0 ) continue;
+		n = FileFS_fread(ffs, iov[i].iov_base, 1, iov[i].iov_len, stream);
+		total += n;
+		if ( n < iov[i].iov_len ) break;
+	}
+	
+	return total;
+}
+
+// 依次写入多个缓冲区，全部在同一个事务中，只commit一次，失败时全部撤销
+size_t FileFS_writev(FileFS *ffs, FFS_FILE *stream, const FFS_iovec *iov, int iovcnt)
 {
 	if ( ffs == NULL ) return 0;
 	if ( ffs->fp == NULL ) return 0;
 	if ( stream == NULL ) return 0;
+	if ( iov == NULL ) return 0;
+	if ( stream->mode == 0 ) return 0; // "r"不可写
 	
-	if ( stream->pos_blockindex == 0 ) return 0;
+	size_t total = 0;
+	int i;
 	
-	unsigned char block[BLOCKSIZE];
-	unsigned char b4[4];
-	unsigned int blockindex, next_blockindex, prev_blockindex;
-	unsigned short blocksize, pos_offset;
-	long long new_offset;
-	unsigned long long pos;
-	unsigned int index;
+	// 已在手动事务中或延迟分配时，每次写入都不会commit，直接依次写入
+	if ( ffs->tmp.state != 0 || stream->delay ) {
+		for (i=0; i<iovcnt; i++) {
+			if ( iov[i].iov_len == 0 ) continue;
+			if ( FileFS_fwrite(ffs, iov[i].iov_base, 1, iov[i].iov_len, stream) != iov[i].iov_len ) return total;
+			total += iov[i].iov_len;
+		}
+		return total;
+	}
 	
-	if ( whence == FFS_SEEK_CUR ) {
-		if ( offset == 0 ) return 1;
-		
-		if ( offset > 0 ) { // 向文件尾移动
-			blockindex = stream->pos_blockindex;
-			new_offset = offset;
-			pos_offset = stream->pos_offset;
-			while (1) {
-				if ( blockindex == stream->file_stop_blockindex ) blocksize = stream->file_offset;
-				else blocksize = BLOCKSIZE;
-				
-				if ( blockindex == stream->file_stop_blockindex ) {
-					if ( blocksize-pos_offset >= new_offset ) {
-						stream->pos_offset += (unsigned short)new_offset;
-						stream->pos += new_offset;
-					} else {
-						stream->pos_offset += (blocksize-pos_offset);
-						stream->pos += (blocksize-pos_offset);
-					}
-					return 1;
-				}
-				
-				stream->pos_offset = BLOCKSIZE;
-				stream->pos += BLOCKSIZE - pos_offset;
-				new_offset -= (BLOCKSIZE - pos_offset);
-				
-				if ( ! readblock(ffs, blockindex, block) ) return 1;
-				memcpy(b4, block+8, 4);
-				next_blockindex = B4toU32(b4);
-				if ( next_blockindex == 0 ) return 1;
-				blockindex = next_blockindex;
-				
-				stream->pos_blockindex = blockindex;
-				pos_offset = BLOCK_HEAD;
-			}
-			return 0;
-		} else { // 向文件头移动
-			blockindex = stream->pos_blockindex;
-			new_offset = -offset;
-			pos_offset = stream->pos_offset;
-			while (1) {
-				if ( pos_offset - BLOCK_HEAD >= new_offset ) {
-					stream->pos_offset -= (unsigned short)new_offset;
-					stream->pos -= new_offset;
-					return 1;
-				} 
-
-				stream->pos_offset -= pos_offset;
-				stream->pos -= pos_offset;
-			
-				new_offset -= pos_offset;
-				pos_offset = BLOCKSIZE;
-				
-				if ( ! readblock(ffs, blockindex, block) ) return 1;
-				memcpy(b4, block+4, 4);
-				prev_blockindex = B4toU32(b4);
-				if ( prev_blockindex == 0 ) return 1;
-				blockindex = prev_blockindex;
-				
-				stream->pos_blockindex = blockindex;
-			}
-			return 0;
-		}
+	FFS_FILE org;
+	memcpy(&org, stream, sizeof(FFS_FILE));
+	
+	// 作为手动事务，其中的写入不会各自commit
+	if ( ! tmpstart(ffs, 2) ) return 0;
+	for (i=0; i<iovcnt; i++) {
+		if ( iov[i].iov_len == 0 ) continue;
+		if ( FileFS_fwrite(ffs, iov[i].iov_base, 1, iov[i].iov_len, stream) != iov[i].iov_len ) break;
+		total += iov[i].iov_len;
+	}
+	if ( i < iovcnt ) {
+		tmpstop(ffs);
+		// 恢复打开时的状态，解压缓存可能已经分配
+		org.cmp_data = stream->cmp_data;
+		org.cmp_valid = 0;
+		memcpy(stream, &org, sizeof(FFS_FILE));
 		return 0;
 	}
+	if ( ! FileFS_commit(ffs) ) return 0;
 	
-	if ( whence == FFS_SEEK_END ) {
-		pos = stream->pos - (stream->pos_offset - BLOCK_HEAD);
-		index = stream->pos_blockindex;
-		while (1) {
-			if ( index == stream->file_stop_blockindex ) {
-				pos += stream->file_offset - BLOCK_HEAD;
-				break;
-			}
-		
-			if ( ! readblock(ffs, index, block) ) return 0;
-			pos += (BLOCKSIZE - BLOCK_HEAD);
-		
-			memcpy(b4, block+4, 4);
-			index = B4toU32(b4);
-		}
-		// =======================
-		stream->pos_blockindex = stream->file_stop_blockindex;
-		stream->pos_offset = stream->file_offset;
-		stream->pos = pos;
-		// =======================
-		if ( offset == 0 ) return 1;
-		
-		if ( offset < 0 ) { // 向文件头移动
-			blockindex = stream->pos_blockindex;
-			new_offset = -offset;
-			pos_offset = stream->pos_offset;
-			while (1) {
-				if ( pos_offset - BLOCK_HEAD >= new_offset ) {
-					stream->pos_offset -= (unsigned short)new_offset;
-					stream->pos -= new_offset;
-					return 1;
-				} 
+	return total;
+}
 
-				stream->pos_offset -= pos_offset;
-				stream->pos -= pos_offset;
-			
-				new_offset -= pos_offset;
-				pos_offset = BLOCKSIZE;
-				
-				if ( ! readblock(ffs, blockindex, block) ) return 1;
-				memcpy(b4, block+4, 4);
-				prev_blockindex = B4toU32(b4);
-				if ( prev_blockindex == 0 ) return 1;
-				blockindex = prev_blockindex;
-				
-				stream->pos_blockindex = blockindex;
-			}
-			return 0;
+// 延迟分配的数据写入失败时返回0，stream仍然会被关闭
+// return: 0-err,1-ok
+unsigned char FileFS_fclose(FileFS *ffs, FFS_FILE *stream)
+{
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	if ( stream == NULL ) return 0;
+	
+	unsigned char ok = 1;
+	if ( stream->delay ) {
+		ok = FileFS_fflush(ffs, stream);
+		delay_unlink(ffs, stream);
+	}
+	
+	// 尾部打包，失败时保持原样即可
+	if ( ffs->tailpack && stream->map && ! stream->compress && stream->mode != 0 && stream->file_stop_blockindex == 0 
+		&& stream->size % BLOCK_DATASIZE > 0 && stream->size % BLOCK_DATASIZE <= PACK_MAXSIZE ) {
+		if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+		if ( ! map_pack(ffs, stream) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		} else if ( ffs->tmp.state == 1 ) {
+			FileFS_commit(ffs);
 		}
-		return 0;
 	}
 	
-	if ( whence == FFS_SEEK_SET ) {
-		stream->pos_blockindex = stream->file_start_blockindex;
-		stream->pos_offset = BLOCK_HEAD;
-		stream->pos = 0;
-		
-		if ( offset == 0 ) return 1;
-		
-		if ( offset > 0 ) { // 向文件尾移动
-			blockindex = stream->pos_blockindex;
-			new_offset = offset;
-			pos_offset = stream->pos_offset;
-			while (1) {
-				if ( blockindex == stream->file_stop_blockindex ) blocksize = stream->file_offset;
-				else blocksize = BLOCKSIZE;
-				
-				if ( blockindex == stream->file_stop_blockindex ) {
-					if ( blocksize-pos_offset >= new_offset ) {
-						stream->pos_offset += (unsigned short)new_offset;
-						stream->pos += new_offset;
-					} else {
-						stream->pos_offset += (blocksize-pos_offset);
-						stream->pos += (blocksize-pos_offset);
-					}
-					return 1;
-				}
-				
-				stream->pos_offset = BLOCKSIZE;
-				stream->pos += BLOCKSIZE - pos_offset;
-				new_offset -= (BLOCKSIZE - pos_offset);
-				
-				if ( ! readblock(ffs, blockindex, block) ) return 1;
-				memcpy(b4, block+8, 4);
-				next_blockindex = B4toU32(b4);
-				if ( next_blockindex == 0 ) return 1;
-				blockindex = next_blockindex;
-				
-				stream->pos_blockindex = blockindex;
-				pos_offset = BLOCK_HEAD;
-			}
-			return 0;
+	FFS_FILE **p;
+	for (p=&ffs->open_head; *p!=NULL; p=&(*p)->open_next) {
+		if ( *p == stream ) {
+			*p = stream->open_next;
+			break;
 		}
-		// 向文件头移动
-		return 0;
 	}
 	
-	return 0;
+	free(stream->cmp_data);
+	free(stream);
+	return ok;
 }
-unsigned long long FileFS_ftell(FileFS *ffs, FFS_FILE *stream)
+
+// 将延迟分配的数据写入，其它文件无需处理
+// return: 0-err,1-ok
+unsigned char FileFS_fflush(FileFS *ffs, FFS_FILE *stream)
 {
 	if ( ffs == NULL ) return 0;
 	if ( ffs->fp == NULL ) return 0;
 	if ( stream == NULL ) return 0;
 	
-	return stream->pos;
-}
-void FileFS_rewind(FileFS *ffs, FFS_FILE *stream)
-{
-	FileFS_fseek(ffs, stream, 0, FFS_SEEK_SET);
+	if ( ! stream->delay || stream->dirty_count == 0 ) return 1;
+	
+	unsigned int org_root = stream->file_start_blockindex;
+	unsigned char org_depth = stream->map_depth;
+	
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	if ( ! do_fflush_delay(ffs, stream) ) {
+		if ( ffs->tmp.state == 1 ) {
+			tmpstop(ffs);
+			stream->file_start_blockindex = org_root;
+			stream->map_depth = org_depth;
+			stream->leaf_blockindex = 0;
+		}
+		return 0;
+	}
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 0;
+		}
+	}
+	
+	return 1;
 }
 
-// =================================
-// return:
-// 0:not exist
-// 1:is file
-// 2:is dir
-static unsigned char FileFS_stat(FileFS *ffs, const char *name)
+// 设置延迟分配，delay: 0-关闭(先fflush),1-打开
+// return: 0-err,1-ok
+unsigned char FileFS_setdelay(FileFS *ffs, FFS_FILE *stream, unsigned char delay)
 {
-	if ( name == NULL ) return 0;
 	if ( ffs == NULL ) return 0;
 	if ( ffs->fp == NULL ) return 0;
+	if ( stream == NULL ) return 0;
+	if ( stream->mode == 0 ) return 0; // "r"不可写
 	
-	unsigned char block[BLOCKSIZE];
-	
-	int i, start, len = (int)strlen(name);
-	unsigned int blockindex;
-	if ( name[0] == '/' ) {
-		blockindex = 1; // root
-		start = 1;
-	} else if ( name[0] == '~' ) { // home
-		if ( ffs->tmp.state == 0 ) blockindex = ffs->home_pwd_blockindex; // pwd
-		else blockindex = ffs->tmp.home_pwd_blockindex;
-		start = 1;
-	} else {
-		if ( ffs->tmp.state == 0 ) blockindex = ffs->pwd_blockindex; // pwd
-		else blockindex = ffs->tmp.pwd_blockindex;
-		start = 0;
+	if ( delay == 0 ) {
+		if ( ! stream->delay ) return 1;
+		if ( ! FileFS_fflush(ffs, stream) ) return 0;
+		delay_unlink(ffs, stream);
+		return 1;
 	}
 	
-	char s[BLOCK_NAME_MAXSIZE + 2];
-	int slen = 0;
-	unsigned int index;
-	memset(s, 0, BLOCK_NAME_MAXSIZE+2);
-	for (i=start; i<len; i++) {
-		if ( name[i] == '/' ) {
-			if ( slen == 0 ) continue;
-			s[slen] = 0;
-			index = findPathBlockindex(ffs, blockindex, s);
-			if ( index < 1 ) return 0;
-			blockindex = index;
-			slen = 0;
-			continue;
+	if ( stream->delay ) return 1;
+	if ( stream->compress ) return 0; // 压缩文件每次写入时重新压缩extent，不使用延迟分配
+	
+	// 延迟分配只用于块映射文件
+	if ( ! stream->map ) {
+		if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+		if ( stream->inl ) {
+			if ( ! inline2map(ffs, stream) ) {
+				if ( ffs->tmp.state == 1 ) {
+					tmpstop(ffs);
+					stream->inl = 1;
+					stream->map = 0;
+					stream->file_start_blockindex = 0;
+				}
+				return 0;
+			}
+		} else if ( ! chain2map(ffs, stream) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
+		}
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) {
+				return 0;
+			}
 		}
-		s[slen] = name[i];
-		slen++;
-		if ( slen > BLOCK_NAME_MAXSIZE ) return 0;
 	}
-	if ( slen == 0 ) return 2; // dir, name作为目录形式全部搜索完毕
-	
-	// slen > 0
-	s[slen] = 0; // 此时的s是形似xx/yy/zz/abc最后的abc，可能是文件，也可能是目录
-	if ( slen > BLOCK_NAME_MAXSIZE ) return 0;
-	char lastname[BLOCK_NAME_MAXSIZE+1];
-	strcpy(lastname, s);
-	
-	// ===============================
-	unsigned char state, dir_file;
-	unsigned char b4[4], b2[2];
-	unsigned int stop_blockindex;
-	unsigned short offset;
-	int k;
-	
-	if ( ! readblock(ffs, blockindex, block) ) return 0;
-	memcpy(b4, block+(12+1+14+4), 4);
-	stop_blockindex = B4toU32(b4);
-	memcpy(b2, block+(12+1+14+4+4), 2);
-	offset = B2toU16(b2);
 	
-	index = blockindex;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			if ( index == stop_blockindex && k+1 >= offset ) return 0; // 已搜索到最后
-			state = block[k]; k++;
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
+	// 打包的尾部先恢复为普通的block
+	if ( stream->file_stop_blockindex > 0 ) {
+		unsigned int org_root = stream->file_start_blockindex;
+		unsigned char org_depth = stream->map_depth;
+		unsigned int org_pack = stream->file_stop_blockindex;
+		unsigned short org_pack_offset = stream->file_offset;
+		
+		if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+		if ( ! map_unpack(ffs, stream) ) {
+			if ( ffs->tmp.state == 1 ) {
+				tmpstop(ffs);
+				stream->file_start_blockindex = org_root;
+				stream->map_depth = org_depth;
+				stream->file_stop_blockindex = org_pack;
+				stream->file_offset = org_pack_offset;
+				stream->leaf_blockindex = 0;
+			}
+			return 0;
+		}
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) {
+				return 0;
 			}
-			dir_file = state & 0x01;
-			if ( dir_file == 0 ) return 2; // dir;
-			return 1; // file;
 		}
-		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 0;
-		if ( ! readblock(ffs, index, block) ) return 0;
 	}
 	
-	return 0; // 正常情况下不会执行到这里
-}
-
-unsigned char FileFS_file_exist(FileFS *ffs, const char *filename)
-{
-	unsigned char r = FileFS_stat(ffs, filename);
-	if ( r != 1 ) return 0;
+	stream->delay = 1;
+	stream->delay_next = ffs->delay_head;
+	ffs->delay_head = stream;
+	
 	return 1;
 }
 
-unsigned char FileFS_dir_exist(FileFS *ffs, const char *pathname)
+// 设置尾部打包，tailpack: 0-关闭,1-打开，已打包的文件不受影响
+void FileFS_settailpack(FileFS *ffs, unsigned char tailpack)
 {
-	unsigned char r = FileFS_stat(ffs, pathname);
-	if ( r != 2 ) return 0;
-	return 1;
+	if ( ffs == NULL ) return;
+	
+	ffs->tailpack = tailpack ? 1 : 0;
 }
 
-// return: 0-ok,1-gen err,2-file not exist,3-dir not existed,4-name>limit(14byte),5-name format err
-int FileFS_remove(FileFS *ffs, const char *filename)
+// 设置压缩，只能用于空文件，compress: 0-关闭,1-打开
+// return: 0-err,1-ok
+unsigned char FileFS_setcompress(FileFS *ffs, FFS_FILE *stream, unsigned char compress)
 {
-	if ( ffs == NULL ) return 1;
-	if ( ffs->fp == NULL ) return 1;
-	if ( filename == NULL ) return 1;
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	if ( stream == NULL ) return 0;
+	if ( stream->mode == 0 ) return 0; // "r"不可写
 	
-	// ===================================
-	// 检查路径
-	int i, start, len = (int)strlen(filename);
-	if ( filename[len-1] == '/' ) return 5; // ...xyz/，最后一位是'/'，表示不是文件
-	unsigned int blockindex;
-	if ( filename[0] == '/' ) {
-		blockindex = 1; // root
-		start = 1;
-	} else if ( filename[0] == '~' ) { // home
-		if ( ffs->tmp.state == 0 ) blockindex = ffs->home_pwd_blockindex; // pwd
-		else blockindex = ffs->tmp.home_pwd_blockindex;
-		start = 1;
-	} else {
-		if ( ffs->tmp.state == 0 ) blockindex = ffs->pwd_blockindex; // pwd
-		else blockindex = ffs->tmp.pwd_blockindex;
-		start = 0;
-	}
+	compress = compress ? 1 : 0;
+	if ( stream->compress == compress ) return 1;
+	if ( stream->delay ) return 0;
+	if ( stream->size > 0 || stream->file_start_blockindex != 0 || stream->file_stop_blockindex != 0 ) return 0; // 不是空文件
 	
-	char s[BLOCK_NAME_MAXSIZE+2];
-	int slen = 0;
-	unsigned int index;
-	for (i=start; i<len; i++) {
-		if ( filename[i] == '/' ) {
-			if ( slen == 0 ) continue;
-			s[slen] = 0;
-			index = findPathBlockindex(ffs, blockindex, s);
-			if ( index < 1 ) {
-				return 3; // dir not exist
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	if ( stream->inl ) {
+		if ( ! inline2map(ffs, stream) ) {
+			if ( ffs->tmp.state == 1 ) {
+				tmpstop(ffs);
+				stream->inl = 1;
+				stream->map = 0;
 			}
-			blockindex = index;
-			slen = 0;
-			continue;
+			return 0;
+		}
+	} else if ( ! stream->map ) {
+		stream->map = 1;
+		stream->map_depth = 0;
+		stream->pos_blockindex = 0;
+		stream->pos_offset = 0;
+	}
+	stream->compress = compress;
+	stream->cmp_valid = 0;
+	if ( ! map_sync(ffs, stream) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		stream->compress = ! compress;
+		return 0;
+	}
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 0;
 		}
-		s[slen] = filename[i];
-		slen++;
-		if ( slen > BLOCK_NAME_MAXSIZE ) return 4; // name to long
 	}
-	if ( slen == 0 ) return 2; // just path, no filename
-	
-	s[slen] = 0;
-	if ( slen > BLOCK_NAME_MAXSIZE ) return 4; // name to long
-	
-	char lastname[BLOCK_NAME_MAXSIZE+1];
-	strcpy(lastname, s);
-	if ( strcmp(lastname, ".") == 0 ) return 5; // format err
-	if ( strcmp(lastname, "..") == 0 ) return 5; // format err
-	
-	// ============================================
-	// 检查文件是否存在
-	BlockArray ba[4];
-	int ba_used = 0;
-	unsigned char *block_head, *block_last, *block_item, *block_prev;
-	unsigned int block_head_index, block_last_index, block_item_index, block_prev_index;
-	for (i=0; i<4; i++) ba[i].active = 0;
 	
+	return 1;
+}
+
+// block链文件: 沿着block链将读写位置移动到target，若target超出文件尾部，则停在文件尾部
+static unsigned char chain_seek(FileFS *ffs, FFS_FILE *stream, unsigned long long target)
+{
 	unsigned char block[BLOCKSIZE];
-	unsigned char state, dir_file;
-	unsigned char b4[4], b2[2];
-	unsigned int stop_blockindex;
-	unsigned short offset;
-	int k;
-	
-	// block_head
-	if ( ! readblock(ffs, blockindex, block) ) return 1;
-	memcpy(ba[0].block, block, BLOCKSIZE);
-	ba[0].blockindex = blockindex;
-	ba[0].active = 1;
-	block_head = ba[0].block;
-	block_head_index = blockindex;
-	ba_used = 1;
-	
-	memcpy(b4, block_head+BLOCK_STOP_BLOCKINDEX, 4);
-	stop_blockindex = B4toU32(b4);
-	memcpy(b2, block_head+BLOCK_OFFSET, 2);
-	offset = B2toU16(b2);
+	unsigned char b4[4];
+	unsigned int blockindex;
+	unsigned short blocksize;
+	unsigned long long n;
 	
-	// block_last
-	if ( stop_blockindex == block_head_index ) {
-		block_last = block_head;
-		block_last_index = block_head_index;
-	} else {
-		if ( ! readblock(ffs, stop_blockindex, ba[1].block) ) return 1;
-		ba[1].blockindex = stop_blockindex;
-		ba[1].active = 1;
-		block_last = ba[1].block;
-		block_last_index = stop_blockindex;
-		ba_used++;
+	if ( stream->file_start_blockindex == 0 ) { // 空文件
+		stream->pos = 0;
+		return 1;
+	}
+	if ( stream->pos_blockindex == 0 ) {
+		stream->pos_blockindex = stream->file_start_blockindex;
+		stream->pos_offset = BLOCK_HEAD;
+		stream->pos = 0;
 	}
 	
-	// 搜索block，检查是否有名称相同的目录或文件
-	unsigned int file_start_blockindex = 0, file_stop_blockindex = 0;
-	unsigned short item_offset = 0;
-	
-	unsigned char flag = 0, u;
-	index = block_head_index;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			// printf("index:%d, stop_blockindex:%d, k=%d, offset:%d\n", index, stop_blockindex, k, offset);
-			if ( index == stop_blockindex && k+1 >= offset ) { // 已搜索到最后
-				return 2; // file not exist
-			}
-			state = block[k]; k++;
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
-			}
-			//printf("state:%d\n", state);
-			dir_file = state & 0x01;
-			if ( dir_file == 0 ) {
-				return 2; // same path exist;
-			}
-			
-			// 读取文件参数
-			memcpy(b4, block+k, 4); file_start_blockindex = B4toU32(b4);
-			memcpy(b4, block+k+4, 4); file_stop_blockindex = B4toU32(b4);
-			
-			item_offset = k + 10; // block item的尾部位置
-			
-			// block_item
-			u = 0;
-			for (i=0; i<ba_used; i++) {
-				if ( 0 == ba[i].active ) continue;
-				if ( ba[i].blockindex == index ) {
-					block_item = ba[i].block;
-					block_item_index = index;
-					u = 1;
-					break;
-				}
-			}
-			if ( !u ) {
-				memcpy(ba[ba_used].block, block, BLOCKSIZE);
-				ba[ba_used].blockindex = index;
-				ba[ba_used].active = 1;
-				block_item = ba[ba_used].block;
-				block_item_index = index;
-				ba_used++;
+	if ( target < stream->pos ) {
+		// 位于文件尾部时pos可能超出了文件长度，从文件头开始
+		if ( stream->pos_blockindex == stream->file_stop_blockindex && stream->pos_offset >= stream->file_offset ) {
+			stream->pos_blockindex = stream->file_start_blockindex;
+			stream->pos_offset = BLOCK_HEAD;
+			stream->pos = 0;
+		} else {
+			// 向文件头移动，除了最后一个block，其它block都是满的
+			while ( stream->pos - target > (unsigned long long)(stream->pos_offset - BLOCK_HEAD) ) {
+				if ( ! readblock(ffs, stream->pos_blockindex, block) ) return 0;
+				memcpy(b4, block+8, 4);
+				blockindex = B4toU32(b4); // prev
+				if ( blockindex == 0 ) return 0;
+				stream->pos -= stream->pos_offset - BLOCK_HEAD;
+				stream->pos_blockindex = blockindex;
+				stream->pos_offset = BLOCKSIZE;
 			}
-			
-			flag = 1;
-			break;
+			stream->pos_offset -= (unsigned short)(stream->pos - target);
+			stream->pos = target;
+			return 1;
 		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 1; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, block) ) return 1; // 到这里说明block有问题
 	}
 	
-	// printf("head:%d, item:%d, last:%d, item_offset:%d\n", block_head_index, block_item_index, block_last_index, item_offset);
-	// =======================
-	// 正式开始删除dir_block(保存了文件名的目录块)
-	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
-
-	// 删除文件内容
-	unsigned char file_block_stop[BLOCKSIZE];
-	if ( file_start_blockindex > 0 ) { // 文件有内容
-		// file block_stop
-		if ( ! readblock(ffs, file_stop_blockindex, file_block_stop) ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
-		}
-		
-		U32toB4(ffs->tmp.new_unused_blockhead, b4);
-		memcpy(file_block_stop + 4, b4, 4);
-		ffs->tmp.new_unused_blockhead = file_start_blockindex;
+	// 向文件尾移动
+	while (1) {
+		if ( stream->pos_blockindex == stream->file_stop_blockindex ) blocksize = stream->file_offset;
+		else blocksize = BLOCKSIZE;
 		
-		if ( ! writeblock(ffs, file_stop_blockindex, file_block_stop) ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		n = blocksize - stream->pos_offset;
+		if ( target - stream->pos <= n ) {
+			stream->pos_offset += (unsigned short)(target - stream->pos);
+			stream->pos = target;
 			return 1;
 		}
+		stream->pos_offset = blocksize;
+		stream->pos += n;
+		if ( stream->pos_blockindex == stream->file_stop_blockindex ) return 1; // 已到文件尾部
+		
+		if ( ! readblock(ffs, stream->pos_blockindex, block) ) return 0;
+		memcpy(b4, block+4, 4);
+		blockindex = B4toU32(b4); // next
+		if ( blockindex == 0 ) return 1;
+		stream->pos_blockindex = blockindex;
+		stream->pos_offset = BLOCK_HEAD;
 	}
 	
-	/*
-	if ( item is not offset ) {
-		get offset->item;
-		copy item;
-	}
-	1.block_item
-	*/
-	if ( block_item_index != stop_blockindex || item_offset != offset ) {
-		memcpy(block_item + item_offset - 25, block_last + offset - 25, 25);
-	}
+	return 0;
+}
 
-	/*
-	offset -= 25;
-	2.block_last
-	*/
-	offset -= 25;
-	U16toB2(offset, b2);
-	memcpy(block_head + BLOCK_OFFSET, b2, 2);
+unsigned char FileFS_fseek(FileFS *ffs, FFS_FILE *stream, long long offset, int whence)
+{
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	if ( stream == NULL ) return 0;
 	
-	/*
-	if ( offset < 25 ) { // 整个block都已清空
-		get prevblockindex;
-		remove block_last;
-		prevblock->next_blockindex = 0;
-		stop_blockindex = prev_block_index;
-		offset = BLOCKSIZE;
-		3.block_prev
-	}
-	4.block_head
-	*/
-	if ( offset < 25 ) {
-		memcpy(b4, block_last+8, 4);
-		block_prev_index = B4toU32(b4);
-		// printf("block prev index:%d\n", block_prev_index);
-		
-		removeblock(ffs, block_last_index);
-		k = -1;
-		for (i=0; i<4; i++) {
-			if ( ! ba[i].active ) continue;
-			if ( ba[i].blockindex == block_last_index ) {
-				ba[i].active = 0;
-				k = i;
-				break;
-			}
-		}
-		if ( k < 0 ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
-		}
-		
-		// block_prev
-		u = 0;
-		for (i=0; i<4; i++) {
-			if ( ! ba[i].active ) continue;
-			if ( ba[i].blockindex == block_prev_index ) {
-				block_prev = ba[i].block;
-				u = 1;
-				break;
-			}
-		}
-		if ( !u ) {
-			if ( ! readblock(ffs, block_prev_index, block) ) {
-				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-				return 1; // 到这里说明block有问题
-			}
-			
-			memcpy(ba[k].block, block, BLOCKSIZE);
-			ba[k].blockindex = block_prev_index;
-			ba[k].active = 1;
-			block_prev = ba[k].block;
-		}
-		
-		// prevblock->next_blockindex = 0;
-		memset(block_prev + 4, 0, 4);
-		
-		U32toB4(block_prev_index, b4);
-		memcpy(block_head + BLOCK_STOP_BLOCKINDEX, b4, 4);
-		offset = BLOCKSIZE;
-		U16toB2(offset, b2);
-		memcpy(block_head + BLOCK_OFFSET, b2, 2);
+	long long target;
+	
+	if ( whence == FFS_SEEK_SET ) {
+		target = offset;
+	} else if ( whence == FFS_SEEK_CUR ) {
+		target = (long long)stream->pos + offset;
+	} else if ( whence == FFS_SEEK_END ) {
+		if ( ! stream->map && ! stream->inl ) {
+			if ( ! chain_seek(ffs, stream, ~0ULL) ) return 0;
+			stream->size = stream->pos;
+		}
+		target = (long long)stream->size + offset;
+	} else {
+		return 0;
 	}
+	if ( target < 0 ) return 0;
 	
-	for (i=0; i<4; i++) {
-		// printf("%d: write blockindex:%d\n", i, ba[i].blockindex);
-		if ( ! ba[i].active ) continue;
-		/*
-		for (k=0; k<BLOCKSIZE; k++) {
-			printf("%x ", ba[i].block[k]);
-		}
-		printf("\n");
-		*/
-		if ( ! writeblock(ffs, ba[i].blockindex, ba[i].block) ) {
-			// printf("write block err %d\n", i);
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
-		}
+	if ( stream->map || stream->inl ) {
+		stream->pos = (unsigned long long)target;
+		return 1;
+	}
+	
+	if ( ! chain_seek(ffs, stream, (unsigned long long)target) ) return 0;
+	if ( stream->pos == (unsigned long long)target ) return 1;
+	
+	// 超出了文件尾部
+	if ( stream->mode == 0 ) { // 只读，读取时直接返回0
+		stream->pos = (unsigned long long)target;
+		return 1;
 	}
 	
+	// 可写，转换为块映射文件，之后写入时中间部分成为空洞
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	if ( ! chain2map(ffs, stream) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 0;
+	}
 	if ( ffs->tmp.state == 1 ) {
 		if ( ! FileFS_commit(ffs) ) {
-			return 1;
+			return 0;
 		}
 	}
+	stream->pos = (unsigned long long)target;
 	
-	// ============================================
-	return 0;
+	return 1;
 }
 
-// =====================
-static int do_rename(FileFS *ffs, 
-	char *old_lastname, unsigned int old_blockindex, unsigned char old_type_dir, 
-	char *new_lastname, unsigned int new_blockindex, unsigned char new_type_dir)
+// 块映射文件的长度保存在root中，只需读取目录项和root；旧的block链文件需要沿block链计算
+unsigned char FileFS_filesize(FileFS *ffs, const char *filename, unsigned long long *size)
 {
-	int i;
-	unsigned int index;
-	char s[BLOCK_NAME_MAXSIZE+2];
-	
-	// ===================================
-	unsigned char b4[4], b2[2];
-	int k;
-	// ===================================
-	// old lastname exist
-	BlockArray old_ba[4];
-	int old_ba_used = 0;
-	unsigned char *old_block_head, *old_block_last, *old_block_item, *old_block_prev;
-	unsigned int old_block_item_index, old_block_last_index, old_block_prev_index, old_block_head_index;
-	for (i=0; i<4; i++) old_ba[i].active = 0;
+	if ( size == NULL ) return 0;
 	
-	unsigned char old_block[BLOCKSIZE];
-	unsigned char state, old_dir_file;
-	unsigned int old_stop_blockindex;
-	unsigned short old_offset;
-	
-	// block_head
-	if ( ! readblock(ffs, old_blockindex, old_block) ) return 1;
-	memcpy(old_ba[0].block, old_block, BLOCKSIZE);
-	old_ba[0].blockindex = old_blockindex;
-	old_ba[0].active = 1;
-	old_block_head = old_ba[0].block;
-	old_block_head_index = old_blockindex;
-	old_ba_used = 1;
-	
-	memcpy(b4, old_block_head+(12+1+14+4), 4);
-	old_stop_blockindex = B4toU32(b4);
-	memcpy(b2, old_block_head+(12+1+14+4+4), 2);
-	old_offset = B2toU16(b2);
+	FFS_FILE *stream = FileFS_fopen(ffs, filename, "r");
+	if ( stream == NULL ) return 0;
 	
-	// block_last
-	if ( old_stop_blockindex == old_block_head_index ) {
-		old_block_last = old_block_head;
-		old_block_last_index = old_block_head_index;
-	} else {
-		if ( ! readblock(ffs, old_stop_blockindex, old_ba[1].block) ) return 1;
-		old_ba[1].blockindex = old_stop_blockindex;
-		old_ba[1].active = 1;
-		old_block_last = old_ba[1].block;
-		old_block_last_index = old_stop_blockindex;
-		old_ba_used++;
+	if ( ! stream->map && ! stream->inl ) {
+		if ( ! chain_seek(ffs, stream, ~0ULL) ) {
+			FileFS_fclose(ffs, stream);
+			return 0;
+		}
+		stream->size = stream->pos;
 	}
+	*size = stream->size;
 	
-	// 搜索block，检查是否有名称相同的目录或文件
-	unsigned short old_item_offset = 0;
-	unsigned char flag = 0, u;
-	index = old_block_head_index;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			if ( index == old_stop_blockindex && k+1 >= old_offset ) { // 已搜索到最后
-				return 4; // old lastname item not exist
-			}
-			state = old_block[k]; k++;
-			memcpy(s, old_block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, old_lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
-			}
-			//printf("state:%d\n", state);
-			old_dir_file = state & 0x01; // 0-dir,1-file
-			if ( old_type_dir == 1 && old_dir_file == 1 ) return 2; // old_name指定为目录，读取出来为文件，前后不一致
-			if ( new_type_dir == 1 && old_dir_file == 1 ) return 6; // new_name指定为目录，old_name为文件，格式不匹配
-			old_item_offset = k + 10; // block item的尾部位置
-			
-			// block_item
-			u = 0;
-			for (i=0; i<old_ba_used; i++) {
-				if ( old_ba[i].blockindex == index ) {
-					old_block_item = old_ba[i].block;
-					old_block_item_index = index;
-					u = 1;
-					break;
-				}
-			}
-			if ( !u ) {
-				memcpy(old_ba[old_ba_used].block, old_block, BLOCKSIZE);
-				old_ba[old_ba_used].blockindex = index;
-				old_ba[old_ba_used].active = 1;
-				old_block_item = old_ba[old_ba_used].block;
-				old_block_item_index = index;
-				old_ba_used++;
-			}
-			
-			flag = 1;
+	// 延迟分配的文件尚未写入root，使用内存中的长度
+	FFS_FILE *ff;
+	for (ff=ffs->delay_head; ff!=NULL; ff=ff->delay_next) {
+		if ( ff->dir_blockindex == stream->dir_blockindex && ff->dir_offset == stream->dir_offset ) {
+			*size = ff->size;
 			break;
 		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, old_block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 1; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, old_block) ) return 1; // 到这里说明block有问题
 	}
+	FileFS_fclose(ffs, stream);
 	
-	// ===================================
-	// new lastname no exist
-	BlockArray new_ba[2];
-	int new_ba_used = 0;
-	unsigned char *new_block_head, *new_block_last;
-	unsigned int new_block_head_index, new_block_last_index;
-	for (i=0; i<2; i++) new_ba[i].active = 0;
+	return 1;
+}
+
+/*
+将文件内容写入宿主的文件描述符fd(从fd的当前位置开始)
+block中的payload之间隔着BLOCK_HEAD，不能用copy_file_range等整段复制，因此:
+块映射文件连续的block一次读入，各block的payload用writev一次写入fd，不再经过额外的缓冲区复制
+压缩文件、inline文件和block链文件用fread读取后写入
+return: 0-err,1-ok
+*/
+unsigned char FileFS_export_fd(FileFS *ffs, const char *filename, int fd)
+{
+	if ( fd < 0 ) return 0;
 	
-	unsigned char new_block[BLOCKSIZE];
-	unsigned int new_stop_blockindex;
-	unsigned short new_offset;
+	FFS_FILE *stream = FileFS_fopen(ffs, filename, "r");
+	if ( stream == NULL ) return 0;
 	
-	// block_head
-	if ( ! readblock(ffs, new_blockindex, new_block) ) return 1;
-	memcpy(new_ba[0].block, new_block, BLOCKSIZE);
-	new_ba[0].blockindex = new_blockindex;
-	new_ba[0].active = 1;
-	new_block_head = new_ba[0].block;
-	new_block_head_index = new_blockindex;
-	new_ba_used = 1;
-	
-	memcpy(b4, new_block_head+(12+1+14+4), 4);
-	new_stop_blockindex = B4toU32(b4);
-	memcpy(b2, new_block_head+(12+1+14+4+4), 2);
-	new_offset = B2toU16(b2);
+	unsigned char run[BLOCK_RUNMAX * BLOCKSIZE];
+	unsigned long long fileblock, last;
+	unsigned int blockindex, next, count, i;
+	size_t n;
+	unsigned char ok = 1;
 	
-	// block_last
-	if ( new_stop_blockindex == new_block_head_index ) {
-		new_block_last = new_block_head;
-		new_block_last_index = new_block_head_index;
-	} else {
-		if ( ! readblock(ffs, new_stop_blockindex, new_ba[1].block) ) return 1;
-		new_ba[1].blockindex = new_stop_blockindex;
-		new_ba[1].active = 1;
-		new_block_last = new_ba[1].block;
-		new_block_last_index = new_stop_blockindex;
-		new_ba_used++;
+	if ( ! stream->map || stream->compress ) {
+		while ( (n = FileFS_fread(ffs, run, 1, sizeof(run), stream)) > 0 ) {
+			if ( ! ffs_write_fd(fd, run, n) ) {
+				ok = 0;
+				break;
+			}
+		}
+		FileFS_fclose(ffs, stream);
+		return ok;
 	}
 	
-	// 搜索block，检查是否有名称相同的目录或文件
-	flag = 0;
-	index = new_block_head_index;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			// printf("index:%d, new_stop_blockindex:%d, k=%d, offset:%d\n", index, new_stop_blockindex, k, offset);
-			if ( index == new_stop_blockindex && k+1 >= new_offset ) { // 已搜索到最后
-				flag = 1;
-				break; // new lastname item not exist
+	last = stream->size == 0 ? 0 : (stream->size - 1) / BLOCK_DATASIZE;
+	while ( ok && stream->pos < stream->size ) {
+		fileblock = stream->pos / BLOCK_DATASIZE;
+		n = BLOCK_DATASIZE;
+		if ( fileblock == last ) n = (size_t)(stream->size - stream->pos);
+		
+		if ( stream->file_stop_blockindex > 0 && fileblock == last ) { // 打包的尾部
+			if ( ! readblock(ffs, stream->file_stop_blockindex, run) ) ok = 0;
+			else ok = ffs_write_fd(fd, run + stream->file_offset + 2, n);
+			stream->pos += n;
+			continue;
+		}
+		if ( ! map_get(ffs, stream, fileblock, &blockindex) ) {
+			ok = 0;
+			break;
+		}
+		if ( blockindex == 0 ) { // 空洞
+			memset(run, 0, n);
+			ok = ffs_write_fd(fd, run, n);
+			stream->pos += n;
+			continue;
+		}
+		
+		// 连续的block
+		for (count=1; count<BLOCK_RUNMAX && fileblock+count<=last; count++) {
+			if ( fileblock + count == last && stream->file_stop_blockindex > 0 ) break;
+			if ( ! map_get(ffs, stream, fileblock + count, &next) ) break;
+			if ( next != blockindex + count ) break;
+		}
+		if ( ! readblockrun(ffs, blockindex, count, run) ) {
+			ok = 0;
+			break;
+		}
+		n = (size_t)count * BLOCK_DATASIZE;
+		if ( stream->pos + n > stream->size ) n = (size_t)(stream->size - stream->pos);
+#ifdef FFS_WRITEV
+		{
+			struct iovec iov[BLOCK_RUNMAX];
+			int k = 0, cnt = (int)count;
+			ssize_t r;
+			for (i=0; i<count; i++) {
+				iov[i].iov_base = run + i * BLOCKSIZE + BLOCK_HEAD;
+				iov[i].iov_len = BLOCK_DATASIZE;
 			}
-			k++; // 跳过state
-			memcpy(s, new_block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, new_lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
+			iov[count-1].iov_len = n - (size_t)(count - 1) * BLOCK_DATASIZE;
+			while ( k < cnt ) {
+				r = writev(fd, iov + k, cnt - k);
+				if ( r < 0 && errno == EINTR ) continue;
+				if ( r <= 0 ) {
+					ok = 0;
+					break;
+				}
+				// 部分写入时跳过已写入的部分
+				while ( k < cnt && (size_t)r >= iov[k].iov_len ) r -= (ssize_t)iov[k++].iov_len;
+				if ( k < cnt ) {
+					iov[k].iov_base = (unsigned char*)iov[k].iov_base + r;
+					iov[k].iov_len -= (size_t)r;
+				}
 			}
-			return 5; // new name already exist
 		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, new_block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 1; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, new_block) ) return 1; // 到这里说明block有问题
+#else
+		for (i=0; i<count && ok; i++) {
+			ok = ffs_write_fd(fd, run + i * BLOCKSIZE + BLOCK_HEAD, i == count - 1 ? n - (size_t)i * BLOCK_DATASIZE : BLOCK_DATASIZE);
+		}
+#endif
+		stream->pos += n;
 	}
 	
-	// =======================================
-	// 此时old_name存在，new_name不存在
-	// =======================================
-	// old和new在同一个目录中，只需更换lastname即可
-	if ( old_block_head_index == new_block_head_index ) {
-		memcpy(old_block_item + old_item_offset - 10 - 14, new_lastname, BLOCK_NAME_MAXSIZE);
-		
-		if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
-		if ( ! writeblock(ffs, old_block_item_index, old_block_item) ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+	FileFS_fclose(ffs, stream);
+	return ok;
+}
+
+/*
+从宿主的文件描述符fd读取到文件尾，写入filename(不存在则创建，已存在则清空)
+数据块不经过fp_add和fnj: 在一个事务中，先把数据按顺序直接写入container尾部新增的block并fsync，
+这部分block在block[0]的total_blocksize之外，commit之前不可达，无需日志；
+之后建立映射(索引块、目录项、block[0])，只有这些元数据按原来的方式commit，数据只写入一次
+size_hint为预计的长度(可以为0)，用于预先扩展container；失败或崩溃时多出的尾部被截掉(mount时也会检查)
+已在手动事务中时，fp_add之后不能再直接写入fp，按普通的fwrite写入
+return: 0-err,1-ok
+*/
+unsigned char FileFS_import_fd(FileFS *ffs, const char *filename, int fd, unsigned long long size_hint)
+{
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	if ( fd < 0 ) return 0;
+	
+	FFS_FILE *stream;
+	unsigned char *in, *run;
+	size_t got, n;
+	unsigned int first, count, i;
+	unsigned long long size = 0, nblocks = 0, fileblock, pos;
+	unsigned char ok = 1;
+	
+	in = (unsigned char*)malloc((size_t)IMPORT_RUNBLOCKS * BLOCK_DATASIZE);
+	if ( in == NULL ) return 0;
+	
+	if ( ffs->tmp.state != 0 ) {
+		stream = FileFS_fopen(ffs, filename, "w");
+		if ( stream == NULL ) {
+			free(in);
+			return 0;
 		}
-		if ( ffs->tmp.state == 1 ) {
-			if ( ! FileFS_commit(ffs) ) {
-				return 1;
-			}
+		while ( ok ) {
+			ok = ffs_read_fd(fd, in, (size_t)IMPORT_RUNBLOCKS * BLOCK_DATASIZE, &got);
+			if ( ! ok || got == 0 ) break;
+			if ( FileFS_fwrite(ffs, in, 1, got, stream) != got ) ok = 0;
 		}
+		FileFS_fclose(ffs, stream);
+		free(in);
+		return ok;
+	}
+	
+	run = (unsigned char*)malloc((size_t)IMPORT_RUNBLOCKS * BLOCKSIZE);
+	if ( run == NULL ) {
+		free(in);
 		return 0;
 	}
 	
-	// =======================================
-	// old和new不在同一个目录中
-	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	// 作为手动事务，其中的fopen/fclose不会各自commit
+	if ( ! tmpstart(ffs, 2) ) {
+		free(run);
+		free(in);
+		return 0;
+	}
+	first = ffs->tmp.total_blocksize;
 	
-	// 若移动的是目录，需将(new_item指向的目录块)->..->start_blockindex = new_block_head_index
-	unsigned int path_blockindex;
-	unsigned char path_block[BLOCKSIZE];
-	if ( old_dir_file == 0 ) {
-		memcpy(b4, old_block_item + old_item_offset - 10, 4);
-		path_blockindex = B4toU32(b4);
-		if ( ! readblock(ffs, path_blockindex, path_block) ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+	// 1.数据按顺序直接写入[first, first+nblocks)
+	if ( size_hint > 0 && (size_hint - 1) / BLOCK_DATASIZE + 1 < 0xFFFFFFFF - first ) {
+		pos = first + (size_hint - 1) / BLOCK_DATASIZE + 1;
+		pos *= BLOCKSIZE;
+		ffs_fsetsize(ffs->fp, pos);
+	}
+	pos = first;
+	pos *= BLOCKSIZE;
+	ffs_fsetpos(ffs->fp, pos);
+	while ( 1 ) {
+		if ( ! ffs_read_fd(fd, in, (size_t)IMPORT_RUNBLOCKS * BLOCK_DATASIZE, &got) ) {
+			ok = 0;
+			break;
 		}
-		U32toB4(new_block_head_index, b4);
-		memcpy(path_block + BLOCK_HEAD + 25 + 1 + 14, b4, 4);
-		if ( ! writeblock(ffs, path_blockindex, path_block) ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+		if ( got == 0 ) break;
+		count = (unsigned int)((got - 1) / BLOCK_DATASIZE + 1);
+		if ( nblocks + count >= 0xFFFFFFFF - first ) {
+			ok = 0;
+			break;
+		}
+		memset(run, 0, (size_t)count * BLOCKSIZE);
+		for (i=0; i<count; i++) {
+			n = got - (size_t)i * BLOCK_DATASIZE;
+			if ( n > BLOCK_DATASIZE ) n = BLOCK_DATASIZE;
+			memcpy(run + i * BLOCKSIZE + BLOCK_HEAD, in + (size_t)i * BLOCK_DATASIZE, n);
 		}
+		if ( (size_t)count * BLOCKSIZE != ffs_fwrite(run, 1, (size_t)count * BLOCKSIZE, ffs->fp) ) {
+			ok = 0;
+			break;
+		}
+		nblocks += count;
+		size += got;
+		if ( got < (size_t)IMPORT_RUNBLOCKS * BLOCK_DATASIZE ) break;
 	}
+	free(run);
+	free(in);
 	
-	// == 在new_block中创建一个新的item，将old_item复制过来
-	unsigned int blockindex_2;
-	unsigned char block_2[BLOCKSIZE];
-	
-	if ( new_offset < BLOCKSIZE ) { // 最后一个block未填满		
-		// 向new_block_last写入lastname目录项
-		memcpy(new_block_last + new_offset, old_block_item + old_item_offset - 25, 25);
+	pos = first + nblocks;
+	pos *= BLOCKSIZE;
+	if ( ok && ! ffs_fsetsize(ffs->fp, pos) ) ok = 0;
+	// 数据先落盘，之后commit的元数据才指向它们
+	if ( ok ) ffs_fflush(ffs->fp);
+	
+	// 2.这部分block视为fp中已有的block，之后新增的block从first+nblocks开始放在fp_add中
+	stream = NULL;
+	if ( ok ) {
+		ffs->tmp.total_blocksize = ffs->tmp.new_total_blocksize = first + (unsigned int)nblocks;
+		ffs->tmp.direct_size = (unsigned int)nblocks;
 		
-		new_offset += 25;
-		U16toB2(new_offset, b2);
-		memcpy(new_block_head + BLOCK_OFFSET, b2, 2);
-	} else { // 最后一个block已填满
-		// 创建存储lastname的目录延伸块
-		// gen block_2 for lastname;
-		// block_2->prevblockindex = cur_blockindex;
-		// write;
-		blockindex_2 = genblockindex(ffs);
-		if ( blockindex_2 == 0 ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
-		}		
-		memset(block_2, 0, BLOCKSIZE);
-		// prevblockindex
-		U32toB4(new_block_last_index, b4);
-		memcpy(block_2+8, b4, 4);
-		// copy item
-		memcpy(block_2 + BLOCK_HEAD, old_block_item + old_item_offset - 25, 25);
-		if ( ! writeblock(ffs, blockindex_2, block_2) ) {
+		stream = FileFS_fopen(ffs, filename, "w");
+		if ( stream == NULL ) ok = 0;
+	}
+	if ( ok && nblocks > 0 && stream->inl && ! inline2map(ffs, stream) ) ok = 0;
+	for (fileblock=0; ok && fileblock<nblocks; fileblock+=count) {
+		// map_setrun不能跨越叶子索引块
+		count = (unsigned int)(MAP_ITEM_MAXCOUNT - fileblock % MAP_ITEM_MAXCOUNT);
+		if ( count > nblocks - fileblock ) count = (unsigned int)(nblocks - fileblock);
+		if ( ! map_setrun(ffs, stream, fileblock, first + (unsigned int)fileblock, count) ) ok = 0;
+	}
+	if ( ok && nblocks > 0 ) {
+		stream->size = size;
+		if ( ! map_sync(ffs, stream) ) ok = 0;
+	}
+	if ( stream != NULL ) FileFS_fclose(ffs, stream);
+	
+	if ( ! ok ) FileFS_rollback(ffs);
+	else if ( FileFS_commit(ffs) ) return 1;
+	fp_trim(ffs);
+	return 0;
+}
+
+// 释放[offset, offset+len)中的完整block，不完整的部分写入0，文件长度不变
+unsigned char FileFS_punch_hole(FileFS *ffs, FFS_FILE *stream, unsigned long long offset, unsigned long long len)
+{
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	if ( stream == NULL ) return 0;
+	if ( stream->mode == 0 ) return 0; // "r"不可写
+	
+	unsigned long long end, size, lo, hi, fileblock;
+	unsigned int blockindex;
+	unsigned short off, n;
+	unsigned char block[BLOCKSIZE];
+	unsigned char empty;
+	
+	if ( len == 0 ) return 1;
+	
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	
+	if ( stream->inl ) { // inline文件没有block，写入0即可
+		if ( offset < stream->size ) {
+			end = offset + len;
+			if ( end < offset || end > stream->size ) end = stream->size;
+			memset(stream->inl_data + offset, 0, (size_t)(end - offset));
+			if ( ! inline_sync(ffs, stream, (unsigned int)stream->size) ) {
+				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+				return 0;
+			}
+		}
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) return 0;
+		}
+		return 1;
+	}
+	
+	if ( stream->compress ) { // 压缩文件写入0，全部为0的extent成为空洞
+		end = offset + len;
+		if ( end < offset || end > stream->size ) end = stream->size;
+		while ( offset < end ) {
+			off = (unsigned short)(offset % CMP_EXTSIZE);
+			n = CMP_EXTSIZE - off;
+			if ( n > end - offset ) n = (unsigned short)(end - offset);
+			if ( ! cmp_load(ffs, stream, offset / CMP_EXTSIZE) ) break;
+			memset(stream->cmp_data + off, 0, n);
+			if ( ! cmp_store(ffs, stream) ) break;
+			offset += n;
+		}
+		if ( offset < end || ! map_sync(ffs, stream) ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+			stream->cmp_valid = 0;
+			stream->leaf_blockindex = 0;
+			return 0;
 		}
-		
-		// new_block_last->nextblockindex = blockindex_2;
-		U32toB4(blockindex_2, b4);
-		memcpy(new_block_last + 4, b4, 4);
-		
-		new_offset = BLOCK_HEAD + 25;
-		U16toB2(new_offset, b2);
-		memcpy(new_block_head + BLOCK_OFFSET, b2, 2);
-		U32toB4(blockindex_2, b4);
-		memcpy(new_block_head + BLOCK_STOP_BLOCKINDEX, b4, 4);
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) return 0;
+		}
+		return 1;
 	}
-	for (i=0; i<new_ba_used; i++) {
-		if ( ! new_ba[i].active ) continue;
-		if ( ! writeblock(ffs, new_ba[i].blockindex, new_ba[i].block) ) {
+	
+	if ( ! stream->map ) {
+		if ( ! chain2map(ffs, stream) ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+			return 0;
 		}
 	}
+	if ( ! map_unpack(ffs, stream) || ! map_cowroot(ffs, stream) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 0;
+	}
 	
-	// == 删除old_item
-	if ( old_block_item_index != old_stop_blockindex || old_item_offset != old_offset ) { // 要删除的item不是最后一项
-		memcpy(old_block_item + old_item_offset - 25, old_block_last + old_offset - 25, 25);
+	size = stream->size;
+	end = offset + len;
+	if ( end < offset || end > size ) end = size;
+	if ( offset >= end ) {
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) return 0;
+		}
+		return 1;
 	}
-
-	old_offset -= 25;
-	U16toB2(old_offset, b2);
-	memcpy(old_block_head + BLOCK_OFFSET, b2, 2);
 	
-	if ( old_offset < 25 ) { // 整个old_block_last都已清空
-		memcpy(b4, old_block_last+8, 4);
-		old_block_prev_index = B4toU32(b4);
-		
-		removeblock(ffs, old_block_last_index);
-		k = -1;
-		for (i=0; i<old_ba_used; i++) {
-			if ( old_ba[i].blockindex == old_block_last_index ) {
-				old_ba[i].active = 0;
-				k = i;
-				break;
+	// 完整的block: [lo, hi)，文件的最后一个block只要覆盖到文件尾部即可
+	lo = (offset + BLOCK_DATASIZE - 1) / BLOCK_DATASIZE;
+	hi = end / BLOCK_DATASIZE;
+	if ( end == size && end % BLOCK_DATASIZE != 0 ) hi++;
+	
+	// 不完整的block写入0，只可能是头尾2个block
+	unsigned long long edge[2];
+	int i;
+	edge[0] = offset / BLOCK_DATASIZE;
+	edge[1] = (end - 1) / BLOCK_DATASIZE;
+	
+	// 延迟分配尚未写入的block，完整的直接丢弃，无需再分配block
+	if ( stream->dirty_count > 0 ) {
+		int j;
+		DirtyBlock *d;
+		i = dirty_search(stream, edge[0]);
+		if ( i < 0 ) i = -i - 1;
+		j = i;
+		for (; i<stream->dirty_count; i++) {
+			d = stream->dirty + i;
+			if ( d->fileblock > edge[1] ) {
+				stream->dirty[j++] = *d;
+				continue;
 			}
+			if ( d->fileblock >= lo && d->fileblock < hi ) continue;
+			off = 0;
+			if ( d->fileblock == edge[0] ) off = (unsigned short)(offset % BLOCK_DATASIZE);
+			n = BLOCK_DATASIZE - off;
+			if ( d->fileblock == edge[1] ) n = (unsigned short)((end - 1) % BLOCK_DATASIZE) + 1 - off;
+			memset(d->data + off, 0, n);
+			if ( j != i ) stream->dirty[j] = *d;
+			j++;
 		}
-		if ( k < 0 ) {
+		stream->dirty_count = j;
+	}
+	for (i=0; i<2; i++) {
+		fileblock = edge[i];
+		if ( i == 1 && fileblock == edge[0] ) break;
+		// depth=0时root不能释放，写入0
+		if ( fileblock >= lo && fileblock < hi && (stream->map_depth > 0 || fileblock > 0) ) continue;
+		if ( ! map_getw(ffs, stream, fileblock, &blockindex) ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+			return 0;
 		}
-		
-		// block_prev
-		u = 0;
-		for (i=0; i<old_ba_used; i++) {
-			if ( old_ba[i].blockindex == old_block_prev_index ) {
-				old_block_prev = old_ba[i].block;
-				u = 1;
-				break;
-			}
+		if ( blockindex == 0 ) continue;
+		if ( ! readblock(ffs, blockindex, block) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
 		}
-		if ( !u ) {
-			if ( ! readblock(ffs, old_block_prev_index, old_block) ) {
-				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-				return 1; // 到这里说明block有问题
-			}
-			
-			memcpy(old_ba[k].block, old_block, BLOCKSIZE);
-			old_ba[k].blockindex = old_block_prev_index;
-			old_ba[k].active = 1;
-			old_block_prev = old_ba[k].block;
+		off = 0;
+		if ( fileblock == edge[0] ) off = (unsigned short)(offset % BLOCK_DATASIZE);
+		n = BLOCK_DATASIZE - off;
+		if ( fileblock == edge[1] ) n = (unsigned short)((end - 1) % BLOCK_DATASIZE) + 1 - off;
+		memset(block + BLOCK_HEAD + off, 0, n);
+		if ( ! writeblock(ffs, blockindex, block) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 0;
 		}
-		
-		// prevblock->next_blockindex = 0;
-		memset(old_block_prev + 4, 0, 4);
-		
-		U32toB4(old_block_prev_index, b4);
-		memcpy(old_block_head + BLOCK_STOP_BLOCKINDEX, b4, 4);
-		old_offset = BLOCKSIZE;
-		U16toB2(old_offset, b2);
-		memcpy(old_block_head + BLOCK_OFFSET, b2, 2);
 	}
 	
-	for (i=0; i<old_ba_used; i++) {
-		if ( ! old_ba[i].active ) continue;
-		if ( ! writeblock(ffs, old_ba[i].blockindex, old_ba[i].block) ) {
+	// 释放完整的block
+	if ( lo < hi && stream->map_depth > 0 && stream->file_start_blockindex > 0 ) {
+		if ( ! map_punch(ffs, stream->file_start_blockindex, stream->map_depth, 0, lo, hi, &empty) ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+			return 0;
 		}
+		stream->leaf_blockindex = 0;
+	}
+	
+	if ( ! map_sync(ffs, stream) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 0;
 	}
 	
-	// commit
 	if ( ffs->tmp.state == 1 ) {
 		if ( ! FileFS_commit(ffs) ) {
-			return 1;
+			return 0;
 		}
 	}
-
-	return 0;
+	
+	return 1;
+}
+unsigned long long FileFS_ftell(FileFS *ffs, FFS_FILE *stream)
+{
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	if ( stream == NULL ) return 0;
+	
+	return stream->pos;
+}
+void FileFS_rewind(FileFS *ffs, FFS_FILE *stream)
+{
+	FileFS_fseek(ffs, stream, 0, FFS_SEEK_SET);
 }
 
-// return: 0:ok,1-err,2-old name format err,3-new name format err,4-old name not exist,5-new name exist, 6-old new format not match
-int FileFS_rename(FileFS *ffs, const char *old_name, const char *new_name)
+// =================================
+// return:
+// 0:not exist
+// 1:is file
+// 2:is dir
+static unsigned char FileFS_stat(FileFS *ffs, const char *name)
 {
-	if ( ffs == NULL ) return 1;
-	if ( ffs->fp == NULL ) return 1;
-	if ( old_name == NULL ) return 1;
-	if ( new_name == NULL ) return 1;
+	if ( name == NULL ) return 0;
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
 	
-	// =================================
-	// check old name
-	int i, start, len = (int)strlen(old_name);
+	int i, start, len = (int)strlen(name);
 	unsigned int blockindex;
-	if ( old_name[0] == '/' ) {
+	if ( name[0] == '/' ) {
 		blockindex = 1; // root
 		start = 1;
-	} else if ( old_name[0] == '~' ) { // home
+	} else if ( name[0] == '~' ) { // home
 		if ( ffs->tmp.state == 0 ) blockindex = ffs->home_pwd_blockindex; // pwd
 		else blockindex = ffs->tmp.home_pwd_blockindex;
 		start = 1;
@@ -2584,47 +3428,119 @@ int FileFS_rename(FileFS *ffs, const char *old_name, const char *new_name)
 		start = 0;
 	}
 	
-	char s[BLOCK_NAME_MAXSIZE+2];
+	char s[BLOCK_NAME_MAXSIZE + 2];
 	int slen = 0;
 	unsigned int index;
 	memset(s, 0, BLOCK_NAME_MAXSIZE+2);
 	for (i=start; i<len; i++) {
-		if ( old_name[i] == '/' ) {
+		if ( name[i] == '/' ) {
 			if ( slen == 0 ) continue;
 			s[slen] = 0;
-			if ( i == len - 1 ) break; // 留下最后一个s不判断
 			index = findPathBlockindex(ffs, blockindex, s);
-			if ( index < 1 ) {
-				return 2; // dir not exist
-			}
+			if ( index < 1 ) return 0;
 			blockindex = index;
 			slen = 0;
 			continue;
 		}
-		s[slen] = old_name[i];
+		s[slen] = name[i];
 		slen++;
-		if ( slen > BLOCK_NAME_MAXSIZE ) return 2; // name to long
+		if ( slen > BLOCK_NAME_MAXSIZE ) return 0;
 	}
-	if ( slen > 0 ) {
-		s[slen] = 0;
-		if ( slen > BLOCK_NAME_MAXSIZE ) return 2; // name to long
+	if ( slen == 0 ) return 2; // dir, name作为目录形式全部搜索完毕
+	
+	// slen > 0
+	s[slen] = 0; // 此时的s是形似xx/yy/zz/abc最后的abc，可能是文件，也可能是目录
+	if ( slen > BLOCK_NAME_MAXSIZE ) return 0;
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	strcpy(lastname, s);
+	
+	// ===============================
+	int r = dir_lookup(ffs, blockindex, lastname, &index);
+	if ( r < 0 ) return 0;
+	return (unsigned char)r; // 0-不存在,1-file,2-dir
+}
+
+unsigned char FileFS_file_exist(FileFS *ffs, const char *filename)
+{
+	unsigned char r = FileFS_stat(ffs, filename);
+	if ( r != 1 ) return 0;
+	return 1;
+}
+
+unsigned char FileFS_dir_exist(FileFS *ffs, const char *pathname)
+{
+	unsigned char r = FileFS_stat(ffs, pathname);
+	if ( r != 2 ) return 0;
+	return 1;
+}
+
+// 删除blockindex目录中的文件lastname，return: 同FileFS_remove
+static int do_remove(FileFS *ffs, char *lastname, unsigned int blockindex)
+{
+	// 检查文件是否存在
+	unsigned char block[BLOCKSIZE];
+	unsigned int block_head_index = blockindex, block_item_index = 0;
+	int r;
+	
+	// block_head
+	if ( ! readblock(ffs, blockindex, block) ) return 1;
+	
+	// 搜索block，检查是否有名称相同的目录或文件
+	unsigned char file_state = 0;
+	unsigned short item_offset = 0;
+	int item_n = 1;
+	
+	r = dir_find(ffs, block_head_index, block, lastname, block, &block_item_index, &item_offset);
+	if ( r < 0 ) return 1;
+	if ( r == 0 ) return 2; // file not exist
+	file_state = block[item_offset-25];
+	if ( (file_state & 0x01) == 0 ) return 2; // same path exist;
+	
+	item_n = item_slots(block + item_offset - 25);
+	
+	// =======================
+	// 正式开始删除dir_block(保存了文件名的目录块)
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+
+	// 删除文件内容，inline文件的内容在目录项中
+	if ( ! item_freecontent(ffs, block + item_offset - 25) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
 	}
 	
-	char old_lastname[BLOCK_NAME_MAXSIZE+1];
-	strcpy(old_lastname, s);
-	if ( strcmp(old_lastname, ".") == 0 ) return 2;
-	if ( strcmp(old_lastname, "..") == 0 ) return 2;
-	unsigned int old_blockindex = blockindex;
-	unsigned char old_type_dir = 0;
-	if ( old_name[len-1] == '/' ) old_type_dir = 1; // 尾部有'/'，说明old_name只能是目录
+	// 删除目录项，目录最后的项目移动过来
+	dcache_drop(ffs, block_head_index, lastname);
+	if ( ! dir_delslots(ffs, block_head_index, block_item_index, item_offset - 25, item_n) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
 	
-	// ========================================
-	// check new name
-	len = (int)strlen(new_name);
-	if ( new_name[0] == '/' ) {
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 1;
+		}
+	}
+	
+	// ============================================
+	return 0;
+}
+
+// return: 0-ok,1-gen err,2-file not exist,3-dir not existed,4-name>limit(14byte),5-name format err
+int FileFS_remove(FileFS *ffs, const char *filename)
+{
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	if ( filename == NULL ) return 1;
+	
+	// ===================================
+	// 检查路径
+	int i, start, len = (int)strlen(filename);
+	if ( filename[len-1] == '/' ) return 5; // ...xyz/，最后一位是'/'，表示不是文件
+	unsigned int blockindex;
+	if ( filename[0] == '/' ) {
 		blockindex = 1; // root
 		start = 1;
-	} else if ( new_name[0] == '~' ) { // home
+	} else if ( filename[0] == '~' ) { // home
 		if ( ffs->tmp.state == 0 ) blockindex = ffs->home_pwd_blockindex; // pwd
 		else blockindex = ffs->tmp.home_pwd_blockindex;
 		start = 1;
@@ -2634,10 +3550,242 @@ int FileFS_rename(FileFS *ffs, const char *old_name, const char *new_name)
 		start = 0;
 	}
 	
-	slen = 0;
-	memset(s, 0, BLOCK_NAME_MAXSIZE+2);
+	char s[BLOCK_NAME_MAXSIZE+2];
+	int slen = 0;
+	unsigned int index;
 	for (i=start; i<len; i++) {
-		if ( new_name[i] == '/' ) {
+		if ( filename[i] == '/' ) {
+			if ( slen == 0 ) continue;
+			s[slen] = 0;
+			index = findPathBlockindex(ffs, blockindex, s);
+			if ( index < 1 ) {
+				return 3; // dir not exist
+			}
+			blockindex = index;
+			slen = 0;
+			continue;
+		}
+		s[slen] = filename[i];
+		slen++;
+		if ( slen > BLOCK_NAME_MAXSIZE ) return 4; // name to long
+	}
+	if ( slen == 0 ) return 2; // just path, no filename
+	
+	s[slen] = 0;
+	if ( slen > BLOCK_NAME_MAXSIZE ) return 4; // name to long
+	
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	strcpy(lastname, s);
+	if ( strcmp(lastname, ".") == 0 ) return 5; // format err
+	if ( strcmp(lastname, "..") == 0 ) return 5; // format err
+	
+	return do_remove(ffs, lastname, blockindex);
+}
+
+// =====================
+static int do_rename(FileFS *ffs, 
+	char *old_lastname, unsigned int old_blockindex, unsigned char old_type_dir, 
+	char *new_lastname, unsigned int new_blockindex, unsigned char new_type_dir)
+{
+	unsigned int index;
+	
+	// ===================================
+	unsigned char b4[4];
+	// ===================================
+	// old lastname exist
+	unsigned char old_block[BLOCKSIZE];
+	unsigned char old_dir_file;
+	unsigned int old_block_head_index = old_blockindex, old_block_item_index = 0;
+	int r;
+	
+	// block_head
+	if ( ! readblock(ffs, old_blockindex, old_block) ) return 1;
+	
+	// 搜索block，检查是否有名称相同的目录或文件
+	unsigned short old_item_offset = 0;
+	int old_item_n = 1;
+	r = dir_find(ffs, old_block_head_index, old_block, old_lastname, old_block, &old_block_item_index, &old_item_offset);
+	if ( r < 0 ) return 1;
+	if ( r == 0 ) return 4; // old lastname item not exist
+	old_dir_file = old_block[old_item_offset-25] & 0x01; // 0-dir,1-file
+	if ( old_type_dir == 1 && old_dir_file == 1 ) return 2; // old_name指定为目录，读取出来为文件，前后不一致
+	if ( new_type_dir == 1 && old_dir_file == 1 ) return 6; // new_name指定为目录，old_name为文件，格式不匹配
+	old_item_n = item_slots(old_block + old_item_offset - 25);
+	
+	// ===================================
+	// new lastname no exist
+	unsigned char new_block[BLOCKSIZE];
+	unsigned int new_block_head_index = new_blockindex;
+	unsigned short new_item_offset;
+	
+	// block_head
+	if ( ! readblock(ffs, new_blockindex, new_block) ) return 1;
+	
+	// 搜索block，检查是否有名称相同的目录或文件
+	r = dir_find(ffs, new_block_head_index, new_block, new_lastname, new_block, &index, &new_item_offset);
+	if ( r < 0 ) return 1;
+	if ( r > 0 ) return 5; // new name already exist
+	
+	// =======================================
+	// 此时old_name存在，new_name不存在
+	// =======================================
+	// old和new在同一个目录中，只需更换lastname即可
+	if ( old_block_head_index == new_block_head_index ) {
+		memset(old_block + old_item_offset - 10 - 14, 0, BLOCK_NAME_MAXSIZE);
+		memcpy(old_block + old_item_offset - 10 - 14, new_lastname, strlen(new_lastname));
+		
+		if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+		dcache_drop(ffs, old_block_head_index, old_lastname);
+		dcache_drop(ffs, old_block_head_index, new_lastname);
+		if ( ! writeblock(ffs, old_block_item_index, old_block) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 1;
+		}
+		// 索引中的记录按新的名称重新加入，位置不变
+		if ( ! readblock(ffs, old_block_head_index, new_block) 
+			|| ! dirindex_update(ffs, B4toU32(new_block+8), (unsigned char*)old_lastname, old_block_item_index, old_item_offset - 25, 0, 0)
+			|| ! dirindex_insert(ffs, old_block_head_index, (unsigned char*)new_lastname, old_block_item_index, old_item_offset) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 1;
+		}
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) {
+				return 1;
+			}
+		}
+		return 0;
+	}
+	
+	// =======================================
+	// old和new不在同一个目录中
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	dcache_drop(ffs, old_block_head_index, old_lastname);
+	dcache_drop(ffs, new_block_head_index, new_lastname);
+	
+	// 若移动的是目录，需将(new_item指向的目录块)->..->start_blockindex = new_block_head_index
+	unsigned int path_blockindex;
+	unsigned char path_block[BLOCKSIZE];
+	if ( old_dir_file == 0 ) {
+		memcpy(b4, old_block + old_item_offset - 10, 4);
+		path_blockindex = B4toU32(b4);
+		if ( ! readblock(ffs, path_blockindex, path_block) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 1;
+		}
+		U32toB4(new_block_head_index, b4);
+		memcpy(path_block + BLOCK_HEAD + 25 + 1 + 14, b4, 4);
+		dcache_drop(ffs, path_blockindex, "..");
+		if ( ! writeblock(ffs, path_blockindex, path_block) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 1;
+		}
+	}
+	
+	// == 在new_block中创建一个新的item，将old_item(包括inline文件的全部slot)复制过来
+	unsigned int item_blockindex;
+	unsigned short item_offset;
+	memset(old_block + old_item_offset - 10 - 14, 0, BLOCK_NAME_MAXSIZE);
+	memcpy(old_block + old_item_offset - 10 - 14, new_lastname, strlen(new_lastname));
+	if ( ! dir_addslots(ffs, new_block_head_index, old_block + old_item_offset - 25, old_item_n, &item_blockindex, &item_offset) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
+	
+	// == 删除old_item，目录最后的项目移动过来
+	if ( ! dir_delslots(ffs, old_block_head_index, old_block_item_index, old_item_offset - 25, old_item_n) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
+	
+	// commit
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// return: 0:ok,1-err,2-old name format err,3-new name format err,4-old name not exist,5-new name exist, 6-old new format not match
+int FileFS_rename(FileFS *ffs, const char *old_name, const char *new_name)
+{
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	if ( old_name == NULL ) return 1;
+	if ( new_name == NULL ) return 1;
+	
+	// =================================
+	// check old name
+	int i, start, len = (int)strlen(old_name);
+	unsigned int blockindex;
+	if ( old_name[0] == '/' ) {
+		blockindex = 1; // root
+		start = 1;
+	} else if ( old_name[0] == '~' ) { // home
+		if ( ffs->tmp.state == 0 ) blockindex = ffs->home_pwd_blockindex; // pwd
+		else blockindex = ffs->tmp.home_pwd_blockindex;
+		start = 1;
+	} else {
+		if ( ffs->tmp.state == 0 ) blockindex = ffs->pwd_blockindex; // pwd
+		else blockindex = ffs->tmp.pwd_blockindex;
+		start = 0;
+	}
+	
+	char s[BLOCK_NAME_MAXSIZE+2];
+	int slen = 0;
+	unsigned int index;
+	memset(s, 0, BLOCK_NAME_MAXSIZE+2);
+	for (i=start; i<len; i++) {
+		if ( old_name[i] == '/' ) {
+			if ( slen == 0 ) continue;
+			s[slen] = 0;
+			if ( i == len - 1 ) break; // 留下最后一个s不判断
+			index = findPathBlockindex(ffs, blockindex, s);
+			if ( index < 1 ) {
+				return 2; // dir not exist
+			}
+			blockindex = index;
+			slen = 0;
+			continue;
+		}
+		s[slen] = old_name[i];
+		slen++;
+		if ( slen > BLOCK_NAME_MAXSIZE ) return 2; // name to long
+	}
+	if ( slen > 0 ) {
+		s[slen] = 0;
+		if ( slen > BLOCK_NAME_MAXSIZE ) return 2; // name to long
+	}
+	
+	char old_lastname[BLOCK_NAME_MAXSIZE+1];
+	strcpy(old_lastname, s);
+	if ( strcmp(old_lastname, ".") == 0 ) return 2;
+	if ( strcmp(old_lastname, "..") == 0 ) return 2;
+	unsigned int old_blockindex = blockindex;
+	unsigned char old_type_dir = 0;
+	if ( old_name[len-1] == '/' ) old_type_dir = 1; // 尾部有'/'，说明old_name只能是目录
+	
+	// ========================================
+	// check new name
+	len = (int)strlen(new_name);
+	if ( new_name[0] == '/' ) {
+		blockindex = 1; // root
+		start = 1;
+	} else if ( new_name[0] == '~' ) { // home
+		if ( ffs->tmp.state == 0 ) blockindex = ffs->home_pwd_blockindex; // pwd
+		else blockindex = ffs->tmp.home_pwd_blockindex;
+		start = 1;
+	} else {
+		if ( ffs->tmp.state == 0 ) blockindex = ffs->pwd_blockindex; // pwd
+		else blockindex = ffs->tmp.pwd_blockindex;
+		start = 0;
+	}
+	
+	slen = 0;
+	memset(s, 0, BLOCK_NAME_MAXSIZE+2);
+	for (i=start; i<len; i++) {
+		if ( new_name[i] == '/' ) {
 			if ( slen == 0 ) continue;
 			s[slen] = 0;
 			if ( i == len - 1 ) break; // 留下最后一个s不判断
@@ -2888,60 +4036,34 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 
 	// ===========================
 	unsigned char b4[4], b2[2];
-	int k;
 	// ===================================
 	// check from filename, exist
 	unsigned char from_block[BLOCKSIZE];
 	unsigned char state, dir_file;
-	unsigned int from_stop_blockindex;
-	unsigned short from_offset;
 	
 	// block_head
 	if ( ! readblock(ffs, from_blockindex, from_block) ) return 1;
-	memcpy(b4, from_block+(12+1+14+4), 4);
-	from_stop_blockindex = B4toU32(b4);
-	memcpy(b2, from_block+(12+1+14+4+4), 2);
-	from_offset = B2toU16(b2);
 	
 	// 搜索block，检查是否有名称相同的目录或文件
 	unsigned int from_file_start_blockindex, from_file_stop_blockindex;
 	unsigned short from_file_offset;
-	unsigned char flag = 0;
-	index = from_blockindex;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			if ( index == from_stop_blockindex && k+1 >= from_offset ) { // 已搜索到最后
-				return 4; // from lastname item not exist
-			}
-			state = from_block[k]; k++;
-			memcpy(s, from_block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, from_lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
-			}
-			dir_file = state & 0x01; // 0-dir,1-file
-			if ( dir_file != 1 ) return 2; // from format err
-			memcpy(b4, from_block+k, 4); k += 4;
-			from_file_start_blockindex = B4toU32(b4);
-			memcpy(b4, from_block+k, 4); k += 4;
-			from_file_stop_blockindex = B4toU32(b4);
-			memcpy(b2, from_block+k, 2);
-			from_file_offset = B2toU16(b2);
-			// printf("from_file, start, stop index, offset:%d %d %d\n", from_file_start_blockindex, from_file_stop_blockindex, from_file_offset);
-			
-			flag = 1;
-			break;
-		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, from_block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 1; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, from_block) ) return 1; // 到这里说明block有问题
-	}
+	unsigned char from_state = ITEM_FILE;
+	unsigned short from_item_offset = 0;
+	int r;
+	r = dir_find(ffs, from_blockindex, from_block, from_lastname, from_block, &index, &from_item_offset);
+	if ( r < 0 ) return 1;
+	if ( r == 0 ) return 4; // from lastname item not exist
+	// 源文件延迟分配的数据先写入
+	r = delay_flushitem(ffs, index, from_item_offset);
+	if ( r < 0 ) return 1;
+	if ( r > 0 && ! readblock(ffs, index, from_block) ) return 1;
+	state = from_block[from_item_offset-25];
+	dir_file = state & 0x01; // 0-dir,1-file
+	if ( dir_file != 1 ) return 2; // from format err
+	from_state = state;
+	from_file_start_blockindex = B4toU32(from_block+from_item_offset-10);
+	from_file_stop_blockindex = B4toU32(from_block+from_item_offset-6);
+	from_file_offset = B2toU16(from_block+from_item_offset-2);
 	
 	// ===========================
 	// check to_lastname, not exist
@@ -2982,34 +4104,34 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 		to_ba_used++;
 	}
 	
-	// 搜索block，检查是否有名称相同的目录或文件
-	flag = 0;
-	index = to_block_head_index;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			// printf("index:%d, to_stop_blockindex:%d, k=%d, offset:%d\n", index, to_stop_blockindex, k, offset);
-			if ( index == to_stop_blockindex && k+1 >= to_offset ) { // 已搜索到最后
-				flag = 1;
-				break; // new lastname item not exist
-			}
-			
-			k++;
-			memcpy(s, to_block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, to_lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
+	// 检查是否有名称相同的目录或文件
+	unsigned short to_item_offset;
+	r = dir_find(ffs, to_block_head_index, to_block_head, to_lastname, to_block, &index, &to_item_offset);
+	if ( r < 0 ) return 1;
+	if ( r > 0 ) return 5; // to_lastname already exist
+	
+	dcache_drop(ffs, to_block_head_index, to_lastname);
+	
+	// ===========================
+	// inline文件，内容在目录项中，复制全部slot即可
+	if ( from_state & ITEM_INLINE ) {
+		unsigned int item_blockindex;
+		unsigned short item_offset;
+		memset(from_block + from_item_offset - 24, 0, BLOCK_NAME_MAXSIZE);
+		memcpy(from_block + from_item_offset - 24, to_lastname, strlen(to_lastname));
+		
+		if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+		if ( ! dir_addslots(ffs, to_block_head_index, from_block + from_item_offset - 25, item_slots(from_block + from_item_offset - 25), 
+			&item_blockindex, &item_offset) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 1;
+		}
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) {
+				return 1;
 			}
-			return 5; // to_lastname already exist
 		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, to_block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 1; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, to_block) ) return 1; // 到这里说明block有问题
+		return 0;
 	}
 	
 	// ===========================
@@ -3017,14 +4139,14 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
 	
 	// == 在to_block中创建一个新的item，将old_item复制过来
-	unsigned int blockindex_2;
+	unsigned int blockindex_2 = 0;
 	unsigned char block_2[BLOCKSIZE];
 	unsigned short new_to_offset;
 	
 	if ( to_offset < BLOCKSIZE ) { // 最后一个block未填满		
 		// 向to_block_last写入lastname目录项
 		memset(to_block_last + to_offset, 0, 25);
-		to_block_last[to_offset] = 1; // file
+		to_block_last[to_offset] = from_state; // file
 		memcpy(to_block_last + to_offset + 1, to_lastname, (int)strlen(to_lastname));
 		
 		new_to_offset = to_offset + 25;
@@ -3032,7 +4154,7 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 		memcpy(to_block_head + BLOCK_OFFSET, b2, 2);
 	} else { // 最后一个block已填满
 		// 创建存储lastname的目录延伸块
-		blockindex_2 = genblockindex(ffs);
+		blockindex_2 = genblockindex_near(ffs, to_block_head_index);
 		if ( blockindex_2 == 0 ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 			return 1;
@@ -3041,7 +4163,7 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 		// prevblockindex
 		U32toB4(to_block_last_index, b4);
 		memcpy(block_2+8, b4, 4);
-		block_2[BLOCK_HEAD] = 1; // file
+		block_2[BLOCK_HEAD] = from_state; // file
 		// copy lastname
 		memcpy(block_2 + BLOCK_HEAD + 1, to_lastname, (int)strlen(to_lastname));
 		
@@ -3066,7 +4188,28 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 	unsigned int new_blockindex, prev_index;
 	unsigned char new_block[BLOCKSIZE];
 	
-	if ( from_file_start_blockindex > 0 ) {
+	if ( from_state & ITEM_MAP ) { // 块映射文件，共享整个映射树(reflink)，写入时才复制
+		if ( from_file_start_blockindex > 0 ) {
+			unsigned int count;
+			if ( ! ref_get(ffs, from_file_start_blockindex, &count) || ! ref_set(ffs, from_file_start_blockindex, count + 1) ) {
+				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+				return 1;
+			}
+			to_file_start_blockindex = from_file_start_blockindex;
+		}
+		if ( from_file_stop_blockindex > 0 ) { // 打包的尾部复制到目标目录的pack block
+			if ( ! pack_copy(ffs, from_file_stop_blockindex, from_file_offset, to_block_head_index, &to_file_stop_blockindex, &to_file_offset) ) {
+				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+				return 1;
+			}
+			// 目录头块中的pack block可能已改变，之后写入to_block_head时不能覆盖
+			if ( ! readblock(ffs, to_block_head_index, new_block) ) {
+				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+				return 1;
+			}
+			memcpy(to_block_head + BLOCK_PACK_BLOCKINDEX, new_block + BLOCK_PACK_BLOCKINDEX, 4);
+		}
+	} else if ( from_file_start_blockindex > 0 ) {
 		to_file_offset = from_file_offset;
 		
 		from_index = from_file_start_blockindex;
@@ -3078,7 +4221,7 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 		memcpy(b4, from_block + 4, 4);
 		from_next_index = B4toU32(b4);
 		
-		new_blockindex = genblockindex(ffs);
+		new_blockindex = genblockindex_near(ffs, to_block_head_index);
 		if ( new_blockindex == 0 ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 			return 1;
@@ -3150,6 +4293,11 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 			return 1;
 		}
 	}
+	if ( ! dirindex_insert(ffs, to_block_head_index, (unsigned char*)to_lastname, 
+		to_offset < BLOCKSIZE ? to_block_last_index : blockindex_2, to_offset < BLOCKSIZE ? to_offset + 25 : BLOCK_HEAD + 25) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
 	
 	// commit
 	if ( ffs->tmp.state == 1 ) {
@@ -3160,21 +4308,248 @@ int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename)
 
 	return 0;
 }
-// =============================================
 
-static unsigned char InitPwdtmp(FileFS *ffs, char *s)
+// =============================================
+// 数据块内容的hash，只用于在内存中查找候选block，合并前还要比较内容，SSE2和普通实现的结果相同
+static const unsigned long long dedup_key[4] = {
+	0x9E3779B185EBCA87ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL
+};
+static unsigned long long dedup_hash(const unsigned char *data)
 {
-	int len = (int)strlen(s);
-	void *p;
-	
-	if ( len+1 > ffs->pwd_tmp_size ) {
-		p = realloc(ffs->pwd_tmp, len+1);
-		if ( p == NULL ) return 0;
-		ffs->pwd_tmp = (char*)p;
-		ffs->pwd_tmp_size = len + 1;
+	unsigned long long acc[2], h;
+	int i;
+#ifdef FFS_SSE2
+	__m128i a = _mm_setzero_si128(), d, dk;
+	__m128i key0 = _mm_loadu_si128((const __m128i*)dedup_key), key1 = _mm_loadu_si128((const __m128i*)(dedup_key+2));
+	for (i=0; i+16<=BLOCK_DATASIZE; i+=16) {
+		d = _mm_loadu_si128((const __m128i*)(data+i));
+		dk = _mm_xor_si128(d, (i & 16) ? key1 : key0);
+		// acc += 交换高低64位的数据 + 每64位的低32位*高32位
+		a = _mm_add_epi64(a, _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2)));
+		a = _mm_add_epi64(a, _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1))));
+	}
+	_mm_storeu_si128((__m128i*)acc, a);
+#else
+	unsigned long long d0, d1, k0, k1;
+	const unsigned long long *key;
+	acc[0] = acc[1] = 0;
+	for (i=0; i+16<=BLOCK_DATASIZE; i+=16) {
+		memcpy(&d0, data+i, 8);
+		memcpy(&d1, data+i+8, 8);
+		key = dedup_key + ((i & 16) ? 2 : 0);
+		k0 = d0 ^ key[0];
+		k1 = d1 ^ key[1];
+		acc[0] += d1 + (k0 & 0xFFFFFFFF) * (k0 >> 32);
+		acc[1] += d0 + (k1 & 0xFFFFFFFF) * (k1 >> 32);
 	}
-	
-	strcpy(ffs->pwd_tmp, s);
+#endif
+	h = acc[0] ^ (acc[1] * 0x9E3779B185EBCA87ULL);
+	for (; i<BLOCK_DATASIZE; i++) h = (h ^ data[i]) * 0x100000001B3ULL;
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	return h;
+}
+// 查找hash所在的位置，不存在时返回空位
+static DedupItem *dedup_slot(DedupTable *t, unsigned long long hash)
+{
+	unsigned int i = (unsigned int)hash & (t->size - 1);
+	while ( t->items[i].blockindex != 0 && t->items[i].hash != hash ) i = (i + 1) & (t->size - 1);
+	return t->items + i;
+}
+// 扩大hash表，保证至少一半为空位
+static unsigned char dedup_grow(DedupTable *t)
+{
+	DedupTable n;
+	unsigned int i;
+	
+	if ( t->size > 0 && t->count * 2 < t->size ) return 1;
+	n.size = t->size > 0 ? t->size * 2 : 4096;
+	n.count = t->count;
+	n.items = (DedupItem*)calloc(n.size, sizeof(DedupItem));
+	if ( n.items == NULL ) return 0;
+	for (i=0; i<t->size; i++) {
+		if ( t->items[i].blockindex == 0 ) continue;
+		*dedup_slot(&n, t->items[i].hash) = t->items[i];
+	}
+	free(t->items);
+	*t = n;
+	return 1;
+}
+// 合并一个文件中与之前扫描过的block内容相同的数据块，dir_offset为文件目录项的尾部
+static unsigned char dedup_file(FileFS *ffs, unsigned char *dir_block, unsigned int dir_blockindex, unsigned short dir_offset, 
+	unsigned int dir_head_blockindex, DedupTable *t, FFS_dedup *st, unsigned int *batch, 
+	void (*progress)(const FFS_dedup *stat, void *arg), void *arg)
+{
+	unsigned char block[BLOCKSIZE], block_c[BLOCKSIZE];
+	unsigned long long fileblock, count, hash;
+	unsigned int blockindex, n;
+	unsigned char changed = 0;
+	DedupItem *item;
+	
+	// "r+"打开，block链文件转换为块映射文件
+	FFS_FILE *stream = do_fopen_item(ffs, dir_block, dir_blockindex, dir_offset, dir_head_blockindex, 3);
+	if ( stream == NULL ) return 0;
+	// inline文件和root就是数据块的文件没有可以共享的block，打包的尾部在映射中为0
+	if ( ! stream->map || stream->map_depth == 0 ) {
+		free(stream);
+		return 1;
+	}
+	
+	count = (stream->size + BLOCK_DATASIZE - 1) / BLOCK_DATASIZE;
+	for (fileblock=0; fileblock<count; fileblock++) {
+		if ( ! map_get(ffs, stream, fileblock, &blockindex) ) goto err;
+		if ( blockindex == 0 ) continue; // 空洞
+		st->blocks++;
+		if ( ! readblock(ffs, blockindex, block) ) goto err;
+		if ( ! dedup_grow(t) ) goto err;
+		
+		hash = dedup_hash(block+BLOCK_HEAD);
+		item = dedup_slot(t, hash);
+		if ( item->blockindex == 0 ) {
+			item->hash = hash;
+			item->blockindex = blockindex;
+			t->count++;
+			continue;
+		}
+		if ( item->blockindex == blockindex ) continue; // 已经共享
+		if ( ! readblock(ffs, item->blockindex, block_c) ) goto err;
+		if ( memcmp(block+BLOCK_HEAD, block_c+BLOCK_HEAD, BLOCK_DATASIZE) != 0 ) continue; // hash冲突
+		
+		// 映射指向候选block，候选block的引用数量加1，原来的block引用数量减1(为0时释放)
+		if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+		if ( ! map_set(ffs, stream, fileblock, item->blockindex) ) goto err;
+		if ( ! ref_get(ffs, item->blockindex, &n) || ! ref_set(ffs, item->blockindex, n + 1) ) goto err;
+		if ( ! ref_get(ffs, blockindex, &n) ) goto err;
+		if ( ! map_free(ffs, blockindex, 0) ) goto err;
+		changed = 1;
+		st->merged++;
+		if ( n == 0 ) st->freed++;
+		
+		if ( ++(*batch) >= DEDUP_BATCH && ffs->tmp.state == 1 ) {
+			if ( ! map_sync(ffs, stream) ) goto err;
+			if ( ! FileFS_commit(ffs) ) {
+				free(stream);
+				return 0;
+			}
+			changed = 0;
+			*batch = 0;
+			if ( progress != NULL ) progress(st, arg);
+		}
+	}
+	
+	if ( changed && ! map_sync(ffs, stream) ) goto err;
+	free(stream);
+	return 1;
+	
+err:
+	if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+	free(stream);
+	return 0;
+}
+unsigned char FileFS_dedup(FileFS *ffs, const char *pathname, FFS_dedup *stat, void (*progress)(const FFS_dedup *stat, void *arg), void *arg)
+{
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	if ( pathname == NULL ) return 0;
+	
+	unsigned char block[BLOCKSIZE], b4[4], b2[2];
+	unsigned int head_index, index, stop_blockindex, batch = 0;
+	unsigned int *dirs;
+	int dir_count = 0, dir_size = 64, k, limit;
+	unsigned short offset;
+	unsigned char ok = 1;
+	DedupTable t;
+	FFS_dedup st;
+	char *abs;
+	
+	FFS_DIR *dir = FileFS_opendir(ffs, pathname, &abs);
+	if ( dir == NULL ) return 0;
+	dirs = (unsigned int*)malloc(dir_size * sizeof(unsigned int));
+	if ( dirs == NULL ) {
+		FileFS_closedir(ffs, dir);
+		return 0;
+	}
+	dirs[dir_count++] = dir->head_blockindex;
+	FileFS_closedir(ffs, dir);
+	
+	memset(&t, 0, sizeof(DedupTable));
+	memset(&st, 0, sizeof(FFS_dedup));
+	
+	// 从pathname开始遍历全部子目录
+	while ( ok && dir_count > 0 ) {
+		head_index = dirs[--dir_count];
+		if ( ! readblock(ffs, head_index, block) ) {
+			ok = 0;
+			break;
+		}
+		memcpy(b4, block+BLOCK_STOP_BLOCKINDEX, 4);
+		stop_blockindex = B4toU32(b4);
+		memcpy(b2, block+BLOCK_OFFSET, 2);
+		offset = B2toU16(b2);
+		
+		index = head_index;
+		while ( 1 ) {
+			limit = (index == stop_blockindex) ? offset : BLOCKSIZE;
+			for (k=BLOCK_HEAD; k+25<=limit; k+=25) {
+				if ( block[k] & ITEM_SLOT ) continue; // inline文件的后续项或空位
+				if ( (block[k] & ITEM_FILE) == 0 ) { // 子目录
+					if ( block[k+1] == '.' && (block[k+2] == 0 || (block[k+2] == '.' && block[k+3] == 0)) ) continue;
+					if ( dir_count == dir_size ) {
+						unsigned int *p = (unsigned int*)realloc(dirs, dir_size * 2 * sizeof(unsigned int));
+						if ( p == NULL ) {
+							ok = 0;
+							break;
+						}
+						dirs = p;
+						dir_size *= 2;
+					}
+					memcpy(b4, block+k+15, 4);
+					dirs[dir_count++] = B4toU32(b4);
+					continue;
+				}
+				st.files++;
+				if ( ! dedup_file(ffs, block, index, (unsigned short)(k+25), head_index, &t, &st, &batch, progress, arg) ) {
+					ok = 0;
+					break;
+				}
+			}
+			if ( ! ok || index == stop_blockindex ) break;
+			memcpy(b4, block+4, 4);
+			index = B4toU32(b4);
+			// 转换block链文件或合并时可能改变了目录块，重新读取
+			if ( index == 0 || ! readblock(ffs, index, block) ) {
+				ok = 0;
+				break;
+			}
+		}
+	}
+	
+	if ( ok && ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) ok = 0;
+		else if ( batch > 0 && progress != NULL ) progress(&st, arg);
+	}
+	
+	free(t.items);
+	free(dirs);
+	if ( stat != NULL ) *stat = st;
+	return ok;
+}
+// =============================================
+
+static unsigned char InitPwdtmp(FileFS *ffs, char *s)
+{
+	int len = (int)strlen(s);
+	void *p;
+	
+	if ( len+1 > ffs->pwd_tmp_size ) {
+		p = realloc(ffs->pwd_tmp, len+1);
+		if ( p == NULL ) return 0;
+		ffs->pwd_tmp = (char*)p;
+		ffs->pwd_tmp_size = len + 1;
+	}
+	
+	strcpy(ffs->pwd_tmp, s);
 	return 1;
 }
 static unsigned char AddToPwdtmp(FileFS *ffs, int pathsize, char *s)
@@ -3524,10 +4899,10 @@ unsigned char FileFS_chwork(FileFS *ffs)
 
 // ======================
 static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex, unsigned char *start_block, 
-	unsigned int cur_blockindex, unsigned char *cur_block, 
-	unsigned int stop_blockindex, unsigned short offset)
+	unsigned int cur_blockindex, unsigned char *cur_block, unsigned short offset)
 {
 	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	dcache_drop(ffs, start_blockindex, lastname);
 	
 	//printf("start_blockindex:%d, cur_blockindex:%d, stop_blockindex:%d, offset:%d\n",
 		//start_blockindex, cur_blockindex, stop_blockindex, offset);
@@ -3542,7 +4917,7 @@ static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex,
 	// 最后一个block未填满
 	if ( offset < BLOCKSIZE ) {
 		// == 创建lastname所指向的block
-		new_blockindex = genblockindex(ffs);
+		new_blockindex = genblockindex_near(ffs, start_blockindex);
 		if ( new_blockindex == 0 ) {
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 			return 1;
@@ -3620,9 +4995,6 @@ static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex,
 				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 				return 1;
 			}
-			if ( ffs->tmp.state == 1 ) {
-				if ( ! FileFS_commit(ffs) ) return 1;
-			}
 		} else { // 当前目录有多个block
 			if ( ! writeblock(ffs, cur_blockindex, cur_block) ) {
 				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
@@ -3633,12 +5005,14 @@ static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex,
 				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 				return 1;
 			}
-			
-			if ( ffs->tmp.state == 1 ) {
-				if ( ! FileFS_commit(ffs) ) {
-					return 1;
-				}
-			}
+		}
+		if ( ! dirindex_insert(ffs, start_blockindex, (unsigned char*)lastname, cur_blockindex, new_offset) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 1;
+		}
+		
+		if ( ffs->tmp.state == 1 ) {
+			if ( ! FileFS_commit(ffs) ) return 1;
 		}
 		
 		return 0;
@@ -3646,7 +5020,7 @@ static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex,
 	
 	// 最后一个block已填满
 	// ======================================
-	new_blockindex = genblockindex(ffs); // 提前生成lastname指向的目录块
+	new_blockindex = genblockindex_near(ffs, start_blockindex); // 提前生成lastname指向的目录块
 	if ( new_blockindex == 0 ) {
 		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 		return 1;
@@ -3655,7 +5029,7 @@ static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex,
 	// gen block_2 for lastname;
 	// block_2->prevblockindex = cur_blockindex;
 	// write;
-	blockindex_2 = genblockindex(ffs);
+	blockindex_2 = genblockindex_near(ffs, start_blockindex);
 	if ( blockindex_2 == 0 ) {
 		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 		return 1;
@@ -3751,11 +5125,6 @@ static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex,
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 			return 1;
 		}
-		if ( ffs->tmp.state == 1 ) {
-			if ( ! FileFS_commit(ffs) ) {
-				return 1;
-			}
-		}
 	} else { // 当前目录有多个block
 		// write cur_block;
 		// modify stop_blockindex by start_block;
@@ -3771,17 +5140,53 @@ static int do_mkdir(FileFS *ffs, char *lastname, unsigned int start_blockindex,
 			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
 			return 1;
 		}
-		
-		if ( ffs->tmp.state == 1 ) {
-			if ( ! FileFS_commit(ffs) ) {
-				return 1;
-			}
+	}
+	if ( ! dirindex_insert(ffs, start_blockindex, (unsigned char*)lastname, blockindex_2, new_offset) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
+	
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 1;
 		}
 	}
 	
 	return 0;
 }
 
+// 检查blockindex目录中没有同名的项目后创建目录lastname，return: 同FileFS_mkdir
+static int do_mkdir_check(FileFS *ffs, char *lastname, unsigned int blockindex)
+{
+	unsigned int index;
+	unsigned char start_block[BLOCKSIZE], block[BLOCKSIZE];
+	unsigned int start_blockindex, stop_blockindex;
+	unsigned short offset, item_offset;
+	int r;
+	
+	// printf("blockindex:%d\n", blockindex);
+	if ( ! readblock(ffs, blockindex, start_block) ) return 1;
+	start_blockindex = blockindex;
+	stop_blockindex = B4toU32(start_block+BLOCK_STOP_BLOCKINDEX);
+	offset = B2toU16(start_block+BLOCK_OFFSET);
+	
+	// 搜索block，检查是否有名称相同的目录或文件
+	r = dir_find(ffs, start_blockindex, start_block, lastname, block, &index, &item_offset);
+	if ( r < 0 ) return 1;
+	if ( r > 0 ) {
+		if ( (block[item_offset-25] & 0x01) == 0 ) return 3; // same dir exist;
+		return 4; // same file exist
+	}
+	
+	// 新的目录项写入最后一个block
+	index = stop_blockindex;
+	if ( index == start_blockindex ) memcpy(block, start_block, BLOCKSIZE);
+	else if ( ! readblock(ffs, index, block) ) return 1;
+	
+	// 正式开始生成目录项
+	return do_mkdir(ffs, lastname, start_blockindex, start_block, index, block, offset);
+}
+
 // return: 0-ok,1-gen err,2-name>limit(14byte),3-dirtroy existed,4-exist same name file
 int FileFS_mkdir(FileFS *ffs, const char *pathname)
 {
@@ -3836,61 +5241,99 @@ int FileFS_mkdir(FileFS *ffs, const char *pathname)
 	char lastname[BLOCK_NAME_MAXSIZE+1];
 	strcpy(lastname, s);
 	
-	// ===============================
-	unsigned char start_block[BLOCKSIZE], block[BLOCKSIZE];
-	unsigned char state, dir_file;
+	return do_mkdir_check(ffs, lastname, blockindex);
+}
+
+// ========================================
+// 删除blockindex目录中的空目录lastname，return: 同FileFS_rmdir
+static int do_rmdir(FileFS *ffs, char *lastname, unsigned int blockindex)
+{
+	unsigned int index;
+	unsigned char block[BLOCKSIZE];
 	unsigned char b4[4], b2[2];
-	unsigned int start_blockindex, stop_blockindex;
-	unsigned short offset;
-	int k;
+	unsigned int block_head_index = blockindex, block_item_index = 0;
+	int r;
 	
-	// printf("blockindex:%d\n", blockindex);
+	// block_head
 	if ( ! readblock(ffs, blockindex, block) ) return 1;
-	memcpy(start_block, block, BLOCKSIZE);
-	start_blockindex = blockindex;
-	
-	memcpy(b4, block+(12+1+14+4), 4);
-	stop_blockindex = B4toU32(b4);
-	memcpy(b2, block+(12+1+14+4+4), 2);
-	offset = B2toU16(b2);
 	
 	// 搜索block，检查是否有名称相同的目录或文件
-	unsigned char flag = 0;
-	index = start_blockindex;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			// printf("index:%d, stop_blockindex:%d, k=%d, offset:%d\n", index, stop_blockindex, k, offset);
-			if ( index == stop_blockindex && k+1 >= offset ) { // 已搜索到最后
-				flag = 1;
-				break;
-			}
-			
-			state = block[k]; k++;
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
+	unsigned int subdirblockindex;
+	unsigned char subdirblock[BLOCKSIZE];
+	unsigned int subdir_start_blockindex, subdir_stop_blockindex;
+	unsigned short subdir_offset;
+	
+	unsigned short item_offset = 0;
+	
+	r = dir_find(ffs, block_head_index, block, lastname, block, &block_item_index, &item_offset);
+	if ( r < 0 ) return 1;
+	if ( r == 0 ) return 3; // dir item not exist
+	if ( block[item_offset-25] & 0x01 ) { // file
+		return 3; // same filename exist;
+	}
+	
+	// 检测子目录是否为空
+	memcpy(b4, block+item_offset-10, 4); subdirblockindex = B4toU32(b4);
+	if ( ! readblock(ffs, subdirblockindex, subdirblock) ) return 1;
+	// get sub dir blockindex and offset
+	memcpy(b4, subdirblock+BLOCK_START_BLOCKINDEX, 4); subdir_start_blockindex = B4toU32(b4);
+	memcpy(b4, subdirblock+BLOCK_STOP_BLOCKINDEX, 4); subdir_stop_blockindex = B4toU32(b4);
+	memcpy(b2, subdirblock+BLOCK_OFFSET, 2); subdir_offset = B2toU16(b2);
+	if ( subdir_stop_blockindex != subdir_start_blockindex ) return 2; // sub dir not empty
+	if ( subdir_offset > 62 ) return 2; // sub dir not empty
+	
+	// =======================
+	// 正式开始删除目录项
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	
+	// 子目录的pack block中可能还有移动到其它目录的文件的尾部，没有片段时释放，否则不再属于该目录
+	index = B4toU32(subdirblock + BLOCK_PACK_BLOCKINDEX);
+	if ( index > 0 ) {
+		if ( ! readblock(ffs, index, block) ) {
+			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+			return 1;
+		}
+		if ( B2toU16(block+6) == 0 ) {
+			removeblock(ffs, index);
+		} else {
+			memset(block+8, 0, 4);
+			if ( ! writeblock(ffs, index, block) ) {
+				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+				return 1;
 			}
-			dir_file = state & 0x01;
-			if ( dir_file == 0 ) return 3; // same dir exist;
-			return 4; // same file exist
 		}
-		if ( flag ) break;
-		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 1; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, block) ) return 1; // 到这里说明block有问题
 	}
 	
-	// 正式开始生成目录项
-	return do_mkdir(ffs, lastname, start_blockindex, start_block, index, block, stop_blockindex, offset);
+	// 子目录曾经很大时留下的散列索引
+	if ( ! dirindex_free(ffs, B4toU32(subdirblock+8)) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
+	
+	// removeblock 子目录
+	if ( ! dir_unmark(ffs, subdirblockindex, subdirblock) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
+	removeblock(ffs, subdirblockindex);
+	
+	// 删除目录项，目录最后的项目移动过来
+	dcache_drop(ffs, block_head_index, lastname);
+	dcache_dropdir(ffs, subdirblockindex);
+	if ( ! dir_delslots(ffs, block_head_index, block_item_index, item_offset - 25, 1) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
+	
+	if ( ffs->tmp.state == 1 ) {
+		if ( ! FileFS_commit(ffs) ) {
+			return 1;
+		}
+	}
+	
+	return 0;
 }
 
-// ========================================
 // return: 0-ok,1-gen err,2-sub dir not empty,3-dirtroy not existed,4-name>limit(14byte)
 int FileFS_rmdir(FileFS *ffs, const char *pathname)
 {
@@ -3944,226 +5387,235 @@ int FileFS_rmdir(FileFS *ffs, const char *pathname)
 	if ( strcmp(lastname, ".") == 0 ) return 1;
 	if ( strcmp(lastname, "..") == 0 ) return 1;
 	
-	// ===============================
-	BlockArray ba[4];
-	int ba_used = 0;
-	unsigned char *block_head, *block_last, *block_item, *block_prev;
-	unsigned int block_item_index, block_last_index, block_prev_index, block_head_index;
-	for (i=0; i<4; i++) ba[i].active = 0;
-	
+	return do_rmdir(ffs, lastname, blockindex);
+}
+
+// 释放文件的内容，item指向目录项的第一个slot，inline文件的内容在目录项中，无需释放，在事务中调用
+static unsigned char item_freecontent(FileFS *ffs, unsigned char *item)
+{
 	unsigned char block[BLOCKSIZE];
-	unsigned char state, dir_file;
-	unsigned char b4[4], b2[2];
-	unsigned int stop_blockindex;
-	unsigned short offset;
-	int k;
-	
-	// block_head
-	if ( ! readblock(ffs, blockindex, block) ) return 1;
-	memcpy(ba[0].block, block, BLOCKSIZE);
-	ba[0].blockindex = blockindex;
-	ba[0].active = 1;
-	block_head = ba[0].block;
-	block_head_index = blockindex;
-	ba_used = 1;
+	unsigned char state = item[0];
+	unsigned int start_blockindex = B4toU32(item+1+BLOCK_NAME_MAXSIZE);
+	unsigned int stop_blockindex = B4toU32(item+1+BLOCK_NAME_MAXSIZE+4);
 	
-	memcpy(b4, block_head+(12+1+14+4), 4);
-	stop_blockindex = B4toU32(b4);
-	memcpy(b2, block_head+(12+1+14+4+4), 2);
-	offset = B2toU16(b2);
-	
-	// block_last
-	if ( stop_blockindex == block_head_index ) {
-		block_last = block_head;
-		block_last_index = block_head_index;
-	} else {
-		if ( ! readblock(ffs, stop_blockindex, ba[1].block) ) return 1;
-		ba[1].blockindex = stop_blockindex;
-		ba[1].active = 1;
-		block_last = ba[1].block;
-		block_last_index = stop_blockindex;
-		ba_used++;
+	if ( state & ITEM_MAP ) { // 块映射文件
+		if ( start_blockindex > 0 ) {
+			if ( ! map_free(ffs, start_blockindex, (state & ITEM_DEPTH_MASK) >> ITEM_DEPTH_SHIFT) ) return 0;
+		}
+		if ( stop_blockindex > 0 ) { // 打包的尾部
+			if ( ! pack_free(ffs, stop_blockindex, B2toU16(item+1+BLOCK_NAME_MAXSIZE+8)) ) return 0;
+		}
+	} else if ( (state & ITEM_INLINE) == 0 && start_blockindex > 0 ) { // block链文件有内容，整个链接到未使用的block链
+		if ( ! readblock(ffs, stop_blockindex, block) ) return 0;
+		U32toB4(ffs->tmp.new_unused_blockhead, block+4);
+		ffs->tmp.new_unused_blockhead = start_blockindex;
+		ffs->tmp.free.count = 0;
+		if ( ! writeblock(ffs, stop_blockindex, block) ) return 0;
 	}
 	
-	// 搜索block，检查是否有名称相同的目录或文件
-	unsigned int subdirblockindex;
-	unsigned char subdirblock[BLOCKSIZE];
-	unsigned int subdir_start_blockindex, subdir_stop_blockindex;
-	unsigned short subdir_offset;
+	return 1;
+}
+
+// 释放目录head_blockindex中的全部文件、子目录和目录自身的block，不修改上级目录中的目录项，在事务中调用
+// 释放目录的头块之前清除"."的名称，过期的FFS_fileid不会再把这个block当作目录
+static unsigned char dir_unmark(FileFS *ffs, unsigned int head_blockindex, unsigned char *head)
+{
+	head[BLOCK_HEAD+1] = 0;
+	return writeblock(ffs, head_blockindex, head);
+}
+
+static unsigned char dir_freetree(FileFS *ffs, unsigned int head_blockindex)
+{
+	unsigned char head[BLOCKSIZE], block[BLOCKSIZE];
+	unsigned int head_index, index, next, stop_blockindex;
+	unsigned int *dirs, *p;
+	int dir_count = 0, dir_size = 64, k, limit;
+	unsigned short offset;
+	unsigned char ok = 1;
 	
-	unsigned short item_offset = 0;
+	dirs = (unsigned int*)malloc(dir_size * sizeof(unsigned int));
+	if ( dirs == NULL ) return 0;
+	dirs[dir_count++] = head_blockindex;
 	
-	unsigned char flag = 0, u;
-	index = block_head_index;
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			// printf("index:%d, stop_blockindex:%d, k=%d, offset:%d\n", index, stop_blockindex, k, offset);
-			if ( index == stop_blockindex && k+1 >= offset ) { // 已搜索到最后
-				return 3; // dir item not exist
-			}
-			
-			state = block[k]; k++;
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, lastname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
-			}
-			//printf("state:%d\n", state);
-			dir_file = state & 0x01;
-			if ( dir_file == 1 ) { // file
-				return 3; // same filename exist;
-			}
-			
-			// 检测子目录是否为空
-			memcpy(b4, block+k, 4); subdirblockindex = B4toU32(b4);
-			if ( ! readblock(ffs, subdirblockindex, subdirblock) ) return 1;
-			// get sub dir blockindex and offset
-			memcpy(b4, subdirblock+BLOCK_START_BLOCKINDEX, 4); subdir_start_blockindex = B4toU32(b4);
-			memcpy(b4, subdirblock+BLOCK_STOP_BLOCKINDEX, 4); subdir_stop_blockindex = B4toU32(b4);
-			memcpy(b2, subdirblock+BLOCK_OFFSET, 2); subdir_offset = B2toU16(b2);
-			if ( subdir_stop_blockindex != subdir_start_blockindex ) return 2; // sub dir not empty
-			if ( subdir_offset > 62 ) return 2; // sub dir not empty
-			
-			item_offset = k + 10; // block item的尾部位置
-			
-			// block_item
-			u = 0;
-			for (i=0; i<ba_used; i++) {
-				if ( ! ba[i].active ) continue;
-				if ( ba[i].blockindex == index ) {
-					block_item = ba[i].block;
-					block_item_index = index;
-					u = 1;
+	while ( ok && dir_count > 0 ) {
+		head_index = dirs[--dir_count];
+		if ( ! readblock(ffs, head_index, head) ) {
+			ok = 0;
+			break;
+		}
+		stop_blockindex = B4toU32(head+BLOCK_STOP_BLOCKINDEX);
+		offset = B2toU16(head+BLOCK_OFFSET);
+		
+		// 释放文件内容，子目录留到之后处理
+		memcpy(block, head, BLOCKSIZE);
+		index = head_index;
+		while ( 1 ) {
+			limit = (index == stop_blockindex) ? offset : BLOCKSIZE;
+			for (k=BLOCK_HEAD; k+25<=limit; k+=25) {
+				if ( block[k] & ITEM_SLOT ) continue; // inline文件的后续项或空位
+				if ( (block[k] & ITEM_FILE) == 0 ) { // 子目录
+					if ( block[k+1] == '.' && (block[k+2] == 0 || (block[k+2] == '.' && block[k+3] == 0)) ) continue;
+					if ( dir_count == dir_size ) {
+						p = (unsigned int*)realloc(dirs, dir_size * 2 * sizeof(unsigned int));
+						if ( p == NULL ) {
+							ok = 0;
+							break;
+						}
+						dirs = p;
+						dir_size *= 2;
+					}
+					dirs[dir_count++] = B4toU32(block+k+15);
+					continue;
+				}
+				if ( ! item_freecontent(ffs, block+k) ) {
+					ok = 0;
 					break;
 				}
 			}
-			if ( !u ) {
-				memcpy(ba[ba_used].block, block, BLOCKSIZE);
-				ba[ba_used].blockindex = index;
-				ba[ba_used].active = 1;
-				block_item = ba[ba_used].block;
-				block_item_index = index;
-				ba_used++;
+			if ( ! ok || index == stop_blockindex ) break;
+			index = B4toU32(block+4);
+			if ( index == 0 || ! readblock(ffs, index, block) ) {
+				ok = 0;
+				break;
 			}
-			
-			flag = 1;
-			break;
 		}
-		if ( flag ) break;
+		if ( ! ok ) break;
 		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 1; // 到这里说明block有问题
-		if ( ! readblock(ffs, index, block) ) return 1; // 到这里说明block有问题
-	}
-	
-	// printf("head:%d, item:%d, last:%d, item_offset:%d\n", block_head_index, block_item_index, block_last_index, item_offset);
-	// =======================
-	// 正式开始删除目录项
-	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
-	
-	// removeblock 子目录
-	removeblock(ffs, subdirblockindex);
-	
-	/*
-	if ( item is not offset ) {
-		get offset->item;
-		copy item;
-	}
-	1.block_item
-	*/
-	if ( block_item_index != stop_blockindex || item_offset != offset ) {
-		memcpy(block_item + item_offset - 25, block_last + offset - 25, 25);
-	}
-
-	/*
-	offset -= 25;
-	2.block_last
-	*/
-	offset -= 25;
-	U16toB2(offset, b2);
-	memcpy(block_head + BLOCK_OFFSET, b2, 2);
-	
-	/*
-	if ( offset < 25 ) { // 整个block都已清空
-		get prevblockindex;
-		remove block_last;
-		prevblock->next_blockindex = 0;
-		stop_blockindex = prev_block_index;
-		offset = BLOCKSIZE;
-		3.block_prev
-	}
-	4.block_head
-	*/
-	if ( offset < 25 ) {
-		memcpy(b4, block_last+8, 4);
-		block_prev_index = B4toU32(b4);
-		// printf("block prev index:%d\n", block_prev_index);
-		
-		removeblock(ffs, block_last_index);
-		k = -1;
-		for (i=0; i<ba_used; i++) {
-			if ( ! ba[i].active ) continue;
-			if ( ba[i].blockindex == block_last_index ) {
-				ba[i].active = 0;
-				k = i;
+		// pack block中可能还有移动到其它目录的文件的尾部，和FileFS_rmdir相同
+		// 释放文件的尾部时pack block可能已经释放，重新读取头块
+		if ( ! readblock(ffs, head_index, head) ) {
+			ok = 0;
+			break;
+		}
+		index = B4toU32(head + BLOCK_PACK_BLOCKINDEX);
+		if ( index > 0 ) {
+			if ( ! readblock(ffs, index, block) ) {
+				ok = 0;
 				break;
 			}
+			if ( B2toU16(block+6) == 0 ) {
+				if ( ! removeblock(ffs, index) ) {
+					ok = 0;
+					break;
+				}
+			} else {
+				memset(block+8, 0, 4);
+				if ( ! writeblock(ffs, index, block) ) {
+					ok = 0;
+					break;
+				}
+			}
 		}
-		if ( k < 0 ) {
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
+		if ( ! dirindex_free(ffs, B4toU32(head+8)) ) {
+			ok = 0;
+			break;
 		}
 		
-		// block_prev
-		u = 0;
-		for (i=0; i<ba_used; i++) {
-			if ( ! ba[i].active ) continue;
-			if ( ba[i].blockindex == block_prev_index ) {
-				block_prev = ba[i].block;
-				u = 1;
+		// 目录的block链
+		dcache_dropdir(ffs, head_index);
+		if ( ! dir_unmark(ffs, head_index, head) ) {
+			ok = 0;
+			break;
+		}
+		index = head_index;
+		while ( index > 0 ) {
+			next = 0;
+			if ( index != stop_blockindex ) {
+				if ( ! readblock(ffs, index, block) ) {
+					ok = 0;
+					break;
+				}
+				next = B4toU32(block+4);
+			}
+			if ( ! removeblock(ffs, index) ) {
+				ok = 0;
 				break;
 			}
+			index = next;
 		}
-		if ( !u ) {
-			if ( ! readblock(ffs, block_prev_index, block) ) {
-				if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-				return 1; // 到这里说明block有问题
+	}
+	
+	free(dirs);
+	return ok;
+}
+
+int FileFS_rmtree(FileFS *ffs, const char *pathname)
+{
+	if ( pathname == NULL ) return 1;
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	
+	int i, start, len = (int)strlen(pathname);
+	unsigned int blockindex;
+	if ( pathname[0] == '/' ) {
+		blockindex = 1; // root
+		start = 1;
+	} else if ( pathname[0] == '~' ) { // home
+		if ( ffs->tmp.state == 0 ) blockindex = ffs->home_pwd_blockindex; // pwd
+		else blockindex = ffs->tmp.home_pwd_blockindex;
+		start = 1;
+	} else {
+		if ( ffs->tmp.state == 0 ) blockindex = ffs->pwd_blockindex; // pwd
+		else blockindex = ffs->tmp.pwd_blockindex;
+		start = 0;
+	}
+	
+	char s[BLOCK_NAME_MAXSIZE+2];
+	int slen = 0;
+	unsigned int index;
+	memset(s, 0, BLOCK_NAME_MAXSIZE+2);
+	for (i=start; i<len; i++) {
+		if ( pathname[i] == '/' ) {
+			if ( slen == 0 ) continue;
+			s[slen] = 0;
+			if ( i == len - 1 ) break; // 留下最后一个s不判断
+			index = findPathBlockindex(ffs, blockindex, s);
+			if ( index < 1 ) {
+				return 3; // dir not exist
 			}
-			
-			memcpy(ba[k].block, block, BLOCKSIZE);
-			ba[k].blockindex = block_prev_index;
-			ba[k].active = 1;
-			block_prev = ba[k].block;
+			blockindex = index;
+			slen = 0;
+			continue;
 		}
-		
-		// prevblock->next_blockindex = 0;
-		memset(block_prev + 4, 0, 4);
-		
-		U32toB4(block_prev_index, b4);
-		memcpy(block_head + BLOCK_STOP_BLOCKINDEX, b4, 4);
-		offset = BLOCKSIZE;
-		U16toB2(offset, b2);
-		memcpy(block_head + BLOCK_OFFSET, b2, 2);
+		s[slen] = pathname[i];
+		slen++;
+		if ( slen > BLOCK_NAME_MAXSIZE ) return 4; // name to long
 	}
+	if ( slen == 0 ) return 1; // 不能删除根目录
+	s[slen] = 0;
 	
-	for (i=0; i<ba_used; i++) {
-		// printf("%d: write blockindex:%d\n", i, ba[i].blockindex);
-		if ( ! ba[i].active ) continue;
-		/*
-		for (k=0; k<BLOCKSIZE; k++) {
-			printf("%x ", ba[i].block[k]);
-		}
-		printf("\n");
-		*/
-		if ( ! writeblock(ffs, ba[i].blockindex, ba[i].block) ) {
-			// printf("write block err %d\n", i);
-			if ( ffs->tmp.state == 1 ) tmpstop(ffs);
-			return 1;
-		}
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	strcpy(lastname, s);
+	if ( strcmp(lastname, ".") == 0 ) return 1;
+	if ( strcmp(lastname, "..") == 0 ) return 1;
+	
+	// ===============================
+	unsigned char block[BLOCKSIZE];
+	unsigned int block_head_index = blockindex, block_item_index = 0;
+	unsigned int subdirblockindex;
+	unsigned short item_offset = 0;
+	int r;
+	
+	if ( ! readblock(ffs, blockindex, block) ) return 1;
+	r = dir_find(ffs, block_head_index, block, lastname, block, &block_item_index, &item_offset);
+	if ( r < 0 ) return 1;
+	if ( r == 0 ) return 3; // dir item not exist
+	if ( block[item_offset-25] & ITEM_FILE ) return 3; // same filename exist
+	subdirblockindex = B4toU32(block+item_offset-10);
+	
+	// =======================
+	// 整个目录树在同一个事务中删除，只commit一次
+	if ( ffs->tmp.state == 0 ) tmpstart(ffs, 1);
+	
+	if ( ! dir_freetree(ffs, subdirblockindex) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
+	}
+	
+	dcache_drop(ffs, block_head_index, lastname);
+	if ( ! dir_delslots(ffs, block_head_index, block_item_index, item_offset - 25, 1) ) {
+		if ( ffs->tmp.state == 1 ) tmpstop(ffs);
+		return 1;
 	}
 	
 	if ( ffs->tmp.state == 1 ) {
@@ -4262,20 +5714,19 @@ FFS_DIR *FileFS_opendir(FileFS *ffs, const char *path, char **absolute_path)
 	memcpy(b2, dir->block+(12+1+14+4+4), 2);
 	dir->offset = B2toU16(b2);
 	
+	dir->head_blockindex = blockindex;
 	dir->blockindex = blockindex;
 	dir->searchindex = 0;
+	dir->block_gen = ffs->block_gen;
 	
 	*absolute_path = ffs->pwd_tmp;
 	
 	return dir;
 }
 
-FFS_dirent *FileFS_readdir(FileFS *ffs, FFS_DIR *dir)
+// 读取下一个目录项到dir->dirp，return: 目录项在dir->block中的位置，NULL-end/err
+static unsigned char *dir_next(FileFS *ffs, FFS_DIR *dir)
 {
-	if ( ffs == NULL ) return NULL;
-	if ( ffs->fp == NULL ) return NULL;
-	if ( dir == NULL ) return NULL;
-
 	unsigned int nextindex;
 	unsigned char *block = dir->block;
 	unsigned char state, dir_file;
@@ -4284,12 +5735,18 @@ FFS_dirent *FileFS_readdir(FileFS *ffs, FFS_DIR *dir)
 	unsigned char b4[4], b2[2];
 	unsigned int dirblockindex;
 	
-	// read block again
-	if ( ! readblock(ffs, dir->blockindex, dir->block) ) return NULL;
-	memcpy(b4, dir->block+(12+1+14+4), 4);
-	dir->stop_blockindex = B4toU32(b4);
-	memcpy(b2, dir->block+(12+1+14+4+4), 2);
-	dir->offset = B2toU16(b2);
+	// 目录被修改过时read block again, stop_blockindex和offset只保存在目录的第一个block中
+	if ( dir->block_gen != ffs->block_gen ) {
+		if ( ! readblock(ffs, dir->head_blockindex, dir->block) ) return NULL;
+		memcpy(b4, dir->block+(12+1+14+4), 4);
+		dir->stop_blockindex = B4toU32(b4);
+		memcpy(b2, dir->block+(12+1+14+4+4), 2);
+		dir->offset = B2toU16(b2);
+		if ( dir->blockindex != dir->head_blockindex ) {
+			if ( ! readblock(ffs, dir->blockindex, dir->block) ) return NULL;
+		}
+		dir->block_gen = ffs->block_gen;
+	}
 	
 	k = BLOCK_HEAD + dir->searchindex * 25;
 	if ( dir->blockindex == dir->stop_blockindex && k+1 >= dir->offset ) return NULL; // end;
@@ -4306,6 +5763,12 @@ FFS_dirent *FileFS_readdir(FileFS *ffs, FFS_DIR *dir)
 		}
 		
 		state = block[k]; k++;
+		if ( state & ITEM_SLOT ) { // inline文件的后续slot或空slot
+			k += 24;
+			dir->searchindex++;
+			if ( dir->blockindex == dir->stop_blockindex && k+1 >= dir->offset ) return NULL; // end;
+			continue;
+		}
 		dir_file = state & 0x01;
 		if ( dir_file == 1 ) {
 			dir->dirp.d_type = FFS_DT_FILE; // file
@@ -4333,122 +5796,712 @@ FFS_dirent *FileFS_readdir(FileFS *ffs, FFS_DIR *dir)
 		
 		k += 10;
 		dir->searchindex++;
-		return &(dir->dirp);
+		return block + k - 25;
 	}
 	
 	return NULL; // 正常情况下不会执行到这里
 }
 
-void FileFS_closedir(FileFS *ffs, FFS_DIR *dir)
+// 最小堆中第i项下沉
+static void sorted_down(DirItem *items, int n, int i)
 {
-	if ( dir != NULL ) free(dir);
+	DirItem t;
+	int c;
+	
+	while ( (c = i * 2 + 1) < n ) {
+		if ( c + 1 < n && strcmp(items[c+1].plus.dirent.d_name, items[c].plus.dirent.d_name) < 0 ) c++;
+		if ( strcmp(items[c].plus.dirent.d_name, items[i].plus.dirent.d_name) >= 0 ) break;
+		t = items[i];
+		items[i] = items[c];
+		items[c] = t;
+		i = c;
+	}
 }
 
-// ====================================
-// 从blockindex所指的目录中搜索pathname是否存在
-// blockindex必须是目录的第一个块
-static unsigned int findPathBlockindex(FileFS *ffs, unsigned int blockindex, char *pathname)
+// 取出名称最小的目录项，return: 0-end,1-ok
+static unsigned char sorted_pop(FFS_DIR *dir, DirItem *it)
 {
-	unsigned char block[BLOCKSIZE];
-	unsigned int index = blockindex;
-	unsigned char b4[4], b2[2];
-	unsigned char state, dir_file;
-	int i, k;
-	char s[BLOCK_NAME_MAXSIZE+1];
-	memset(s, 0, BLOCK_NAME_MAXSIZE+1);
-	unsigned int stop_blockindex;
-	unsigned short offset;
+	if ( dir->item_count == 0 ) return 0;
+	*it = dir->items[0];
+	dir->item_count--;
+	if ( dir->item_count > 0 ) {
+		dir->items[0] = dir->items[dir->item_count];
+		sorted_down(dir->items, dir->item_count, 0);
+	}
+	return 1;
+}
+
+FFS_dirent *FileFS_readdir(FileFS *ffs, FFS_DIR *dir)
+{
+	if ( ffs == NULL ) return NULL;
+	if ( ffs->fp == NULL ) return NULL;
+	if ( dir == NULL ) return NULL;
 	
-	if ( ! readblock(ffs, index, block) ) return 0;
-	memcpy(b4, block+(BLOCK_STOP_BLOCKINDEX), 4);
-	stop_blockindex = B4toU32(b4);
-	memcpy(b2, block+(BLOCK_OFFSET), 2);
-	offset = B2toU16(b2);
+	if ( dir->sorted ) {
+		if ( ! sorted_pop(dir, &dir->cur) ) return NULL; // end
+		dir->dirp = dir->cur.plus.dirent;
+		return &dir->dirp;
+	}
+	if ( dir_next(ffs, dir) == NULL ) return NULL;
 	
-	while (1) {
-		// blocksize=512,去掉前置的12byte，一共能放下20个子项目(目录或文件)
-		k = BLOCK_HEAD;
-		for (i=0; i<BLOCK_ITEM_MAXCOUNT; i++) {
-			if ( index == stop_blockindex && k+1 >= offset ) return 0; // 已搜索到最后
-			state = block[k]; k++;
-			dir_file = state & 0x01;
-			if ( dir_file == 1 ) { // is file
-				k += 24;
-				continue;
-			}
-			// path
-			memcpy(s, block+k, BLOCK_NAME_MAXSIZE); k+=BLOCK_NAME_MAXSIZE;
-			if ( strcmp(s, pathname) != 0 ) {
-				k += 10; // 4+4+2
-				continue;
+	return &(dir->dirp);
+}
+
+// 一次读取多个目录项到buf，同一个block中的目录项只读取一次block
+// return: 读取的数量，0-end,-1-err
+int FileFS_getdents(FileFS *ffs, FFS_DIR *dir, FFS_dirent *buf, int max)
+{
+	if ( ffs == NULL ) return -1;
+	if ( ffs->fp == NULL ) return -1;
+	if ( dir == NULL || buf == NULL || max < 0 ) return -1;
+	
+	int n = 0;
+	
+	if ( dir->sorted ) {
+		while ( n < max && sorted_pop(dir, &dir->cur) ) {
+			buf[n++] = dir->cur.plus.dirent;
+		}
+		return n;
+	}
+	while ( n < max ) {
+		if ( dir_next(ffs, dir) == NULL ) break;
+		buf[n++] = dir->dirp;
+	}
+	
+	return n;
+}
+
+// 从目录项中取出位置信息，文件长度只填写inline文件的
+static void dir_item(const FFS_dirent *dirent, unsigned int blockindex, unsigned char *block, unsigned char *item, DirItem *it)
+{
+	FFS_direntplus *plus = &it->plus;
+	
+	memset(it, 0, sizeof(DirItem));
+	plus->dirent = *dirent;
+	it->blockindex = blockindex;
+	it->offset = (unsigned short)(item - block + 25);
+	if ( (item[0] & ITEM_FILE) && (item[0] & ITEM_INLINE) ) { // 内容在目录项中
+		plus->size = B2toU16(item+1+BLOCK_NAME_MAXSIZE);
+		plus->has_size = 1;
+		return;
+	}
+	plus->start_blockindex = B4toU32(item+1+BLOCK_NAME_MAXSIZE);
+	plus->stop_blockindex = B4toU32(item+1+BLOCK_NAME_MAXSIZE+4);
+	plus->offset = B2toU16(item+1+BLOCK_NAME_MAXSIZE+8);
+	if ( item[0] & ITEM_MAP ) plus->has_size = 2; // 长度在root中，需要时由dir_itemsize读取
+}
+
+// 延迟分配的文件使用内存中的长度，root为1时块映射文件读取root中的长度，为0时has_size保持为2
+// return: 0-err,1-ok
+static unsigned char dir_itemsize(FileFS *ffs, DirItem *it, unsigned char root)
+{
+	FFS_direntplus *plus = &it->plus;
+	unsigned char block[BLOCKSIZE];
+	FFS_FILE *ff;
+	
+	if ( plus->dirent.d_type == FFS_DT_FILE ) {
+		for (ff=ffs->delay_head; ff!=NULL; ff=ff->delay_next) {
+			if ( ff->dir_blockindex == it->blockindex && ff->dir_offset == it->offset ) {
+				plus->size = ff->size;
+				plus->has_size = 1;
+				return 1;
 			}
-			memcpy(b4, block+k, 4);
-			return B4toU32(b4); // find
 		}
-		
-		// get nextblockindex;
-		memcpy(b4, block+4, 4);
-		index = B4toU32(b4);
-		if ( index == 0 ) return 0;		
-		if ( ! readblock(ffs, index, block) ) return 0;
 	}
 	
-	return 0;
+	if ( plus->has_size == 2 && root ) {
+		plus->has_size = 1;
+		if ( plus->start_blockindex > 0 ) {
+			if ( ! readblock(ffs, plus->start_blockindex, block) ) return 0;
+			plus->size = B8toU64(block+4);
+		} else if ( plus->stop_blockindex > 0 ) { // 只有一个打包的片段
+			if ( ! readblock(ffs, plus->stop_blockindex, block) ) return 0;
+			plus->size = B2toU16(block + plus->offset);
+		}
+	}
+	
+	return 1;
 }
 
-// =================================
-unsigned char FileFS_begin(FileFS *ffs)
+FFS_direntplus *FileFS_readdirplus(FileFS *ffs, FFS_DIR *dir)
+{
+	if ( ffs == NULL ) return NULL;
+	if ( ffs->fp == NULL ) return NULL;
+	if ( dir == NULL ) return NULL;
+	
+	unsigned char *item;
+	
+	if ( dir->sorted ) {
+		if ( ! sorted_pop(dir, &dir->cur) ) return NULL; // end
+	} else {
+		item = dir_next(ffs, dir);
+		if ( item == NULL ) return NULL;
+		dir_item(&dir->dirp, dir->blockindex, dir->block, item, &dir->cur);
+	}
+	if ( ! dir_itemsize(ffs, &dir->cur, 0) ) return NULL;
+	dir->dirp = dir->cur.plus.dirent;
+	
+	return &dir->cur.plus;
+}
+
+unsigned char FileFS_readdirsize(FileFS *ffs, FFS_DIR *dir)
 {
-	//printf("begin\n");
 	if ( ffs == NULL ) return 0;
 	if ( ffs->fp == NULL ) return 0;
+	if ( dir == NULL ) return 0;
 	
-	return tmpstart(ffs, 2);
+	return dir_itemsize(ffs, &dir->cur, 1);
 }
 
-void FileFS_rollback(FileFS *ffs)
+void FileFS_closedir(FileFS *ffs, FFS_DIR *dir)
 {
-	//printf("rollback\n");
-	if ( ffs == NULL ) return;
-	if ( ffs->fp == NULL ) return;
+	(void)ffs;
+	if ( dir == NULL ) return;
+	if ( dir->items != NULL ) free(dir->items);
+	free(dir);
+}
+
+FFS_DIR *FileFS_opendir_sorted(FileFS *ffs, const char *path, const char *start, char **absolute_path)
+{
+	FFS_DIR *dir = FileFS_opendir(ffs, path, absolute_path);
+	DirItem *p;
+	unsigned char *item;
+	int i, size = 0;
 	
-	// clear fpj
-	// ffs_remove(ffs->fnj);
-	unsigned char state = 0;
-	fseek(ffs->fpj, 4, SEEK_SET);
-	fwrite(&state, 1, 1, ffs->fpj);
-	ffs_fflush(ffs->fpj);
+	if ( dir == NULL ) return NULL;
+	while ( (item = dir_next(ffs, dir)) != NULL ) {
+		if ( start != NULL && strcmp(dir->dirp.d_name, start) < 0 ) continue;
+		if ( dir->item_count == size ) {
+			size = size ? size * 2 : 64;
+			p = (DirItem*)realloc(dir->items, size * sizeof(DirItem));
+			if ( p == NULL ) {
+				FileFS_closedir(ffs, dir);
+				return NULL;
+			}
+			dir->items = p;
+		}
+		dir_item(&dir->dirp, dir->blockindex, dir->block, item, &dir->items[dir->item_count++]);
+	}
+	// 建堆是O(n)的，只取出前k项时(分页、前缀)为O(n + k*log n)，不需要排序全部目录项
+	for (i=dir->item_count/2-1; i>=0; i--) sorted_down(dir->items, dir->item_count, i);
+	dir->sorted = 1;
 	
-	tmpstop(ffs);
+	return dir;
 }
 
-unsigned char FileFS_commit(FileFS *ffs)
+// FileFS_walk中正在遍历的一个目录
+typedef struct WalkDir {
+	unsigned int head_blockindex, blockindex, stop_blockindex;
+	unsigned short offset;
+	int k; // 下一个目录项在block中的位置
+	int path_len; // 进入目录前path的长度
+	unsigned char block[BLOCKSIZE];
+	DirItem item; // 目录自身，后序回调时使用
+} WalkDir;
+
+// 预读block中子目录的第一个block和目录的下一个block
+static void walk_prefetch(FileFS *ffs, WalkDir *w)
 {
-	// printf("commit\n");
-	if ( ffs == NULL ) return 0;
-	if ( ffs->fp == NULL ) return 0;
+	int k, limit = (w->blockindex == w->stop_blockindex) ? w->offset : BLOCKSIZE;
 	
-	{
-		// write fnj;
-		FILE *fp = ffs->fpj;
-		unsigned char signal;
-		unsigned int blocksize = 0;
-		unsigned char b4[4];
-		unsigned char block[BLOCKSIZE+4];
-		int k;
-		unsigned int blockindex;
-		unsigned long long pos;
-		unsigned int n;
-		
-		if ( fp == NULL ) {
-			fp = fopen(ffs->fnj, "w+b");
-			if ( fp == NULL ) {
-				tmpstop(ffs);
-				return 0;
+	for (k=BLOCK_HEAD; k+25<=limit; k+=25) {
+		if ( w->block[k] & (ITEM_SLOT | ITEM_FILE) ) continue;
+		if ( w->block[k+1] == '.' && (w->block[k+2] == 0 || (w->block[k+2] == '.' && w->block[k+3] == 0)) ) continue;
+		ffs_prefetch(ffs->fp, (unsigned long long)B4toU32(w->block+k+15) * BLOCKSIZE, BLOCKSIZE);
+	}
+	if ( w->blockindex != w->stop_blockindex && B4toU32(w->block+4) > 0 ) {
+		ffs_prefetch(ffs->fp, (unsigned long long)B4toU32(w->block+4) * BLOCKSIZE, BLOCKSIZE);
+	}
+}
+
+// 读取目录的第一个block
+static unsigned char walk_open(FileFS *ffs, WalkDir *w, unsigned int head_blockindex)
+{
+	if ( ! readblock(ffs, head_blockindex, w->block) ) return 0;
+	w->head_blockindex = head_blockindex;
+	w->blockindex = head_blockindex;
+	w->stop_blockindex = B4toU32(w->block+BLOCK_STOP_BLOCKINDEX);
+	w->offset = B2toU16(w->block+BLOCK_OFFSET);
+	w->k = BLOCK_HEAD;
+	walk_prefetch(ffs, w);
+	
+	return 1;
+}
+
+// 下一个目录项，跳过"."和".."，return: 目录项在w->block中的位置，NULL-end，*err为1时读取失败
+static unsigned char *walk_next(FileFS *ffs, WalkDir *w, unsigned char *err)
+{
+	unsigned char *item;
+	unsigned int nextindex;
+	int limit;
+	
+	while ( 1 ) {
+		limit = (w->blockindex == w->stop_blockindex) ? w->offset : BLOCKSIZE;
+		if ( w->k + 25 > limit ) {
+			if ( w->blockindex == w->stop_blockindex ) return NULL; // end
+			nextindex = B4toU32(w->block+4);
+			if ( nextindex == 0 ) return NULL;
+			if ( ! readblock(ffs, nextindex, w->block) ) {
+				*err = 1;
+				return NULL;
 			}
-			ffs->fpj = fp;
-		} else {
-			ffs_rewind(fp);
+			w->blockindex = nextindex;
+			w->k = BLOCK_HEAD;
+			walk_prefetch(ffs, w);
+			continue;
+		}
+		item = w->block + w->k;
+		w->k += 25;
+		if ( item[0] & ITEM_SLOT ) continue; // inline文件的后续slot或空slot
+		if ( item[1] == '.' && (item[2] == 0 || (item[2] == '.' && item[3] == 0)) ) continue;
+		return item;
+	}
+}
+
+int FileFS_walk(FileFS *ffs, const char *path, int (*fn)(const FFS_walkent *ent, void *arg), void *arg, int flags)
+{
+	if ( ffs == NULL ) return -1;
+	if ( ffs->fp == NULL ) return -1;
+	if ( path == NULL || fn == NULL ) return -1;
+	
+	WalkDir *dirs, *w;
+	int dir_count = 0, dir_size = 16, path_size = 256, len, k, r = 0;
+	unsigned char *item, err = 0;
+	char *abs, *pathbuf;
+	void *p;
+	FFS_walkent ent;
+	FFS_dirent dirent;
+	DirItem it;
+	
+	FFS_DIR *dir = FileFS_opendir(ffs, path, &abs);
+	if ( dir == NULL ) return -1;
+	dirs = (WalkDir*)malloc(dir_size * sizeof(WalkDir));
+	pathbuf = (char*)malloc(path_size);
+	if ( dirs == NULL || pathbuf == NULL || ! walk_open(ffs, &dirs[0], dir->head_blockindex) ) {
+		FileFS_closedir(ffs, dir);
+		free(dirs);
+		free(pathbuf);
+		return -1;
+	}
+	FileFS_closedir(ffs, dir);
+	dirs[0].path_len = 0;
+	dir_count = 1;
+	pathbuf[0] = 0;
+	
+	while ( dir_count > 0 ) {
+		w = &dirs[dir_count-1];
+		item = walk_next(ffs, w, &err);
+		if ( item == NULL ) {
+			if ( err ) {
+				r = -1;
+				break;
+			}
+			// 目录中的项目已经全部回调
+			dir_count--;
+			if ( dir_count > 0 && (flags & FFS_WALK_POST) ) {
+				ent.ent = w->item.plus;
+				ent.dir_blockindex = dirs[dir_count-1].head_blockindex;
+				ent.path = pathbuf;
+				ent.depth = dir_count;
+				ent.post = 1;
+				r = fn(&ent, arg);
+				if ( r != 0 && r != FFS_WALK_SKIP ) break;
+				r = 0;
+			}
+			pathbuf[w->path_len] = 0;
+			continue;
+		}
+		
+		// 路径: 上级目录/名称
+		memset(&dirent, 0, sizeof(FFS_dirent));
+		memcpy(dirent.d_name, item+1, BLOCK_NAME_MAXSIZE);
+		dirent.d_namlen = strlen(dirent.d_name);
+		dirent.d_type = (item[0] & ITEM_FILE) ? FFS_DT_FILE : FFS_DT_DIR;
+		len = (int)strlen(pathbuf);
+		if ( len + 1 + (int)dirent.d_namlen + 1 > path_size ) {
+			p = realloc(pathbuf, path_size * 2);
+			if ( p == NULL ) {
+				r = -1;
+				break;
+			}
+			pathbuf = (char*)p;
+			path_size *= 2;
+		}
+		k = len;
+		if ( k > 0 ) pathbuf[k++] = '/';
+		strcpy(pathbuf + k, dirent.d_name);
+		
+		dir_item(&dirent, w->blockindex, w->block, item, &it);
+		if ( it.plus.has_size == 2 ) { // 块映射文件的长度需要读取root
+			if ( flags & FFS_WALK_SIZE ) {
+				if ( ! dir_itemsize(ffs, &it, 1) ) {
+					r = -1;
+					break;
+				}
+			} else {
+				it.plus.has_size = 0;
+			}
+		}
+		ent.ent = it.plus;
+		ent.dir_blockindex = w->head_blockindex;
+		ent.path = pathbuf;
+		ent.depth = dir_count;
+		ent.post = 0;
+		
+		if ( dirent.d_type == FFS_DT_FILE ) {
+			r = fn(&ent, arg);
+			pathbuf[len] = 0;
+			if ( r != 0 && r != FFS_WALK_SKIP ) break;
+			r = 0;
+			continue;
+		}
+		
+		// 子目录
+		if ( flags & FFS_WALK_PRE ) {
+			r = fn(&ent, arg);
+			if ( r == FFS_WALK_SKIP ) {
+				pathbuf[len] = 0;
+				r = 0;
+				continue;
+			}
+			if ( r != 0 ) break;
+		}
+		if ( dir_count == dir_size ) {
+			p = realloc(dirs, dir_size * 2 * sizeof(WalkDir));
+			if ( p == NULL ) {
+				r = -1;
+				break;
+			}
+			dirs = (WalkDir*)p;
+			dir_size *= 2;
+		}
+		w = &dirs[dir_count];
+		if ( ! walk_open(ffs, w, it.plus.start_blockindex) ) {
+			r = -1;
+			break;
+		}
+		w->path_len = len;
+		w->item = it;
+		dir_count++;
+	}
+	
+	free(dirs);
+	free(pathbuf);
+	return r;
+}
+
+// =============================================
+// *at: 相对路径从dir开始解析，dir为NULL时从当前目录开始，以'/'或'~'开头时和其它函数相同
+// 得到最后一级名称lastname和它所在目录的blockindex，最后一级之后可以有'/'
+// return: 0-ok,1-没有最后一级名称,3-dir not exist,4-name>limit(14byte)
+static int at_path(FileFS *ffs, FFS_DIR *dir, const char *name, unsigned int *blockindex, char *lastname)
+{
+	int i, start = 0, slen = 0, len = (int)strlen(name);
+	unsigned int index;
+	char s[BLOCK_NAME_MAXSIZE+2];
+	
+	if ( name[0] == '/' ) {
+		*blockindex = 1; // root
+		start = 1;
+	} else if ( name[0] == '~' ) { // home
+		if ( ffs->tmp.state == 0 ) *blockindex = ffs->home_pwd_blockindex;
+		else *blockindex = ffs->tmp.home_pwd_blockindex;
+		start = 1;
+	} else if ( dir != NULL ) {
+		*blockindex = dir->head_blockindex;
+	} else {
+		if ( ffs->tmp.state == 0 ) *blockindex = ffs->pwd_blockindex; // pwd
+		else *blockindex = ffs->tmp.pwd_blockindex;
+	}
+	
+	for (i=start; i<len; i++) {
+		if ( name[i] == '/' ) {
+			if ( slen == 0 ) continue;
+			if ( i == len - 1 ) break; // 留下最后一个s不判断
+			s[slen] = 0;
+			index = findPathBlockindex(ffs, *blockindex, s);
+			if ( index < 1 ) return 3; // dir not exist
+			*blockindex = index;
+			slen = 0;
+			continue;
+		}
+		s[slen] = name[i];
+		slen++;
+		if ( slen > BLOCK_NAME_MAXSIZE ) return 4; // name to long
+	}
+	if ( slen == 0 ) return 1;
+	s[slen] = 0;
+	strcpy(lastname, s);
+	
+	return 0;
+}
+
+FFS_FILE *FileFS_openat(FileFS *ffs, FFS_DIR *dir, const char *filename, const char *mode)
+{
+	if ( ffs == NULL ) return NULL;
+	if ( ffs->fp == NULL ) return NULL;
+	if ( filename == NULL || filename[0] == 0 ) return NULL;
+	if ( mode == NULL ) return NULL;
+	
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	unsigned int blockindex;
+	int bmode = fopen_mode(mode);
+	
+	if ( bmode < 0 ) return NULL;
+	if ( filename[strlen(filename)-1] == '/' ) return NULL; // just path, no filename
+	if ( at_path(ffs, dir, filename, &blockindex, lastname) != 0 ) return NULL;
+	if ( strcmp(lastname, ".") == 0 ) return NULL;
+	if ( strcmp(lastname, "..") == 0 ) return NULL;
+	
+	return do_fopen(ffs, lastname, (unsigned char)bmode, blockindex);
+}
+
+int FileFS_mkdirat(FileFS *ffs, FFS_DIR *dir, const char *pathname)
+{
+	if ( pathname == NULL ) return 1;
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	unsigned int blockindex;
+	
+	switch ( at_path(ffs, dir, pathname, &blockindex, lastname) ) {
+	case 0: break;
+	case 1: return 3; // 目录已存在
+	case 4: return 2; // name to long
+	default: return 1;
+	}
+	
+	return do_mkdir_check(ffs, lastname, blockindex);
+}
+
+int FileFS_unlinkat(FileFS *ffs, FFS_DIR *dir, const char *name, int flags)
+{
+	if ( name == NULL ) return 1;
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	unsigned int blockindex;
+	int r;
+	
+	if ( (flags & FFS_AT_REMOVEDIR) == 0 && name[0] != 0 && name[strlen(name)-1] == '/' ) return 5; // 不是文件
+	r = at_path(ffs, dir, name, &blockindex, lastname);
+	if ( r == 1 ) return (flags & FFS_AT_REMOVEDIR) ? 1 : 2;
+	if ( r != 0 ) return r;
+	if ( strcmp(lastname, ".") == 0 || strcmp(lastname, "..") == 0 ) return (flags & FFS_AT_REMOVEDIR) ? 1 : 5;
+	
+	if ( flags & FFS_AT_REMOVEDIR ) return do_rmdir(ffs, lastname, blockindex);
+	return do_remove(ffs, lastname, blockindex);
+}
+
+int FileFS_renameat(FileFS *ffs, FFS_DIR *old_dir, const char *old_name, FFS_DIR *new_dir, const char *new_name)
+{
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	if ( old_name == NULL || old_name[0] == 0 ) return 1;
+	if ( new_name == NULL || new_name[0] == 0 ) return 1;
+	
+	char old_lastname[BLOCK_NAME_MAXSIZE+1], new_lastname[BLOCK_NAME_MAXSIZE+1];
+	unsigned int old_blockindex, new_blockindex;
+	unsigned char old_type_dir, new_type_dir;
+	
+	if ( at_path(ffs, old_dir, old_name, &old_blockindex, old_lastname) != 0 ) return 2;
+	if ( strcmp(old_lastname, ".") == 0 ) return 2;
+	if ( strcmp(old_lastname, "..") == 0 ) return 2;
+	if ( at_path(ffs, new_dir, new_name, &new_blockindex, new_lastname) != 0 ) return 3;
+	if ( strcmp(new_lastname, ".") == 0 ) return 3;
+	if ( strcmp(new_lastname, "..") == 0 ) return 3;
+	old_type_dir = old_name[strlen(old_name)-1] == '/' ? 1 : 0; // 尾部有'/'，只能是目录
+	new_type_dir = new_name[strlen(new_name)-1] == '/' ? 1 : 0;
+	
+	return do_rename(ffs, old_lastname, old_blockindex, old_type_dir, new_lastname, new_blockindex, new_type_dir);
+}
+
+int FileFS_statat(FileFS *ffs, FFS_DIR *dir, const char *name, FFS_direntplus *st)
+{
+	if ( name == NULL || st == NULL ) return 1;
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	
+	unsigned char head[BLOCKSIZE], block[BLOCKSIZE];
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	unsigned int blockindex, item_blockindex;
+	unsigned short item_offset;
+	FFS_dirent dirent;
+	DirItem it;
+	int r;
+	
+	r = at_path(ffs, dir, name, &blockindex, lastname);
+	if ( r == 1 ) strcpy(lastname, "."); // 目录自身
+	else if ( r != 0 ) return r;
+	
+	if ( ! readblock(ffs, blockindex, head) ) return 1;
+	r = dir_find(ffs, blockindex, head, lastname, block, &item_blockindex, &item_offset);
+	if ( r < 0 ) return 1;
+	if ( r == 0 ) return 2; // not exist
+	
+	memset(&dirent, 0, sizeof(FFS_dirent));
+	memcpy(dirent.d_name, block+item_offset-25+1, BLOCK_NAME_MAXSIZE);
+	dirent.d_namlen = strlen(dirent.d_name);
+	dirent.d_type = (block[item_offset-25] & ITEM_FILE) ? FFS_DT_FILE : FFS_DT_DIR;
+	if ( strcmp(dirent.d_name, ".") == 0 && B4toU32(block+item_offset-10) == 1 ) dirent.d_type = FFS_DT_ROOT;
+	if ( strcmp(dirent.d_name, "..") == 0 && B4toU32(block+item_offset-10) == 0 ) dirent.d_type = FFS_DT_ROOT;
+	dir_item(&dirent, item_blockindex, block, block+item_offset-25, &it);
+	if ( ! dir_itemsize(ffs, &it, 1) ) return 1;
+	*st = it.plus;
+	
+	return 0;
+}
+
+int FileFS_fileid(FileFS *ffs, FFS_DIR *dir, const char *name, FFS_fileid *id)
+{
+	if ( name == NULL || id == NULL ) return 1;
+	if ( ffs == NULL ) return 1;
+	if ( ffs->fp == NULL ) return 1;
+	
+	unsigned char head[BLOCKSIZE], block[BLOCKSIZE];
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	unsigned int blockindex, item_blockindex;
+	unsigned short item_offset;
+	int r;
+	
+	r = at_path(ffs, dir, name, &blockindex, lastname);
+	if ( r == 1 ) return 5; // 没有名称，例如"/"
+	if ( r != 0 ) return r;
+	if ( strcmp(lastname, ".") == 0 ) return 5;
+	if ( strcmp(lastname, "..") == 0 ) return 5;
+	
+	if ( ! readblock(ffs, blockindex, head) ) return 1;
+	r = dir_find(ffs, blockindex, head, lastname, block, &item_blockindex, &item_offset);
+	if ( r < 0 ) return 1;
+	if ( r == 0 ) return 2; // not exist
+	
+	memset(id, 0, sizeof(FFS_fileid));
+	id->dir_blockindex = blockindex;
+	strcpy(id->name, lastname);
+	
+	return 0;
+}
+
+FFS_FILE *FileFS_fopen_id(FileFS *ffs, const FFS_fileid *id, const char *mode)
+{
+	if ( ffs == NULL ) return NULL;
+	if ( ffs->fp == NULL ) return NULL;
+	if ( id == NULL || mode == NULL ) return NULL;
+	
+	unsigned char head[BLOCKSIZE];
+	char lastname[BLOCK_NAME_MAXSIZE+1];
+	int bmode = fopen_mode(mode);
+	
+	if ( bmode < 0 ) return NULL;
+	memcpy(lastname, id->name, BLOCK_NAME_MAXSIZE);
+	lastname[BLOCK_NAME_MAXSIZE] = 0;
+	if ( lastname[0] == 0 ) return NULL;
+	if ( strchr(lastname, '/') != NULL ) return NULL;
+	if ( strcmp(lastname, ".") == 0 ) return NULL;
+	if ( strcmp(lastname, "..") == 0 ) return NULL;
+	
+	// dir_blockindex必须仍是目录的头块: "."指向自身，删除目录时"."的名称已被清除
+	if ( id->dir_blockindex < 1 ) return NULL;
+	if ( ! readblock(ffs, id->dir_blockindex, head) ) return NULL;
+	if ( head[BLOCK_HEAD] != 0 ) return NULL;
+	if ( head[BLOCK_HEAD+1] != '.' || head[BLOCK_HEAD+2] != 0 ) return NULL;
+	if ( B4toU32(head+BLOCK_START_BLOCKINDEX) != id->dir_blockindex ) return NULL;
+	
+	return do_fopen(ffs, lastname, (unsigned char)bmode, id->dir_blockindex);
+}
+
+// ====================================
+// 从blockindex所指的目录中搜索pathname是否存在
+// blockindex必须是目录的第一个块
+static unsigned int findPathBlockindex(FileFS *ffs, unsigned int blockindex, char *pathname)
+{
+	unsigned int index;
+	
+	if ( dir_lookup(ffs, blockindex, pathname, &index) != 2 ) return 0; // 不存在或为文件
+	return index; // find
+}
+
+// =================================
+unsigned char FileFS_begin(FileFS *ffs)
+{
+	//printf("begin\n");
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	
+	// 延迟分配的数据先写入，rollback只丢弃事务中写入的数据
+	FFS_FILE *stream;
+	if ( ffs->tmp.state == 0 ) {
+		for (stream=ffs->delay_head; stream!=NULL; stream=stream->delay_next) {
+			if ( ! FileFS_fflush(ffs, stream) ) return 0;
+		}
+	}
+	
+	return tmpstart(ffs, 2);
+}
+
+void FileFS_rollback(FileFS *ffs)
+{
+	//printf("rollback\n");
+	if ( ffs == NULL ) return;
+	if ( ffs->fp == NULL ) return;
+	
+	// clear fpj
+	// ffs_remove(ffs->fnj);
+	unsigned char state = 0;
+	fseek(ffs->fpj, 4, SEEK_SET);
+	fwrite(&state, 1, 1, ffs->fpj);
+	ffs_fflush(ffs->fpj);
+	
+	tmpstop(ffs);
+	
+	// 延迟分配的文件丢弃内存中的数据
+	FFS_FILE *stream, *next;
+	for (stream=ffs->delay_head; stream!=NULL; stream=next) {
+		next = stream->delay_next;
+		delay_reload(ffs, stream);
+	}
+}
+
+unsigned char FileFS_commit(FileFS *ffs)
+{
+	// printf("commit\n");
+	if ( ffs == NULL ) return 0;
+	if ( ffs->fp == NULL ) return 0;
+	
+	// 手动事务中，延迟分配的文件一起写入
+	if ( ffs->tmp.state == 2 ) {
+		FFS_FILE *stream;
+		for (stream=ffs->delay_head; stream!=NULL; stream=stream->delay_next) {
+			if ( ! do_fflush_delay(ffs, stream) ) {
+				FileFS_rollback(ffs);
+				return 0;
+			}
+		}
+	}
+	
+	{
+		// write fnj;
+		FILE *fp = ffs->fpj;
+		unsigned char signal;
+		unsigned int blocksize = 0;
+		unsigned char b4[4];
+		unsigned char block[BLOCKSIZE+4];
+		int k;
+		unsigned int blockindex;
+		unsigned long long pos;
+		unsigned int n;
+		
+		if ( fp == NULL ) {
+			fp = fopen(ffs->fnj, "w+b");
+			if ( fp == NULL ) {
+				tmpstop(ffs);
+				return 0;
+			}
+			ffs->fpj = fp;
+		} else {
+			ffs_rewind(fp);
 		}
 		
 		// blocksize
@@ -4470,7 +6523,9 @@ unsigned char FileFS_commit(FileFS *ffs)
 		
 		// block 0
 		if ( ffs->tmp.total_blocksize != ffs->tmp.new_total_blocksize ||
-			ffs->tmp.unused_blockhead != ffs->tmp.new_unused_blockhead ) {
+			ffs->tmp.unused_blockhead != ffs->tmp.new_unused_blockhead ||
+			ffs->tmp.ref_root != ffs->tmp.new_ref_root || ffs->tmp.ref_depth != ffs->tmp.new_ref_depth ||
+			ffs->tmp.direct_size > 0 ) {
 			// block index = 0
 			memset(b4, 0, 4);
 			fwrite(b4, 1, 4, fp);
@@ -4486,6 +6541,10 @@ unsigned char FileFS_commit(FileFS *ffs)
 			// unused block head
 			U32toB4(ffs->tmp.new_unused_blockhead, b4);
 			memcpy(block+k, b4, 4); k += 4;
+			// 引用计数表
+			U32toB4(ffs->tmp.new_ref_root, b4);
+			memcpy(block+k, b4, 4); k += 4;
+			block[k] = ffs->tmp.new_ref_depth; k += 1;
 			// other,皆为0
 			fwrite(block, 1, BLOCKSIZE, fp);
 
@@ -4589,6 +6648,8 @@ unsigned char FileFS_commit(FileFS *ffs)
 		ffs_fflush(ffs->fpj);
 	}
 	
+	ffs->free = ffs->tmp.free;
+	
 	int len;
 	void *p;
 	len = (int)strlen(ffs->tmp.pwd) + 1;
@@ -4634,14 +6695,17 @@ static unsigned char tmpstart(FileFS *ffs, unsigned char state)
 	
 	if ( ffs->tmp.state != 0 ) tmpstop(ffs);
 	
-	// read total_blocksize, unused_blockhead
-	unsigned char block[12];
+	// read total_blocksize, unused_blockhead, ref_root, ref_depth
+	unsigned char block[17];
 	ffs_rewind(ffs->fp);
-	if ( 12 != ffs_fread(block, 1, 12, ffs->fp) ) return 0;
+	if ( 17 != ffs_fread(block, 1, 17, ffs->fp) ) return 0;
 	ffs->tmp.total_blocksize = B4toU32(block+4);
 	ffs->tmp.unused_blockhead = B4toU32(block+8);
 	ffs->tmp.new_total_blocksize = ffs->tmp.total_blocksize;
 	ffs->tmp.new_unused_blockhead = ffs->tmp.unused_blockhead;
+	ffs->tmp.ref_root = ffs->tmp.new_ref_root = B4toU32(block+12);
+	ffs->tmp.ref_depth = ffs->tmp.new_ref_depth = block[16];
+	ffs->tmp.free = ffs->free;
 	// printf("6.set new_unused_blockhead:%d\n", ffs->tmp.new_unused_blockhead);
 	
 	if ( ffs->tmp.fp_cp == NULL ) {
@@ -4701,7 +6765,10 @@ static void tmpstop(FileFS *ffs)
 	ffs->tmp.cp_size = 0;
 	*/
 	
+	// 手动事务中缓存的目录项可能没有提交
+	if ( ffs->tmp.state == 2 ) dcache_clear(ffs);
 	ffs->tmp.state = 0;
+	ffs->block_gen++; // rollback后block恢复为原来的内容
 }
 // ============================================
 /*
@@ -4727,36 +6794,170 @@ static unsigned int genblockindex(FileFS *ffs)
 		return blockindex;
 	}
 	
-	// unused_block找不到空闲块，则在fp_add里新增一个block，并将new_total_blocksize+1
-	blockindex = ffs->tmp.new_total_blocksize;
-	unsigned int addindex;
-	unsigned long long pos;
-	unsigned char b4[4];
-	
-	addindex = blockindex - ffs->tmp.total_blocksize;
-	pos = addindex;
-	pos *= (4+BLOCKSIZE);
-	ffs_fsetpos(ffs->tmp.fp_add, pos);
-	U32toB4(blockindex, b4);
-	if ( 4 != ffs_fwrite(b4, 1, 4, ffs->tmp.fp_add) ) return 0;
-	if ( BLOCKSIZE != ffs_fwrite(block, 1, BLOCKSIZE, ffs->tmp.fp_add) ) return 0; // block未做任何初始化，因为此时block的数据无任何意义
-	ffs->tmp.new_total_blocksize++;
-	
-	ffs->tmp.add_size++;
+	// unused_block找不到空闲块
+	return addblockindex(ffs);
+}
+
+/*
+blockindex将成为空闲链表头，它的next为当前的链表头，在removeblock中调用
+当前的链表头在缓存中时，去掉它之前已经取出的部分，在前面插入blockindex；否则缓存无效
+*/
+static void freecache_push(FileFS *ffs, unsigned int blockindex)
+{
+	FreeCache *fc = &ffs->tmp.free;
+	unsigned int head = ffs->tmp.new_unused_blockhead;
+	int j;
 	
-	return blockindex;
+	for (j=0; j<fc->count && fc->idx[j]!=head; j++) ;
+	if ( head > 0 && j == fc->count ) {
+		fc->count = 0;
+		return;
+	}
+	if ( head == 0 ) j = fc->count = 0; // 空闲链表为空
+	fc->count -= j;
+	if ( fc->count == GENBLOCK_SCANMAX ) fc->count--;
+	memmove(fc->idx + 1, fc->idx + j, fc->count * sizeof(unsigned int));
+	memmove(fc->next + 1, fc->next + j, fc->count * sizeof(unsigned int));
+	fc->idx[0] = blockindex;
+	fc->next[0] = head;
+	fc->count++;
 }
 
 /*
-读取的block可能来自fp/fp_cp/fp_add中的任一个
+在hint附近分配block，用于目录的延伸块和文件的第一个block，使ls和读取目录中的小文件集中在一个区域
+在空闲链表的前GENBLOCK_SCANMAX个block中选择离hint最近的，可以从链表中间取出
+链表头部的block和它们的next缓存在tmp.free中，每个block进入缓存时只读取一次，平均每次分配约一次readblock，和genblockindex相同
+从链表中间取出时只需改写前一个block的next，空闲block的其它内容没有意义，不需要读取
+空闲链表为空时才增加block，hint靠近尾部时也先使用空闲的block，container不会因此增大
+return:0-生成失败,other-返回可用的blockindex
 */
-static unsigned char readblock(FileFS *ffs, unsigned int blockindex, unsigned char *block)
+static unsigned int genblockindex_near(FileFS *ffs, unsigned int hint)
 {
-	unsigned long long pos;
-	unsigned int addindex;
-	unsigned char buf[4], b4[4];
-	unsigned int cpindex, orgindex;;
-		
+	FreeCache *fc = &ffs->tmp.free;
+	unsigned char block[BLOCKSIZE];
+	unsigned int head = ffs->tmp.new_unused_blockhead;
+	unsigned int index, best;
+	unsigned int dist, best_dist = 0xFFFFFFFF;
+	int i, j, b = 0;
+	
+	if ( hint == 0 ) return genblockindex(ffs);
+	if ( head == 0 ) return addblockindex(ffs); // 空闲链表为空
+	
+	// 去掉已经被genblockindex等取出的部分，再从缓存的尾部补充，只读取新进入缓存的block
+	for (j=0; j<fc->count && fc->idx[j]!=head; j++) ;
+	if ( j == fc->count ) {
+		fc->count = 0;
+		index = head;
+	} else {
+		fc->count -= j;
+		memmove(fc->idx, fc->idx + j, fc->count * sizeof(unsigned int));
+		memmove(fc->next, fc->next + j, fc->count * sizeof(unsigned int));
+		index = fc->next[fc->count-1];
+	}
+	while ( fc->count < GENBLOCK_SCANMAX && index > 0 ) {
+		if ( ! readblock(ffs, index, block) ) {
+			fc->count = 0;
+			return 0;
+		}
+		fc->idx[fc->count] = index;
+		fc->next[fc->count] = B4toU32(block+4);
+		index = fc->next[fc->count++];
+	}
+	
+	for (i=0; i<fc->count; i++) {
+		dist = fc->idx[i] > hint ? fc->idx[i] - hint : hint - fc->idx[i];
+		if ( dist < best_dist ) {
+			b = i;
+			best_dist = dist;
+		}
+	}
+	best = fc->idx[b];
+	
+	// 从空闲链表中取出best
+	if ( b == 0 ) {
+		ffs->tmp.new_unused_blockhead = fc->next[0];
+	} else {
+		memset(block, 0, BLOCKSIZE);
+		U32toB4(fc->next[b], block+4);
+		if ( ! writeblock(ffs, fc->idx[b-1], block) ) {
+			fc->count = 0;
+			return 0;
+		}
+		fc->next[b-1] = fc->next[b];
+	}
+	fc->count--;
+	memmove(fc->idx + b, fc->idx + b + 1, (fc->count - b) * sizeof(unsigned int));
+	memmove(fc->next + b, fc->next + b + 1, (fc->count - b) * sizeof(unsigned int));
+	
+	return best;
+}
+
+// 在fp_add里新增一个block，并将new_total_blocksize+1
+static unsigned int addblockindex(FileFS *ffs)
+{
+	unsigned int blockindex;
+	unsigned char block[BLOCKSIZE];
+	
+	blockindex = ffs->tmp.new_total_blocksize;
+	unsigned int addindex;
+	unsigned long long pos;
+	unsigned char b4[4];
+	
+	addindex = blockindex - ffs->tmp.total_blocksize;
+	pos = addindex;
+	pos *= (4+BLOCKSIZE);
+	ffs_fsetpos(ffs->tmp.fp_add, pos);
+	U32toB4(blockindex, b4);
+	if ( 4 != ffs_fwrite(b4, 1, 4, ffs->tmp.fp_add) ) return 0;
+	if ( BLOCKSIZE != ffs_fwrite(block, 1, BLOCKSIZE, ffs->tmp.fp_add) ) return 0; // block未做任何初始化，因为此时block的数据无任何意义
+	ffs->tmp.new_total_blocksize++;
+	
+	ffs->tmp.add_size++;
+	
+	return blockindex;
+}
+
+/*
+分配最多count个连续的block，新的block必须全部写入
+空闲链表的头部是连续的block时(例如刚删除的文件)使用这部分，*n返回实际分配的数量
+空闲链表为空时在fp_add里新增count个
+return:0-生成失败,other-起始blockindex
+*/
+static unsigned int genblockrun(FileFS *ffs, unsigned int count, unsigned int *n)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int head = ffs->tmp.new_unused_blockhead;
+	unsigned int index = head, i;
+	
+	if ( head > 0 ) {
+		for (i=0; i<count && index == head+i; i++) {
+			if ( ! readblock(ffs, index, block) ) return 0;
+			index = B4toU32(block+4);
+		}
+		ffs->tmp.new_unused_blockhead = index;
+		*n = i;
+		return head;
+	}
+	
+	head = ffs->tmp.new_total_blocksize;
+	for (i=0; i<count; i++) {
+		if ( addblockindex(ffs) == 0 ) return 0;
+	}
+	*n = count;
+	
+	return head;
+}
+
+/*
+读取的block可能来自fp/fp_cp/fp_add中的任一个
+*/
+static unsigned char readblock(FileFS *ffs, unsigned int blockindex, unsigned char *block)
+{
+	unsigned long long pos;
+	unsigned int addindex;
+	unsigned char buf[4], b4[4];
+	unsigned int cpindex, orgindex;;
+		
 	pos = blockindex;
 	pos *= BLOCKSIZE;
 	ffs_fsetpos(ffs->fp, pos);
@@ -4819,6 +7020,7 @@ static unsigned char writeblock(FileFS *ffs, unsigned int blockindex, unsigned c
 		//printf("1\n");
 		return 0;
 	}
+	ffs->block_gen++;
 	
 	unsigned long long pos;
 	unsigned int addindex;
@@ -4902,9 +7104,64 @@ static unsigned char writeblock(FileFS *ffs, unsigned int blockindex, unsigned c
 	return 1;
 }
 
+/*
+读取从blockindex开始count个连续的block到buf
+不在事务中时block都在fp中，一次读取；否则逐个readblock
+*/
+static unsigned char readblockrun(FileFS *ffs, unsigned int blockindex, unsigned int count, unsigned char *buf)
+{
+	unsigned long long pos;
+	unsigned int i;
+	
+	if ( ffs->tmp.state == 0 ) {
+		pos = blockindex;
+		pos *= BLOCKSIZE;
+		ffs_fsetpos(ffs->fp, pos);
+		if ( (size_t)count * BLOCKSIZE == ffs_fread(buf, 1, (size_t)count * BLOCKSIZE, ffs->fp) ) return 1;
+	}
+	
+	for (i=0; i<count; i++) {
+		if ( ! readblock(ffs, blockindex + i, buf + i * BLOCKSIZE) ) return 0;
+	}
+	return 1;
+}
+
+/*
+写入从blockindex开始count个连续的block
+都是本次事务新增的block时，在fp_add中也是连续的，一次写入；否则逐个writeblock
+*/
+static unsigned char writeblockrun(FileFS *ffs, unsigned int blockindex, unsigned int count, unsigned char *buf)
+{
+	unsigned char run[BLOCK_RUNMAX * (4+BLOCKSIZE)];
+	unsigned long long pos;
+	unsigned int i;
+	
+	if ( ffs->tmp.state == 0 ) return 0;
+	ffs->block_gen++;
+	
+	if ( count <= BLOCK_RUNMAX && blockindex >= ffs->tmp.total_blocksize 
+		&& blockindex - ffs->tmp.total_blocksize + count <= ffs->tmp.add_size ) {
+		for (i=0; i<count; i++) {
+			U32toB4(blockindex + i, run + i * (4+BLOCKSIZE));
+			memcpy(run + i * (4+BLOCKSIZE) + 4, buf + i * BLOCKSIZE, BLOCKSIZE);
+		}
+		pos = blockindex - ffs->tmp.total_blocksize;
+		pos *= (4+BLOCKSIZE);
+		ffs_fsetpos(ffs->tmp.fp_add, pos);
+		if ( (size_t)count * (4+BLOCKSIZE) != ffs_fwrite(run, 1, (size_t)count * (4+BLOCKSIZE), ffs->tmp.fp_add) ) return 0;
+		return 1;
+	}
+	
+	for (i=0; i<count; i++) {
+		if ( ! writeblock(ffs, blockindex + i, buf + i * BLOCKSIZE) ) return 0;
+	}
+	return 1;
+}
+
 static unsigned char removeblock(FileFS *ffs, unsigned int blockindex)
 {
 	if ( ffs->tmp.state == 0 ) return 0;
+	ffs->block_gen++;
 	
 	// 读取block
 	unsigned long long pos;
@@ -4926,6 +7183,7 @@ static unsigned char removeblock(FileFS *ffs, unsigned int blockindex)
 		ffs_fsetpos(ffs->tmp.fp_add, pos);
 		U32toB4(ffs->tmp.new_unused_blockhead, b4);
 		if ( 4 != ffs_fwrite(b4, 1, 4, ffs->tmp.fp_add) ) return 0; // 写入new_unused_blockhead
+		freecache_push(ffs, blockindex);
 		ffs->tmp.new_unused_blockhead = blockindex; // 将blockindex存入new_unused_blockhead
 		// printf("2.set new_unused_blockhead:%d\n", ffs->tmp.new_unused_blockhead);
 		return 1;
@@ -4947,6 +7205,7 @@ static unsigned char removeblock(FileFS *ffs, unsigned int blockindex)
 				ffs_fsetpos(ffs->tmp.fp_cp, pos);
 				U32toB4(ffs->tmp.new_unused_blockhead, b4); // 写入blockindex(new_unused_blockhead)到fp_cp
 				if ( 4 != ffs_fwrite(b4, 1, 4, ffs->tmp.fp_cp) ) return 0;
+				freecache_push(ffs, blockindex);
 				ffs->tmp.new_unused_blockhead = blockindex; // 将blockindex存入new_unused_blockhead
 				// printf("5.set new_unused_blockhead:%d\n", ffs->tmp.new_unused_blockhead);
 				return 1;
@@ -4975,11 +7234,1800 @@ static unsigned char removeblock(FileFS *ffs, unsigned int blockindex)
 	
 	ffs->tmp.cp_size++;
 	
+	freecache_push(ffs, blockindex);
 	ffs->tmp.new_unused_blockhead = blockindex; // 将blockindex存入new_unused_blockhead
 	// printf("3.set new_unused_blockhead:%d\n", ffs->tmp.new_unused_blockhead);
 	return 1;
 }
 
+// =======================================
+// 块映射文件
+// =======================================
+// 层数为depth的映射树可容纳的block数量
+static unsigned long long map_capacity(unsigned char depth)
+{
+	unsigned long long n = 1;
+	unsigned char i;
+	for (i=0; i<depth; i++) n *= MAP_ITEM_MAXCOUNT;
+	return n;
+}
+
+// 读取block额外的引用数量(reflink)
+static unsigned char ref_get(FileFS *ffs, unsigned int blockindex, unsigned int *count)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int index;
+	int level;
+	
+	*count = 0;
+	index = ffs->tmp.new_ref_root;
+	if ( index == 0 ) return 1;
+	if ( blockindex >= map_capacity(ffs->tmp.new_ref_depth) ) return 1;
+	
+	for (level=ffs->tmp.new_ref_depth-1; level>=0; level--) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		index = B4toU32(block + BLOCK_HEAD + ((blockindex / map_capacity((unsigned char)level)) % MAP_ITEM_MAXCOUNT) * 4);
+		if ( index == 0 ) return 1;
+	}
+	*count = index;
+	
+	return 1;
+}
+
+// 设置block额外的引用数量，需要时增加层数和表中的块，在事务中调用
+// 引用计数表的块中是否全部为0
+static unsigned char ref_empty(unsigned char *block)
+{
+	int i;
+	
+	for (i=0; i<MAP_ITEM_MAXCOUNT*4; i++) {
+		if ( block[BLOCK_HEAD+i] != 0 ) return 0;
+	}
+	return 1;
+}
+
+/*
+path[level]为blockindex所在的各层表块，叶子已经全部为0，从叶子开始释放空的表块
+上一层的表块中还有其它项目时停止，root也释放时引用计数表为空
+*/
+static unsigned char ref_release(FileFS *ffs, unsigned int blockindex, unsigned int *path)
+{
+	unsigned char block[BLOCKSIZE];
+	int level;
+	
+	for (level=0; level<ffs->tmp.new_ref_depth; level++) {
+		if ( ! removeblock(ffs, path[level]) ) return 0;
+		if ( level == ffs->tmp.new_ref_depth - 1 ) break;
+		if ( ! readblock(ffs, path[level+1], block) ) return 0;
+		memset(block + BLOCK_HEAD + ((blockindex / map_capacity((unsigned char)(level+1))) % MAP_ITEM_MAXCOUNT) * 4, 0, 4);
+		if ( ! ref_empty(block) ) return writeblock(ffs, path[level+1], block);
+	}
+	
+	ffs->tmp.new_ref_root = 0;
+	ffs->tmp.new_ref_depth = 0;
+	return 1;
+}
+
+static unsigned char ref_set(FileFS *ffs, unsigned int blockindex, unsigned int count)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned char *p;
+	unsigned int index, child;
+	unsigned int path[MAP_MAXDEPTH];
+	int level;
+	
+	if ( ffs->tmp.new_ref_root == 0 ) {
+		if ( count == 0 ) return 1;
+		index = genblockindex(ffs);
+		if ( index == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		if ( ! writeblock(ffs, index, block) ) return 0;
+		ffs->tmp.new_ref_root = index;
+		ffs->tmp.new_ref_depth = 1;
+	}
+	
+	// 层数不够时，新的root的第0项指向原来的root
+	while ( blockindex >= map_capacity(ffs->tmp.new_ref_depth) ) {
+		if ( count == 0 ) return 1;
+		index = genblockindex(ffs);
+		if ( index == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		U32toB4(ffs->tmp.new_ref_root, block + BLOCK_HEAD);
+		if ( ! writeblock(ffs, index, block) ) return 0;
+		ffs->tmp.new_ref_root = index;
+		ffs->tmp.new_ref_depth++;
+	}
+	
+	index = ffs->tmp.new_ref_root;
+	for (level=ffs->tmp.new_ref_depth-1; level>=0; level--) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		path[level] = index;
+		p = block + BLOCK_HEAD + ((blockindex / map_capacity((unsigned char)level)) % MAP_ITEM_MAXCOUNT) * 4;
+		if ( level == 0 ) {
+			U32toB4(count, p);
+			if ( count == 0 && ref_empty(block) ) return ref_release(ffs, blockindex, path); // 最后的引用数量为0
+			return writeblock(ffs, index, block);
+		}
+		child = B4toU32(p);
+		if ( child == 0 ) {
+			if ( count == 0 ) return 1;
+			child = genblockindex(ffs);
+			if ( child == 0 ) return 0;
+			U32toB4(child, p);
+			if ( ! writeblock(ffs, index, block) ) return 0;
+			memset(block, 0, BLOCKSIZE);
+			if ( ! writeblock(ffs, child, block) ) return 0;
+		}
+		index = child;
+	}
+	
+	return 0;
+}
+
+/*
+写入前调用: block被共享时复制一份，原来的block引用数量减1，复制索引块时子块的引用数量加1
+depth: 0-数据块,>0-索引块，在事务中调用
+return: 0-err,other-可以写入的blockindex
+*/
+static unsigned int ref_cow(FileFS *ffs, unsigned int blockindex, unsigned char depth)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int count, child, n, new_blockindex;
+	int i;
+	
+	if ( ! ref_get(ffs, blockindex, &count) ) return 0;
+	if ( count == 0 ) return blockindex;
+	
+	if ( ! readblock(ffs, blockindex, block) ) return 0;
+	if ( depth > 0 ) {
+		for (i=0; i<MAP_ITEM_MAXCOUNT; i++) {
+			child = B4toU32(block + BLOCK_HEAD + i*4);
+			if ( child == 0 ) continue;
+			if ( ! ref_get(ffs, child, &n) ) return 0;
+			if ( ! ref_set(ffs, child, n + 1) ) return 0;
+		}
+	}
+	new_blockindex = genblockindex_near(ffs, blockindex);
+	if ( new_blockindex == 0 ) return 0;
+	if ( ! writeblock(ffs, new_blockindex, block) ) return 0;
+	if ( ! ref_set(ffs, blockindex, count - 1) ) return 0;
+	
+	return new_blockindex;
+}
+
+// 共享的root先复制，在事务中调用
+static unsigned char map_cowroot(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned int index;
+	
+	if ( stream->file_start_blockindex == 0 ) return 1;
+	index = ref_cow(ffs, stream->file_start_blockindex, stream->map_depth);
+	if ( index == 0 ) return 0;
+	if ( index != stream->file_start_blockindex ) {
+		stream->file_start_blockindex = index;
+		stream->leaf_blockindex = 0;
+	}
+	
+	return 1;
+}
+
+// 从目录项state和root中读取块映射参数
+static unsigned char map_open(FileFS *ffs, FFS_FILE *stream, unsigned char state)
+{
+	unsigned char block[BLOCKSIZE];
+	
+	stream->map = 1;
+	stream->map_depth = (state & ITEM_DEPTH_MASK) >> ITEM_DEPTH_SHIFT;
+	stream->compress = (state & ITEM_COMPRESS) ? 1 : 0;
+	stream->cmp_valid = 0;
+	stream->size = 0;
+	stream->leaf_blockindex = 0;
+	stream->pos_blockindex = 0;
+	stream->pos_offset = 0;
+	if ( stream->file_start_blockindex == 0 ) {
+		if ( stream->file_stop_blockindex == 0 ) return 1;
+		// 只有一个打包的片段
+		if ( ! readblock(ffs, stream->file_stop_blockindex, block) ) return 0;
+		stream->size = B2toU16(block + stream->file_offset);
+		return 1;
+	}
+	
+	if ( ! readblock(ffs, stream->file_start_blockindex, block) ) return 0;
+	stream->size = B8toU64(block+4);
+	
+	return 1;
+}
+
+// 查找文件第fileblock个block，*blockindex为0表示空洞
+static unsigned char map_get(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int *blockindex)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned long long span, base;
+	unsigned int index;
+	int level;
+	
+	*blockindex = 0;
+	if ( stream->file_start_blockindex == 0 ) return 1;
+	if ( stream->map_depth == 0 ) {
+		if ( fileblock == 0 ) *blockindex = stream->file_start_blockindex;
+		return 1;
+	}
+	if ( fileblock >= map_capacity(stream->map_depth) ) return 1;
+	
+	base = fileblock - fileblock % MAP_ITEM_MAXCOUNT;
+	if ( stream->leaf_blockindex != 0 && stream->leaf_base == base ) {
+		*blockindex = B4toU32(stream->leaf + BLOCK_HEAD + (fileblock - base) * 4);
+		return 1;
+	}
+	
+	index = stream->file_start_blockindex;
+	for (level=stream->map_depth-1; level>0; level--) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		span = map_capacity((unsigned char)level);
+		index = B4toU32(block + BLOCK_HEAD + ((fileblock / span) % MAP_ITEM_MAXCOUNT) * 4);
+		if ( index == 0 ) return 1; // 空洞
+	}
+	if ( ! readblock(ffs, index, stream->leaf) ) {
+		stream->leaf_blockindex = 0;
+		return 0;
+	}
+	stream->leaf_blockindex = index;
+	stream->leaf_base = base;
+	*blockindex = B4toU32(stream->leaf + BLOCK_HEAD + (fileblock - base) * 4);
+	
+	return 1;
+}
+
+// 查找文件第fileblock个block用于写入，路径上共享的块先复制(reflink)，*blockindex为0表示空洞，在事务中调用
+static unsigned char map_getw(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int *blockindex)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned char *p;
+	unsigned int index, child, index_cow;
+	int level;
+	
+	if ( ffs->tmp.new_ref_root == 0 ) return map_get(ffs, stream, fileblock, blockindex); // 没有共享的block
+	
+	*blockindex = 0;
+	if ( stream->file_start_blockindex == 0 ) return 1;
+	if ( ! map_cowroot(ffs, stream) ) return 0;
+	if ( stream->map_depth == 0 ) {
+		if ( fileblock == 0 ) *blockindex = stream->file_start_blockindex;
+		return 1;
+	}
+	if ( fileblock >= map_capacity(stream->map_depth) ) return 1;
+	
+	index = stream->file_start_blockindex;
+	for (level=stream->map_depth-1; level>=0; level--) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		p = block + BLOCK_HEAD + ((fileblock / map_capacity((unsigned char)level)) % MAP_ITEM_MAXCOUNT) * 4;
+		child = B4toU32(p);
+		if ( child == 0 ) return 1; // 空洞
+		index_cow = ref_cow(ffs, child, (unsigned char)level);
+		if ( index_cow == 0 ) return 0;
+		if ( index_cow != child ) {
+			U32toB4(index_cow, p);
+			if ( ! writeblock(ffs, index, block) ) return 0;
+		}
+		if ( level == 0 ) {
+			memcpy(stream->leaf, block, BLOCKSIZE);
+			stream->leaf_blockindex = index;
+			stream->leaf_base = fileblock - fileblock % MAP_ITEM_MAXCOUNT;
+			*blockindex = index_cow;
+			return 1;
+		}
+		index = index_cow;
+	}
+	
+	return 0;
+}
+
+// 设置文件第fileblock个block，需要时增加层数和索引块，在事务中调用
+static unsigned char map_set(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int blockindex)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned long long span;
+	unsigned int index, child, index_cow;
+	unsigned char depth;
+	int level;
+	
+	if ( stream->map_depth == 0 && fileblock == 0 ) {
+		stream->file_start_blockindex = blockindex;
+		return 1;
+	}
+	
+	// 空文件直接生成足够层数的root
+	if ( stream->file_start_blockindex == 0 ) {
+		depth = 1;
+		while ( fileblock >= map_capacity(depth) ) depth++;
+		if ( depth > MAP_MAXDEPTH ) return 0;
+		index = genblockindex(ffs);
+		if ( index == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		if ( ! writeblock(ffs, index, block) ) return 0;
+		stream->file_start_blockindex = index;
+		stream->map_depth = depth;
+	}
+	
+	// 层数不够时，新的root的第0项指向原来的root
+	while ( fileblock >= map_capacity(stream->map_depth) ) {
+		if ( stream->map_depth >= MAP_MAXDEPTH ) return 0;
+		index = genblockindex(ffs);
+		if ( index == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		U32toB4(stream->file_start_blockindex, block + BLOCK_HEAD);
+		if ( ! writeblock(ffs, index, block) ) return 0;
+		stream->file_start_blockindex = index;
+		stream->map_depth++;
+	}
+	
+	// 共享的root和索引块先复制(reflink)
+	if ( ! map_cowroot(ffs, stream) ) return 0;
+	index = stream->file_start_blockindex;
+	for (level=stream->map_depth-1; level>=0; level--) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		span = map_capacity((unsigned char)level);
+		if ( level == 0 ) {
+			U32toB4(blockindex, block + BLOCK_HEAD + (fileblock % MAP_ITEM_MAXCOUNT) * 4);
+			if ( ! writeblock(ffs, index, block) ) return 0;
+			memcpy(stream->leaf, block, BLOCKSIZE);
+			stream->leaf_blockindex = index;
+			stream->leaf_base = fileblock - fileblock % MAP_ITEM_MAXCOUNT;
+			return 1;
+		}
+		child = B4toU32(block + BLOCK_HEAD + ((fileblock / span) % MAP_ITEM_MAXCOUNT) * 4);
+		if ( child == 0 ) {
+			child = genblockindex(ffs);
+			if ( child == 0 ) return 0;
+			U32toB4(child, block + BLOCK_HEAD + ((fileblock / span) % MAP_ITEM_MAXCOUNT) * 4);
+			if ( ! writeblock(ffs, index, block) ) return 0;
+			memset(block, 0, BLOCKSIZE);
+			if ( ! writeblock(ffs, child, block) ) return 0;
+		} else {
+			index_cow = ref_cow(ffs, child, (unsigned char)level);
+			if ( index_cow == 0 ) return 0;
+			if ( index_cow != child ) {
+				child = index_cow;
+				U32toB4(child, block + BLOCK_HEAD + ((fileblock / span) % MAP_ITEM_MAXCOUNT) * 4);
+				if ( ! writeblock(ffs, index, block) ) return 0;
+			}
+		}
+		index = child;
+	}
+	
+	return 0;
+}
+
+// 设置从fileblock开始count个连续的block，不能跨越叶子索引块，叶子索引块只写入一次，在事务中调用
+static unsigned char map_setrun(FileFS *ffs, FFS_FILE *stream, unsigned long long fileblock, unsigned int blockindex, unsigned int count)
+{
+	unsigned int i;
+	
+	if ( ! map_set(ffs, stream, fileblock, blockindex) ) return 0;
+	if ( count == 1 ) return 1;
+	if ( stream->map_depth == 0 ) { // 只有第0个block时root就是数据块，之后增加层数
+		for (i=1; i<count; i++) {
+			if ( ! map_set(ffs, stream, fileblock + i, blockindex + i) ) return 0;
+		}
+		return 1;
+	}
+	
+	// map_set之后stream->leaf就是可以写入的叶子索引块
+	for (i=1; i<count; i++) U32toB4(blockindex + i, stream->leaf + BLOCK_HEAD + (fileblock + i - stream->leaf_base) * 4);
+	return writeblock(ffs, stream->leaf_blockindex, stream->leaf);
+}
+
+// 将文件长度写入root，将root和层数写入目录项
+static unsigned char map_sync(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int index;
+	
+	// 延迟分配的block全部被丢弃(punch_hole)后没有root，分配全0的数据块作为depth=0的root保存文件长度
+	if ( stream->file_start_blockindex == 0 && stream->size > 0 && stream->dirty_count == 0 ) {
+		index = genblockindex_near(ffs, stream->dir_blockindex);
+		if ( index == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		if ( ! writeblock(ffs, index, block) ) return 0;
+		stream->file_start_blockindex = index;
+		stream->map_depth = 0;
+		stream->leaf_blockindex = 0;
+	}
+	
+	if ( stream->file_start_blockindex > 0 ) {
+		if ( ! map_cowroot(ffs, stream) ) return 0;
+		if ( ! readblock(ffs, stream->file_start_blockindex, block) ) return 0;
+		U64toB8(stream->size, block+4);
+		if ( ! writeblock(ffs, stream->file_start_blockindex, block) ) return 0;
+	}
+	
+	if ( ! readblock(ffs, stream->dir_blockindex, block) ) return 0;
+	block[stream->dir_offset-25] = ITEM_FILE | ITEM_MAP | (stream->map_depth << ITEM_DEPTH_SHIFT) | (stream->compress ? ITEM_COMPRESS : 0);
+	U32toB4(stream->file_start_blockindex, block + stream->dir_offset-10);
+	U32toB4(stream->file_stop_blockindex, block + stream->dir_offset-6);
+	U16toB2(stream->file_offset, block + stream->dir_offset-2);
+	if ( ! writeblock(ffs, stream->dir_blockindex, block) ) return 0;
+	
+	return 1;
+}
+
+/*
+释放整个映射树，depth=0时只释放一个数据块
+空闲链表是后进先出的，先释放索引块，再倒序释放数据块，使得释放后空闲链表的头部是按文件顺序连续的block
+共享的子树只减少引用数量
+*/
+static unsigned char map_free(FileFS *ffs, unsigned int blockindex, unsigned char depth)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int child, count;
+	int i;
+	
+	if ( ! ref_get(ffs, blockindex, &count) ) return 0;
+	if ( count > 0 ) return ref_set(ffs, blockindex, count - 1);
+	
+	if ( depth == 0 ) return removeblock(ffs, blockindex);
+	
+	if ( ! readblock(ffs, blockindex, block) ) return 0;
+	if ( ! removeblock(ffs, blockindex) ) return 0;
+	for (i=MAP_ITEM_MAXCOUNT-1; i>=0; i--) {
+		child = B4toU32(block + BLOCK_HEAD + i*4);
+		if ( child == 0 ) continue;
+		if ( ! map_free(ffs, child, depth-1) ) return 0;
+	}
+	
+	return 1;
+}
+
+/*
+释放子树中文件块序号在[lo, hi)中的数据块，base为子树第0项对应的文件块序号
+清空的索引子树一并释放，子树自身是否已清空由*empty返回，由调用者决定是否释放
+blockindex必须没有被共享，部分释放的共享子树先复制
+*/
+static unsigned char map_punch(FileFS *ffs, unsigned int blockindex, unsigned char depth, 
+	unsigned long long base, unsigned long long lo, unsigned long long hi, unsigned char *empty)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned long long span, child_base;
+	unsigned int child, child_cow;
+	unsigned char changed = 0, child_empty;
+	int i, live = 0;
+	
+	*empty = 0;
+	if ( ! readblock(ffs, blockindex, block) ) return 0;
+	span = map_capacity(depth-1);
+	for (i=0; i<MAP_ITEM_MAXCOUNT; i++) {
+		child = B4toU32(block + BLOCK_HEAD + i*4);
+		if ( child == 0 ) continue;
+		child_base = base + span * i;
+		if ( child_base + span <= lo || child_base >= hi ) {
+			live++;
+			continue;
+		}
+		if ( depth == 1 || (child_base >= lo && child_base + span <= hi) ) { // 整个子树都在范围内
+			if ( ! map_free(ffs, child, depth-1) ) return 0;
+		} else {
+			child_cow = ref_cow(ffs, child, depth-1);
+			if ( child_cow == 0 ) return 0;
+			if ( child_cow != child ) {
+				child = child_cow;
+				U32toB4(child, block + BLOCK_HEAD + i*4);
+				changed = 1;
+			}
+			if ( ! map_punch(ffs, child, depth-1, child_base, lo, hi, &child_empty) ) return 0;
+			if ( ! child_empty ) {
+				live++;
+				continue;
+			}
+			if ( ! removeblock(ffs, child) ) return 0;
+		}
+		memset(block + BLOCK_HEAD + i*4, 0, 4);
+		changed = 1;
+	}
+	
+	if ( changed ) {
+		if ( ! writeblock(ffs, blockindex, block) ) return 0;
+	}
+	if ( live == 0 ) *empty = 1;
+	
+	return 1;
+}
+
+// 将block链文件转换为块映射文件，数据块的格式相同，直接使用原来的block，在事务中调用
+static unsigned char chain2map(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int index, next;
+	unsigned long long n = 0, size = 0;
+	
+	unsigned int org_start_blockindex = stream->file_start_blockindex;
+	
+	index = stream->file_start_blockindex;
+	stream->file_start_blockindex = 0;
+	stream->map_depth = 0;
+	stream->leaf_blockindex = 0;
+	while ( index > 0 ) {
+		if ( index == stream->file_stop_blockindex ) {
+			next = 0;
+			size += stream->file_offset - BLOCK_HEAD;
+		} else {
+			if ( ! readblock(ffs, index, block) ) break;
+			next = B4toU32(block+4);
+			size += BLOCK_DATASIZE;
+		}
+		if ( ! map_set(ffs, stream, n, index) ) break;
+		n++;
+		index = next;
+	}
+	if ( index > 0 ) { // 失败，恢复为block链
+		stream->file_start_blockindex = org_start_blockindex;
+		stream->map_depth = 0;
+		stream->leaf_blockindex = 0;
+		return 0;
+	}
+	
+	stream->map = 1;
+	stream->size = size;
+	stream->file_stop_blockindex = 0;
+	stream->file_offset = 0;
+	stream->pos_blockindex = 0;
+	stream->pos_offset = 0;
+	
+	return map_sync(ffs, stream);
+}
+
+// 在目录的pack block中追加一个片段，放不下时分配新的pack block，在事务中调用
+static unsigned char pack_alloc(FileFS *ffs, unsigned int dir_head_blockindex, unsigned char *data, unsigned short len, 
+	unsigned int *pack_blockindex, unsigned short *pack_offset)
+{
+	unsigned char head[BLOCKSIZE], block[BLOCKSIZE];
+	unsigned int index;
+	unsigned short end = 0;
+	
+	if ( ! readblock(ffs, dir_head_blockindex, head) ) return 0;
+	index = B4toU32(head + BLOCK_PACK_BLOCKINDEX);
+	if ( index > 0 ) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		end = B2toU16(block+4);
+	}
+	if ( index == 0 || end + 2 + len > BLOCKSIZE ) {
+		index = genblockindex_near(ffs, dir_head_blockindex);
+		if ( index == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		U32toB4(dir_head_blockindex, block+8);
+		end = BLOCK_HEAD;
+		U32toB4(index, head + BLOCK_PACK_BLOCKINDEX);
+		if ( ! writeblock(ffs, dir_head_blockindex, head) ) return 0;
+	}
+	
+	U16toB2(len, block + end);
+	memcpy(block + end + 2, data, len);
+	*pack_blockindex = index;
+	*pack_offset = end;
+	U16toB2(end + 2 + len, block+4);
+	U16toB2(B2toU16(block+6) + 1, block+6);
+	
+	return writeblock(ffs, index, block);
+}
+
+// 释放一个片段，片段数量为0时释放pack block，目录当前使用的pack block则清空后继续使用，在事务中调用
+static unsigned char pack_free(FileFS *ffs, unsigned int pack_blockindex, unsigned short pack_offset)
+{
+	unsigned char block[BLOCKSIZE], head[BLOCKSIZE];
+	unsigned short len, count;
+	unsigned int owner;
+	
+	if ( ! readblock(ffs, pack_blockindex, block) ) return 0;
+	len = B2toU16(block + pack_offset);
+	count = B2toU16(block+6) - 1;
+	U16toB2(count, block+6);
+	// 最后一个片段可以直接回收
+	if ( pack_offset + 2 + len == B2toU16(block+4) ) U16toB2(pack_offset, block+4);
+	
+	if ( count == 0 ) {
+		// 是目录当前的pack block时，目录中不再有pack block，下次打包时重新分配
+		owner = B4toU32(block+8);
+		if ( owner > 0 ) {
+			if ( ! readblock(ffs, owner, head) ) return 0;
+			if ( B4toU32(head + BLOCK_PACK_BLOCKINDEX) == pack_blockindex ) {
+				memset(head + BLOCK_PACK_BLOCKINDEX, 0, 4);
+				if ( ! writeblock(ffs, owner, head) ) return 0;
+			}
+		}
+		return removeblock(ffs, pack_blockindex);
+	}
+	
+	return writeblock(ffs, pack_blockindex, block);
+}
+
+// 将片段复制到另一个目录的pack block中，在事务中调用
+static unsigned char pack_copy(FileFS *ffs, unsigned int pack_blockindex, unsigned short pack_offset, unsigned int dir_head_blockindex, 
+	unsigned int *new_pack_blockindex, unsigned short *new_pack_offset)
+{
+	unsigned char block[BLOCKSIZE];
+	
+	if ( ! readblock(ffs, pack_blockindex, block) ) return 0;
+	return pack_alloc(ffs, dir_head_blockindex, block + pack_offset + 2, B2toU16(block + pack_offset), 
+		new_pack_blockindex, new_pack_offset);
+}
+
+// 将文件最后一个不完整的block打包，释放原来的block，在事务中调用
+static unsigned char map_pack(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned long long fileblock;
+	unsigned int blockindex, pack_blockindex;
+	unsigned short len, pack_offset;
+	unsigned char empty;
+	
+	len = (unsigned short)(stream->size % BLOCK_DATASIZE);
+	if ( stream->file_stop_blockindex > 0 || len == 0 || len > PACK_MAXSIZE ) return 1;
+	
+	fileblock = stream->size / BLOCK_DATASIZE;
+	if ( ! map_get(ffs, stream, fileblock, &blockindex) ) return 0;
+	if ( blockindex == 0 ) return 1; // 空洞
+	if ( ! readblock(ffs, blockindex, block) ) return 0;
+	if ( ! pack_alloc(ffs, stream->dir_head_blockindex, block + BLOCK_HEAD, len, &pack_blockindex, &pack_offset) ) return 0;
+	
+	if ( stream->map_depth == 0 ) {
+		if ( ! map_free(ffs, blockindex, 0) ) return 0;
+		stream->file_start_blockindex = 0;
+	} else {
+		if ( ! map_cowroot(ffs, stream) ) return 0;
+		if ( ! map_punch(ffs, stream->file_start_blockindex, stream->map_depth, 0, fileblock, fileblock+1, &empty) ) return 0;
+		stream->leaf_blockindex = 0;
+	}
+	stream->file_stop_blockindex = pack_blockindex;
+	stream->file_offset = pack_offset;
+	
+	return map_sync(ffs, stream);
+}
+
+// 将打包的尾部恢复为普通的block，写入前调用，在事务中调用
+static unsigned char map_unpack(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE], pack[BLOCKSIZE];
+	unsigned int blockindex;
+	
+	if ( stream->file_stop_blockindex == 0 ) return 1;
+	
+	if ( ! readblock(ffs, stream->file_stop_blockindex, pack) ) return 0;
+	if ( stream->file_start_blockindex == 0 ) blockindex = genblockindex_near(ffs, stream->dir_blockindex);
+	else blockindex = genblockindex(ffs);
+	if ( blockindex == 0 ) return 0;
+	memset(block, 0, BLOCKSIZE);
+	memcpy(block + BLOCK_HEAD, pack + stream->file_offset + 2, B2toU16(pack + stream->file_offset));
+	if ( ! writeblock(ffs, blockindex, block) ) return 0;
+	if ( ! map_set(ffs, stream, (stream->size - 1) / BLOCK_DATASIZE, blockindex) ) return 0;
+	if ( ! pack_free(ffs, stream->file_stop_blockindex, stream->file_offset) ) return 0;
+	stream->file_stop_blockindex = 0;
+	stream->file_offset = 0;
+	
+	return map_sync(ffs, stream);
+}
+
+// =======================================
+// 压缩文件
+// =======================================
+static unsigned int lz_hash(const unsigned char *p)
+{
+	unsigned int v;
+	memcpy(&v, p, 4);
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+// 写入LZ4的扩展长度
+static int lz_putlen(unsigned char *dst, int op, int len)
+{
+	while ( len >= 255 ) {
+		dst[op++] = 255;
+		len -= 255;
+	}
+	dst[op++] = (unsigned char)len;
+	return op;
+}
+// 写入一个序列: token 扩展的literal长度 literal [offset(2) 扩展的match长度]，match_len为0时是最后的literal
+static int lz_putseq(unsigned char *dst, int op, const unsigned char *lit, int lit_len, int offset, int match_len)
+{
+	int ml = match_len > 0 ? match_len - 4 : 0;
+	dst[op++] = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+	if ( lit_len >= 15 ) op = lz_putlen(dst, op, lit_len - 15);
+	memcpy(dst + op, lit, lit_len);
+	op += lit_len;
+	if ( match_len == 0 ) return op;
+	dst[op++] = (unsigned char)(offset & 0xFF);
+	dst[op++] = (unsigned char)(offset >> 8);
+	if ( ml >= 15 ) op = lz_putlen(dst, op, ml - 15);
+	return op;
+}
+// LZ4 block格式压缩，n不超过65535
+// return: 压缩后的长度，0-放不进cap
+static int lz_compress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	unsigned short table[1 << LZ_HASHBITS];
+	int ip = 0, anchor = 0, op = 0, ref, len, lit;
+	unsigned int h;
+	
+	if ( cap <= 0 ) return 0;
+	memset(table, 0, sizeof(table));
+	// 最后一个match至少在尾部12 byte之前开始，最后5 byte总是literal
+	while ( ip < n - 12 ) {
+		h = lz_hash(src + ip);
+		ref = table[h];
+		table[h] = (unsigned short)ip;
+		if ( ref >= ip || memcmp(src + ref, src + ip, 4) != 0 ) {
+			ip += 1 + ((ip - anchor) >> 6); // 长时间没有match时加快跳过
+			continue;
+		}
+		len = 4;
+		while ( ip + len < n - 5 && src[ref + len] == src[ip + len] ) len++;
+		lit = ip - anchor;
+		if ( op + 1 + lit / 255 + 1 + lit + 2 + (len - 4) / 255 + 1 > cap ) return 0;
+		op = lz_putseq(dst, op, src + anchor, lit, ip - ref, len);
+		ip += len;
+		anchor = ip;
+	}
+	lit = n - anchor;
+	if ( op + 1 + lit / 255 + 1 + lit > cap ) return 0;
+	return lz_putseq(dst, op, src + anchor, lit, 0, 0);
+}
+// LZ4 block格式解压
+// return: 解压后的长度，-1-数据错误
+static int lz_decompress(const unsigned char *src, int n, unsigned char *dst, int cap)
+{
+	int ip = 0, op = 0, lit, len, ref, token;
+	
+	while ( ip < n ) {
+		token = src[ip++];
+		lit = token >> 4;
+		if ( lit == 15 ) {
+			do {
+				if ( ip >= n ) return -1;
+				lit += src[ip];
+			} while ( src[ip++] == 255 );
+		}
+		if ( lit > n - ip || lit > cap - op ) return -1;
+		memcpy(dst + op, src + ip, lit);
+		ip += lit;
+		op += lit;
+		if ( ip == n ) break; // 最后的literal
+		
+		if ( ip + 2 > n ) return -1;
+		ref = op - (src[ip] | (src[ip+1] << 8));
+		ip += 2;
+		if ( ref < 0 || ref == op ) return -1;
+		len = (token & 15) + 4;
+		if ( (token & 15) == 15 ) {
+			do {
+				if ( ip >= n ) return -1;
+				len += src[ip];
+			} while ( src[ip++] == 255 );
+		}
+		if ( len > cap - op ) return -1;
+		if ( op - ref >= len ) {
+			memcpy(dst + op, dst + ref, len);
+			op += len;
+		} else { // 重叠的match逐个复制
+			while ( len-- > 0 ) dst[op++] = dst[ref++];
+		}
+	}
+	
+	return op;
+}
+
+// 第extent个extent的长度
+static unsigned int cmp_extlen(FFS_FILE *stream, unsigned long long extent)
+{
+	unsigned long long base = extent * CMP_EXTSIZE;
+	
+	if ( base >= stream->size ) return 0;
+	if ( stream->size - base < CMP_EXTSIZE ) return (unsigned int)(stream->size - base);
+	return CMP_EXTSIZE;
+}
+
+// 读取并解压第extent个extent到cmp_data，尾部之后为0
+static unsigned char cmp_load(FileFS *ffs, FFS_FILE *stream, unsigned long long extent)
+{
+	unsigned char block[BLOCKSIZE], data[CMP_EXTSIZE];
+	unsigned int blockindex[CMP_EXTBLOCKS];
+	unsigned int len, need, m = 0, clen, i, n;
+	
+	if ( stream->cmp_data == NULL ) {
+		stream->cmp_data = (unsigned char*)malloc(CMP_EXTSIZE);
+		if ( stream->cmp_data == NULL ) return 0;
+		stream->cmp_valid = 0;
+	}
+	if ( stream->cmp_valid && stream->cmp_extent == extent ) return 1;
+	stream->cmp_valid = 0;
+	memset(stream->cmp_data, 0, CMP_EXTSIZE);
+	
+	len = cmp_extlen(stream, extent);
+	for (i=0; i<CMP_EXTBLOCKS; i++) {
+		if ( ! map_get(ffs, stream, extent * CMP_EXTBLOCKS + i, &blockindex[i]) ) return 0;
+		if ( blockindex[i] == 0 ) break;
+		m++;
+	}
+	need = (len + BLOCK_DATASIZE - 1) / BLOCK_DATASIZE;
+	
+	if ( m >= need ) { // 未压缩，m为0时是空洞
+		for (i=0; i<need; i++) {
+			if ( ! readblock(ffs, blockindex[i], block) ) return 0;
+			n = len - i * BLOCK_DATASIZE;
+			if ( n > BLOCK_DATASIZE ) n = BLOCK_DATASIZE;
+			memcpy(stream->cmp_data + i * BLOCK_DATASIZE, block + BLOCK_HEAD, n);
+		}
+	} else if ( m > 0 ) {
+		for (i=0; i<m; i++) {
+			if ( ! readblock(ffs, blockindex[i], block) ) return 0;
+			memcpy(data + i * BLOCK_DATASIZE, block + BLOCK_HEAD, BLOCK_DATASIZE);
+		}
+		clen = B2toU16(data);
+		if ( clen + 2 > m * BLOCK_DATASIZE ) return 0;
+		if ( lz_decompress(data + 2, (int)clen, stream->cmp_data, (int)len) != (int)len ) return 0;
+	}
+	
+	stream->cmp_extent = extent;
+	stream->cmp_valid = 1;
+	return 1;
+}
+
+// 压缩cmp_data并写入，只能节省block时才压缩，多余的block释放，在事务中调用
+static unsigned char cmp_store(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE], out[CMP_EXTSIZE];
+	const unsigned char *src = stream->cmp_data;
+	unsigned long long fileblock;
+	unsigned int len, need, count, srclen, blockindex, i, n;
+	int clen;
+	
+	len = cmp_extlen(stream, stream->cmp_extent);
+	need = (len + BLOCK_DATASIZE - 1) / BLOCK_DATASIZE;
+	srclen = len;
+	for (i=0; i<len && src[i]==0; i++) ;
+	if ( i == len ) { // 全部为0，成为空洞
+		count = 0;
+	} else {
+		count = need;
+		clen = lz_compress(src, (int)len, out + 2, (int)((need - 1) * BLOCK_DATASIZE) - 2);
+		if ( clen > 0 ) {
+			U16toB2((unsigned short)clen, out);
+			src = out;
+			srclen = (unsigned int)clen + 2;
+			count = (srclen + BLOCK_DATASIZE - 1) / BLOCK_DATASIZE;
+		}
+	}
+	
+	// 至少1层索引，root不能是数据块；全部是空洞时也需要root保存文件长度
+	if ( stream->file_start_blockindex == 0 ) {
+		blockindex = genblockindex_near(ffs, stream->dir_blockindex);
+		if ( blockindex == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		if ( ! writeblock(ffs, blockindex, block) ) return 0;
+		stream->file_start_blockindex = blockindex;
+		stream->map_depth = 1;
+		stream->leaf_blockindex = 0;
+	}
+	
+	for (i=0; i<CMP_EXTBLOCKS; i++) {
+		fileblock = stream->cmp_extent * CMP_EXTBLOCKS + i;
+		if ( i >= count ) { // 多余的block
+			if ( ! map_get(ffs, stream, fileblock, &blockindex) ) return 0;
+			if ( blockindex == 0 ) continue;
+			if ( ! map_set(ffs, stream, fileblock, 0) ) return 0;
+			if ( ! map_free(ffs, blockindex, 0) ) return 0;
+			continue;
+		}
+		
+		memset(block, 0, BLOCKSIZE);
+		n = srclen - i * BLOCK_DATASIZE;
+		if ( n > BLOCK_DATASIZE ) n = BLOCK_DATASIZE;
+		memcpy(block + BLOCK_HEAD, src + i * BLOCK_DATASIZE, n);
+		if ( ! map_getw(ffs, stream, fileblock, &blockindex) ) return 0;
+		if ( blockindex == 0 ) {
+			blockindex = genblockindex(ffs);
+			if ( blockindex == 0 ) return 0;
+			if ( ! writeblock(ffs, blockindex, block) ) return 0;
+			if ( ! map_set(ffs, stream, fileblock, blockindex) ) return 0;
+		} else {
+			if ( ! writeblock(ffs, blockindex, block) ) return 0;
+		}
+	}
+	
+	return 1;
+}
+
+// =======================================
+// inline文件的slot数量
+static int inline_slots(unsigned int size)
+{
+	if ( size <= INLINE_HEADSIZE ) return 1;
+	return 1 + (size - INLINE_HEADSIZE + INLINE_CONTSIZE - 1) / INLINE_CONTSIZE;
+}
+
+// 目录项占用的slot数量，item为第一个slot
+static int item_slots(unsigned char *item)
+{
+	if ( (item[0] & ITEM_SLOT) == 0 && (item[0] & ITEM_INLINE) ) return inline_slots(B2toU16(item+1+BLOCK_NAME_MAXSIZE));
+	return 1;
+}
+
+/*
+在目录尾部增加n个连续的slot，*blockindex和*item_offset返回第一个slot所在的block和尾部，在事务中调用
+最后一个block放不下时，尾部填入ITEM_FILLER，在新的延伸块中写入
+*/
+static unsigned char dir_addslots(FileFS *ffs, unsigned int head_blockindex, unsigned char *slots, int n, 
+	unsigned int *blockindex, unsigned short *item_offset)
+{
+	unsigned char head[BLOCKSIZE], block[BLOCKSIZE];
+	unsigned char *last;
+	unsigned int stop_blockindex, new_blockindex;
+	unsigned short offset;
+	
+	if ( ! readblock(ffs, head_blockindex, head) ) return 0;
+	stop_blockindex = B4toU32(head+BLOCK_STOP_BLOCKINDEX);
+	offset = B2toU16(head+BLOCK_OFFSET);
+	
+	last = head;
+	if ( stop_blockindex != head_blockindex ) {
+		if ( ! readblock(ffs, stop_blockindex, block) ) return 0;
+		last = block;
+	}
+	
+	if ( offset + 25*n <= BLOCKSIZE ) {
+		memcpy(last+offset, slots, 25*n);
+		if ( last != head ) {
+			if ( ! writeblock(ffs, stop_blockindex, last) ) return 0;
+		}
+		*blockindex = stop_blockindex;
+		*item_offset = offset + 25;
+		U16toB2(offset + 25*n, head+BLOCK_OFFSET);
+		if ( ! writeblock(ffs, head_blockindex, head) ) return 0;
+		return dirindex_insert(ffs, head_blockindex, slots+1, *blockindex, *item_offset);
+	}
+	
+	new_blockindex = genblockindex_near(ffs, head_blockindex);
+	if ( new_blockindex == 0 ) return 0;
+	for (; offset<BLOCKSIZE; offset+=25) {
+		memset(last+offset, 0, 25);
+		last[offset] = ITEM_FILLER;
+	}
+	U32toB4(new_blockindex, last+4);
+	if ( last != head ) {
+		if ( ! writeblock(ffs, stop_blockindex, last) ) return 0;
+	}
+	
+	memset(block, 0, BLOCKSIZE);
+	U32toB4(stop_blockindex, block+8); // prev
+	memcpy(block+BLOCK_HEAD, slots, 25*n);
+	if ( ! writeblock(ffs, new_blockindex, block) ) return 0;
+	
+	*blockindex = new_blockindex;
+	*item_offset = BLOCK_HEAD + 25;
+	U32toB4(new_blockindex, head+BLOCK_STOP_BLOCKINDEX);
+	U16toB2(BLOCK_HEAD + 25*n, head+BLOCK_OFFSET);
+	if ( ! writeblock(ffs, head_blockindex, head) ) return 0;
+	return dirindex_insert(ffs, head_blockindex, slots+1, *blockindex, *item_offset);
+}
+
+// 目录项(blockindex, 尾部item_offset)是否是打开的文件，FFS_FILE中保存了目录项的位置，因此不能移动
+static unsigned char item_isopen(FileFS *ffs, unsigned int blockindex, unsigned short item_offset)
+{
+	FFS_FILE *ff;
+	
+	for (ff=ffs->open_head; ff!=NULL; ff=ff->open_next) {
+		if ( ff->dir_blockindex == blockindex && ff->dir_offset == item_offset ) return 1;
+	}
+	return 0;
+}
+
+/*
+删除目录中从(blockindex, item_start)开始的n个slot，在事务中调用
+用目录最后的项目填补，最后的项目比空出的位置大或者是打开的文件时，空出的位置改为ITEM_FILLER
+目录尾部的ITEM_FILLER和清空的延伸块都会释放
+*/
+static unsigned char dir_delslots(FileFS *ffs, unsigned int head_blockindex, unsigned int blockindex, unsigned short item_start, int n)
+{
+	unsigned char head[BLOCKSIZE], block_last[BLOCKSIZE], block[BLOCKSIZE];
+	unsigned char *last, *item;
+	unsigned int stop_blockindex, prev_blockindex, root;
+	unsigned short offset, last_start;
+	int i, m;
+	
+	if ( ! readblock(ffs, head_blockindex, head) ) return 0;
+	stop_blockindex = B4toU32(head+BLOCK_STOP_BLOCKINDEX);
+	offset = B2toU16(head+BLOCK_OFFSET);
+	root = B4toU32(head+8);
+	
+	last = head;
+	if ( stop_blockindex != head_blockindex ) {
+		if ( ! readblock(ffs, stop_blockindex, block_last) ) return 0;
+		last = block_last;
+	}
+	
+	if ( root > 0 ) { // 删除的是整个目录项时，从索引中删除
+		if ( blockindex == head_blockindex ) item = head;
+		else if ( blockindex == stop_blockindex ) item = last;
+		else {
+			if ( ! readblock(ffs, blockindex, block) ) return 0;
+			item = block;
+		}
+		if ( (item[item_start] & ITEM_SLOT) == 0 && item[item_start+1] != 0 ) {
+			if ( ! dirindex_update(ffs, root, item+item_start+1, blockindex, item_start, 0, 0) ) return 0;
+		}
+	}
+	
+	while ( n > 0 ) {
+		if ( blockindex == stop_blockindex && item_start + 25*n == offset ) { // 位于目录尾部
+			offset = item_start;
+			n = 0;
+		} else {
+			// 最后一个项目
+			last_start = offset - 25;
+			while ( last[last_start] == ITEM_CONT ) last_start -= 25;
+			m = (offset - last_start) / 25;
+			
+			if ( blockindex == head_blockindex ) item = head;
+			else if ( blockindex == stop_blockindex ) item = last;
+			else {
+				if ( ! readblock(ffs, blockindex, block) ) return 0;
+				item = block;
+			}
+			
+			if ( m > n || item_isopen(ffs, stop_blockindex, last_start + 25) ) {
+				for (i=0; i<n; i++) {
+					memset(item+item_start+25*i, 0, 25);
+					item[item_start+25*i] = ITEM_FILLER;
+				}
+				n = 0;
+			} else {
+				memcpy(item+item_start, last+last_start, 25*m);
+				if ( root > 0 && (item[item_start] & ITEM_SLOT) == 0 && item[item_start+1] != 0 ) {
+					if ( ! dirindex_update(ffs, root, item+item_start+1, stop_blockindex, last_start, blockindex, item_start) ) return 0;
+				}
+				offset = last_start;
+				item_start += 25*m;
+				n -= m;
+			}
+			if ( item == block ) {
+				if ( ! writeblock(ffs, blockindex, block) ) return 0;
+			}
+		}
+		
+		// 释放尾部的ITEM_FILLER和清空的延伸块
+		while (1) {
+			if ( stop_blockindex != head_blockindex && offset <= BLOCK_HEAD ) {
+				prev_blockindex = B4toU32(last+8);
+				if ( ! removeblock(ffs, stop_blockindex) ) return 0;
+				stop_blockindex = prev_blockindex;
+				if ( stop_blockindex == head_blockindex ) {
+					last = head;
+				} else {
+					if ( ! readblock(ffs, stop_blockindex, block_last) ) return 0;
+					last = block_last;
+				}
+				memset(last+4, 0, 4); // next
+				offset = BLOCKSIZE;
+				continue;
+			}
+			if ( last[offset-25] == ITEM_FILLER ) {
+				offset -= 25;
+				continue;
+			}
+			break;
+		}
+	}
+	
+	if ( last != head ) {
+		if ( ! writeblock(ffs, stop_blockindex, last) ) return 0;
+	}
+	U32toB4(stop_blockindex, head+BLOCK_STOP_BLOCKINDEX);
+	U16toB2(offset, head+BLOCK_OFFSET);
+	return writeblock(ffs, head_blockindex, head);
+}
+
+// =======================================
+// 目录项名称的hash(FNV-1a)，name为目录项中的名称或不超过BLOCK_NAME_MAXSIZE的字符串
+static unsigned int dirindex_hash(const unsigned char *name)
+{
+	unsigned int h = 2166136261U;
+	int i;
+	for (i=0; i<BLOCK_NAME_MAXSIZE && name[i] != 0; i++) {
+		h ^= name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+找到hash所在的桶，root为索引root的内容
+*ptr_blockindex和*ptr_pos返回保存桶的blockindex的block(root或二级块)和序号，*bucket返回桶的第一个block
+二级块不存在时*ptr_blockindex为0，*ptr_pos为二级块在root中的序号
+*/
+static unsigned char dirindex_bucket(FileFS *ffs, unsigned int root, unsigned char *root_block, unsigned int hash, 
+	unsigned int *ptr_blockindex, unsigned int *ptr_pos, unsigned int *bucket)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int nb = B4toU32(root_block+4);
+	unsigned int b, level1;
+	
+	*bucket = 0;
+	if ( nb == 0 ) return 0;
+	b = hash % nb;
+	if ( nb <= MAP_ITEM_MAXCOUNT ) {
+		*ptr_blockindex = root;
+		*ptr_pos = b;
+		*bucket = B4toU32(root_block + BLOCK_HEAD + b*4);
+		return 1;
+	}
+	
+	level1 = B4toU32(root_block + BLOCK_HEAD + (b / MAP_ITEM_MAXCOUNT)*4);
+	if ( level1 == 0 ) {
+		*ptr_blockindex = 0;
+		*ptr_pos = b / MAP_ITEM_MAXCOUNT;
+		return 1;
+	}
+	if ( ! readblock(ffs, level1, block) ) return 0;
+	*ptr_blockindex = level1;
+	*ptr_pos = b % MAP_ITEM_MAXCOUNT;
+	*bucket = B4toU32(block + BLOCK_HEAD + (b % MAP_ITEM_MAXCOUNT)*4);
+	return 1;
+}
+
+// 释放桶的全部block
+static unsigned char dirindex_freechain(FileFS *ffs, unsigned int blockindex)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int next;
+	
+	while ( blockindex > 0 ) {
+		if ( ! readblock(ffs, blockindex, block) ) return 0;
+		next = B4toU32(block+4);
+		if ( ! removeblock(ffs, blockindex) ) return 0;
+		blockindex = next;
+	}
+	return 1;
+}
+
+// 释放root之下的全部桶和二级块，root本身保留
+static unsigned char dirindex_clear(FileFS *ffs, unsigned char *root_block)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int nb = B4toU32(root_block+4);
+	unsigned int index;
+	int i, j;
+	
+	for (i=0; i<MAP_ITEM_MAXCOUNT; i++) {
+		index = B4toU32(root_block + BLOCK_HEAD + i*4);
+		if ( index == 0 ) continue;
+		if ( nb <= MAP_ITEM_MAXCOUNT ) {
+			if ( ! dirindex_freechain(ffs, index) ) return 0;
+			continue;
+		}
+		if ( ! readblock(ffs, index, block) ) return 0;
+		for (j=0; j<MAP_ITEM_MAXCOUNT; j++) {
+			if ( ! dirindex_freechain(ffs, B4toU32(block + BLOCK_HEAD + j*4)) ) return 0;
+		}
+		if ( ! removeblock(ffs, index) ) return 0;
+	}
+	return 1;
+}
+
+static int dirindex_cmp(const void *a, const void *b)
+{
+	const DirIndexItem *x = (const DirIndexItem*)a, *y = (const DirIndexItem*)b;
+	if ( x->bucket != y->bucket ) return x->bucket < y->bucket ? -1 : 1;
+	return 0;
+}
+
+/*
+扫描整个目录，重新建立root之下的索引，桶的数量按目录项数量决定，在事务中调用
+记录按桶排序后依次写入，每个桶和二级块只写入一次
+*/
+static unsigned char dirindex_fill(FileFS *ffs, unsigned int head_blockindex, unsigned int root)
+{
+	unsigned char root_block[BLOCKSIZE], block[BLOCKSIZE], level1_block[BLOCKSIZE];
+	DirIndexItem *items = NULL, *p;
+	unsigned int count = 0, size = 0, nb, i, j, n;
+	unsigned int index, stop_blockindex, bucket, level1 = 0, level1_pos = 0;
+	unsigned short offset, k, end;
+	unsigned char ok = 1;
+	
+	if ( ! readblock(ffs, root, root_block) ) return 0;
+	if ( ! dirindex_clear(ffs, root_block) ) return 0;
+	
+	// 收集全部目录项
+	if ( ! readblock(ffs, head_blockindex, block) ) return 0;
+	stop_blockindex = B4toU32(block+BLOCK_STOP_BLOCKINDEX);
+	offset = B2toU16(block+BLOCK_OFFSET);
+	index = head_blockindex;
+	k = BLOCK_HEAD + 50; // 跳过.和..
+	while ( ok ) {
+		end = index == stop_blockindex ? offset : BLOCKSIZE;
+		for (; k+25<=end; k+=25) {
+			if ( block[k] & ITEM_SLOT ) continue;
+			if ( block[k+1] == 0 ) continue;
+			if ( count == size ) {
+				size = size ? size * 2 : 256;
+				p = (DirIndexItem*)realloc(items, size * sizeof(DirIndexItem));
+				if ( p == NULL ) {
+					ok = 0;
+					break;
+				}
+				items = p;
+			}
+			items[count].hash = dirindex_hash(block+k+1);
+			items[count].blockindex = index;
+			items[count].item_start = k;
+			count++;
+		}
+		if ( index == stop_blockindex ) break;
+		index = B4toU32(block+4);
+		if ( index == 0 || ! readblock(ffs, index, block) ) ok = 0;
+		k = BLOCK_HEAD;
+	}
+	if ( ! ok ) {
+		free(items);
+		return 0;
+	}
+	
+	nb = count / (DIRINDEX_LOAD / 2) + 1;
+	if ( nb > DIRINDEX_MAXBUCKETS ) nb = DIRINDEX_MAXBUCKETS;
+	for (i=0; i<count; i++) items[i].bucket = items[i].hash % nb;
+	qsort(items, count, sizeof(DirIndexItem), dirindex_cmp);
+	
+	memset(root_block+4, 0, BLOCKSIZE-4);
+	U32toB4(nb, root_block+4);
+	U32toB4(count, root_block+8);
+	
+	// 每个桶从后向前写入，前面的block的next指向后面的block
+	for (i=0; ok && i<count; i=j) {
+		bucket = items[i].bucket;
+		for (j=i; j<count && items[j].bucket == bucket; j++) ;
+		
+		index = 0;
+		while ( j > i && ok ) {
+			n = (j - i) % DIRINDEX_ITEMS;
+			if ( n == 0 ) n = DIRINDEX_ITEMS;
+			// 从桶的最后一个block开始写入，只有它可能不满
+			memset(block, 0, BLOCKSIZE);
+			U32toB4(index, block+4);
+			U32toB4(n, block+8);
+			for (k=0; k<n; k++) {
+				p = &items[j - n + k];
+				U32toB4(p->hash, block + BLOCK_HEAD + k*10);
+				U32toB4(p->blockindex, block + BLOCK_HEAD + k*10 + 4);
+				U16toB2(p->item_start, block + BLOCK_HEAD + k*10 + 8);
+			}
+			index = genblockindex_near(ffs, root);
+			if ( index == 0 || ! writeblock(ffs, index, block) ) ok = 0;
+			j -= n;
+		}
+		for (j=i; j<count && items[j].bucket == bucket; j++) ;
+		if ( ! ok ) break;
+		
+		if ( nb <= MAP_ITEM_MAXCOUNT ) {
+			U32toB4(index, root_block + BLOCK_HEAD + bucket*4);
+			continue;
+		}
+		// 二级块，桶是按顺序的，同一个二级块的桶是连续的
+		if ( level1 != 0 && level1_pos != bucket / MAP_ITEM_MAXCOUNT ) {
+			if ( ! writeblock(ffs, level1, level1_block) ) ok = 0;
+			level1 = 0;
+		}
+		if ( level1 == 0 && ok ) {
+			level1 = genblockindex_near(ffs, root);
+			if ( level1 == 0 ) ok = 0;
+			level1_pos = bucket / MAP_ITEM_MAXCOUNT;
+			memset(level1_block, 0, BLOCKSIZE);
+			U32toB4(level1, root_block + BLOCK_HEAD + level1_pos*4);
+		}
+		U32toB4(index, level1_block + BLOCK_HEAD + (bucket % MAP_ITEM_MAXCOUNT)*4);
+	}
+	if ( ok && level1 != 0 ) {
+		if ( ! writeblock(ffs, level1, level1_block) ) ok = 0;
+	}
+	free(items);
+	if ( ! ok ) return 0;
+	
+	return writeblock(ffs, root, root_block);
+}
+
+// 在索引中加入一条记录，记录过多时增加桶的数量并重建，在事务中调用
+static unsigned char dirindex_add(FileFS *ffs, unsigned int head_blockindex, unsigned int root, const unsigned char *name, 
+	unsigned int blockindex, unsigned short item_start)
+{
+	unsigned char root_block[BLOCKSIZE], ptr_block[BLOCKSIZE], block[BLOCKSIZE];
+	unsigned char *ptr;
+	unsigned int hash = dirindex_hash(name);
+	unsigned int ptr_blockindex, ptr_pos, bucket, index, n, nb, count;
+	
+	if ( ! readblock(ffs, root, root_block) ) return 0;
+	if ( ! dirindex_bucket(ffs, root, root_block, hash, &ptr_blockindex, &ptr_pos, &bucket) ) return 0;
+	
+	// 桶中有空位的block
+	for (index=bucket; index>0; index=B4toU32(block+4)) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		n = B4toU32(block+8);
+		if ( n < DIRINDEX_ITEMS ) break;
+	}
+	
+	if ( index == 0 ) { // 在桶的前面增加一个block
+		index = genblockindex_near(ffs, root);
+		if ( index == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		U32toB4(bucket, block+4);
+		n = 0;
+		
+		if ( ptr_blockindex == root ) {
+			ptr = root_block;
+		} else {
+			if ( ptr_blockindex == 0 ) { // 新的二级块
+				ptr_blockindex = genblockindex_near(ffs, root);
+				if ( ptr_blockindex == 0 ) return 0;
+				U32toB4(ptr_blockindex, root_block + BLOCK_HEAD + ptr_pos*4);
+				memset(ptr_block, 0, BLOCKSIZE);
+				ptr_pos = (hash % B4toU32(root_block+4)) % MAP_ITEM_MAXCOUNT;
+			} else {
+				if ( ! readblock(ffs, ptr_blockindex, ptr_block) ) return 0;
+			}
+			ptr = ptr_block;
+		}
+		U32toB4(index, ptr + BLOCK_HEAD + ptr_pos*4);
+		if ( ptr == ptr_block ) {
+			if ( ! writeblock(ffs, ptr_blockindex, ptr_block) ) return 0;
+		}
+	}
+	
+	U32toB4(hash, block + BLOCK_HEAD + n*10);
+	U32toB4(blockindex, block + BLOCK_HEAD + n*10 + 4);
+	U16toB2(item_start, block + BLOCK_HEAD + n*10 + 8);
+	U32toB4(n + 1, block+8);
+	if ( ! writeblock(ffs, index, block) ) return 0;
+	
+	nb = B4toU32(root_block+4);
+	count = B4toU32(root_block+8) + 1;
+	U32toB4(count, root_block+8);
+	if ( ! writeblock(ffs, root, root_block) ) return 0;
+	
+	if ( count / nb > DIRINDEX_LOAD && nb < DIRINDEX_MAXBUCKETS ) return dirindex_fill(ffs, head_blockindex, root);
+	return 1;
+}
+
+/*
+目录项从(blockindex, item_start)移动到(new_blockindex, new_item_start)时更新索引中的记录，new_blockindex为0时删除记录
+name为目录项的名称，root为0时什么都不做，在事务中调用
+*/
+static unsigned char dirindex_update(FileFS *ffs, unsigned int root, const unsigned char *name, 
+	unsigned int blockindex, unsigned short item_start, unsigned int new_blockindex, unsigned short new_item_start)
+{
+	unsigned char root_block[BLOCKSIZE], block[BLOCKSIZE], prev_block[BLOCKSIZE];
+	unsigned int hash = dirindex_hash(name);
+	unsigned int ptr_blockindex, ptr_pos, bucket, index, prev = 0, next, n, i;
+	unsigned char *r;
+	
+	if ( root == 0 ) return 1;
+	if ( ! readblock(ffs, root, root_block) ) return 0;
+	if ( ! dirindex_bucket(ffs, root, root_block, hash, &ptr_blockindex, &ptr_pos, &bucket) ) return 0;
+	
+	for (index=bucket; index>0; prev=index, index=next) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		next = B4toU32(block+4);
+		n = B4toU32(block+8);
+		for (i=0; i<n; i++) {
+			r = block + BLOCK_HEAD + i*10;
+			if ( B4toU32(r) == hash && B4toU32(r+4) == blockindex && B2toU16(r+8) == item_start ) break;
+		}
+		if ( i == n ) continue;
+		
+		if ( new_blockindex > 0 ) {
+			U32toB4(new_blockindex, r+4);
+			U16toB2(new_item_start, r+8);
+			return writeblock(ffs, index, block);
+		}
+		
+		// 删除: 最后一条记录移动过来，block清空时从桶中去掉
+		n--;
+		memcpy(r, block + BLOCK_HEAD + n*10, 10);
+		memset(block + BLOCK_HEAD + n*10, 0, 10);
+		U32toB4(n, block+8);
+		if ( n > 0 ) {
+			if ( ! writeblock(ffs, index, block) ) return 0;
+		} else {
+			if ( prev > 0 ) {
+				if ( ! readblock(ffs, prev, prev_block) ) return 0;
+				U32toB4(next, prev_block+4);
+				if ( ! writeblock(ffs, prev, prev_block) ) return 0;
+			} else if ( ptr_blockindex == root ) {
+				U32toB4(next, root_block + BLOCK_HEAD + ptr_pos*4);
+			} else {
+				if ( ! readblock(ffs, ptr_blockindex, prev_block) ) return 0;
+				U32toB4(next, prev_block + BLOCK_HEAD + ptr_pos*4);
+				if ( ! writeblock(ffs, ptr_blockindex, prev_block) ) return 0;
+			}
+			if ( ! removeblock(ffs, index) ) return 0;
+		}
+		U32toB4(B4toU32(root_block+8) - 1, root_block+8);
+		return writeblock(ffs, root, root_block);
+	}
+	
+	return 1; // 索引中没有这条记录
+}
+
+// 释放整个索引，在事务中调用
+static unsigned char dirindex_free(FileFS *ffs, unsigned int root)
+{
+	unsigned char root_block[BLOCKSIZE];
+	
+	if ( root == 0 ) return 1;
+	if ( ! readblock(ffs, root, root_block) ) return 0;
+	if ( ! dirindex_clear(ffs, root_block) ) return 0;
+	return removeblock(ffs, root);
+}
+
+/*
+目录中新增了目录项之后调用(目录头块已写入)，item_offset为目录项的尾部，在事务中调用
+有索引时加入索引；没有索引时，新目录项位于新的延伸块且目录已达到DIRINDEX_MINBLOCKS个block，则建立索引
+*/
+static unsigned char dirindex_insert(FileFS *ffs, unsigned int head_blockindex, const unsigned char *name, unsigned int blockindex, unsigned short item_offset)
+{
+	unsigned char head[BLOCKSIZE], block[BLOCKSIZE];
+	unsigned int root, index;
+	int n;
+	
+	if ( ! readblock(ffs, head_blockindex, head) ) return 0;
+	root = B4toU32(head+8);
+	if ( root > 0 ) return dirindex_add(ffs, head_blockindex, root, name, blockindex, item_offset - 25);
+	if ( blockindex == head_blockindex || item_offset != BLOCK_HEAD + 25 ) return 1;
+	
+	index = B4toU32(head+4);
+	for (n=1; index>0 && n<DIRINDEX_MINBLOCKS; n++) {
+		if ( ! readblock(ffs, index, block) ) return 0;
+		index = B4toU32(block+4);
+	}
+	if ( n < DIRINDEX_MINBLOCKS ) return 1;
+	
+	root = genblockindex_near(ffs, head_blockindex);
+	if ( root == 0 ) return 0;
+	memset(block, 0, BLOCKSIZE);
+	if ( ! writeblock(ffs, root, block) ) return 0;
+	U32toB4(root, head+8);
+	if ( ! writeblock(ffs, head_blockindex, head) ) return 0;
+	return dirindex_fill(ffs, head_blockindex, root);
+}
+
+// 目录项名称的比较键: name补0到16 byte，name不超过BLOCK_NAME_MAXSIZE
+static void dir_namekey(const char *name, unsigned char key[16])
+{
+	memset(key, 0, 16);
+	memcpy(key, name, strlen(name));
+}
+
+// 比较k处目录项的名称和状态，SSE2时一次16 byte的比较(之后的2 byte属于start_blockindex，不参与比较)
+static unsigned char dir_match(const unsigned char *block, unsigned short k, const unsigned char *key, 
+	unsigned char mask, unsigned char want)
+{
+#ifdef FFS_SSE2
+	__m128i v = _mm_loadu_si128((const __m128i*)(block+k+1));
+	if ( (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_loadu_si128((const __m128i*)key))) & 0x3FFF) != 0x3FFF ) return 0;
+#else
+	if ( memcmp(block+k+1, key, BLOCK_NAME_MAXSIZE) != 0 ) return 0;
+#endif
+	return (block[k] & mask) == want;
+}
+
+/*
+在目录块block的[k, end)范围内查找名称等于key的目录项，只匹配(state & mask) == want的项目(mask为0时不区分文件和目录)
+目录项中的名称补0存放，直接比较BLOCK_NAME_MAXSIZE byte，不需要复制和strcmp；ITEM_SLOT的名称第1个byte为0，不会匹配
+先比较名称的前4 byte，只有前缀相同的目录项才用dir_match比较整个名称
+AVX2时用gather一次取出8个目录项的前缀，一次比较；SSE2没有gather，4个前缀组装成向量比逐个比较更慢，逐个比较
+return: 目录项的起始位置，0-没有
+*/
+static unsigned short dir_scan(const unsigned char *block, unsigned short k, unsigned short end, const unsigned char *key, 
+	unsigned char mask, unsigned char want)
+{
+	int prefix;
+	
+	memcpy(&prefix, key, 4);
+#ifdef FFS_AVX2
+	int i, m;
+	__m256i idx8 = _mm256_setr_epi32(1, 26, 51, 76, 101, 126, 151, 176), kv8 = _mm256_set1_epi32(prefix);
+	for (; k+25*8<=end; k+=25*8) {
+		m = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_i32gather_epi32((const int*)(block+k), idx8, 1), kv8)));
+		for (i=0; m!=0; i++, m>>=1) {
+			if ( (m & 1) && dir_match(block, (unsigned short)(k+25*i), key, mask, want) ) return (unsigned short)(k+25*i);
+		}
+	}
+#endif
+	for (; k+25<=end; k+=25) {
+		if ( memcmp(block+k+1, &prefix, 4) != 0 ) continue;
+		if ( dir_match(block, k, key, mask, want) ) return k;
+	}
+	return 0;
+}
+
+/*
+在目录中查找名称为name的目录项(文件或目录)，head为目录头块的内容，block可以和head相同
+有散列索引时按hash找到候选的目录项再比较名称，否则顺序搜索目录块
+block返回目录项所在block的内容，*blockindex和*item_offset返回block和目录项的尾部(同FFS_FILE.dir_offset)
+return: 1-找到,0-不存在,-1-err
+*/
+static int dir_find(FileFS *ffs, unsigned int head_blockindex, unsigned char *head, const char *name, 
+	unsigned char *block, unsigned int *blockindex, unsigned short *item_offset)
+{
+	unsigned char root_block[BLOCKSIZE], index_block[BLOCKSIZE], key[16];
+	unsigned int root = B4toU32(head+8);
+	unsigned int hash, ptr_blockindex, ptr_pos, index, stop_blockindex, n, i, cur = 0;
+	unsigned short k, offset, start;
+	unsigned char *r;
+	
+	if ( strlen(name) > BLOCK_NAME_MAXSIZE ) return 0;
+	if ( strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ) {
+		if ( block != head ) memcpy(block, head, BLOCKSIZE);
+		*blockindex = head_blockindex;
+		*item_offset = name[1] == 0 ? BLOCK_HEAD + 25 : BLOCK_HEAD + 50;
+		return 1;
+	}
+	dir_namekey(name, key);
+	
+	if ( root > 0 ) {
+		hash = dirindex_hash((const unsigned char*)name);
+		if ( ! readblock(ffs, root, root_block) ) return -1;
+		if ( ! dirindex_bucket(ffs, root, root_block, hash, &ptr_blockindex, &ptr_pos, &index) ) return -1;
+		for (; index>0; index=B4toU32(index_block+4)) {
+			if ( ! readblock(ffs, index, index_block) ) return -1;
+			n = B4toU32(index_block+8);
+			for (i=0; i<n; i++) {
+				r = index_block + BLOCK_HEAD + i*10;
+				if ( B4toU32(r) != hash ) continue;
+				if ( B4toU32(r+4) != cur ) {
+					cur = B4toU32(r+4);
+					if ( ! readblock(ffs, cur, block) ) return -1;
+				}
+				start = B2toU16(r+8);
+				if ( start < BLOCK_HEAD || start > BLOCKSIZE - 25 ) continue;
+				if ( dir_scan(block, start, start + 25, key, ITEM_SLOT, 0) == 0 ) continue;
+				*blockindex = cur;
+				*item_offset = start + 25;
+				return 1;
+			}
+		}
+		return 0;
+	}
+	
+	stop_blockindex = B4toU32(head+BLOCK_STOP_BLOCKINDEX);
+	offset = B2toU16(head+BLOCK_OFFSET);
+	if ( block != head ) memcpy(block, head, BLOCKSIZE);
+	index = head_blockindex;
+	while (1) {
+		k = dir_scan(block, BLOCK_HEAD, index == stop_blockindex ? offset : BLOCKSIZE, key, 0, 0);
+		if ( k > 0 ) {
+			*blockindex = index;
+			*item_offset = k + 25;
+			return 1;
+		}
+		if ( index == stop_blockindex ) return 0; // 已搜索到最后
+		index = B4toU32(block+4);
+		if ( index == 0 ) return -1; // 到这里说明block有问题
+		if ( ! readblock(ffs, index, block) ) return -1;
+	}
+}
+
+// =======================================
+static DCacheItem *dcache_slot(FileFS *ffs, unsigned int parent, const char *name)
+{
+	unsigned int h = dirindex_hash((const unsigned char*)name) ^ (parent * 2654435761U);
+	return &ffs->dcache[(h ^ (h >> 16)) & (DCACHE_SIZE - 1)];
+}
+
+// 从缓存中删除(parent, name)，目录项创建、删除或改名时调用
+static void dcache_drop(FileFS *ffs, unsigned int parent, const char *name)
+{
+	DCacheItem *c = dcache_slot(ffs, parent, name);
+	if ( c->parent == parent && strcmp(c->name, name) == 0 ) c->parent = 0;
+}
+
+// 删除目录parent中的全部缓存，删除目录时调用(目录的block可能被再次用作新的目录)
+static void dcache_dropdir(FileFS *ffs, unsigned int parent)
+{
+	int i;
+	for (i=0; i<DCACHE_SIZE; i++) {
+		if ( ffs->dcache[i].parent == parent ) ffs->dcache[i].parent = 0;
+	}
+}
+
+static void dcache_clear(FileFS *ffs)
+{
+	memset(ffs->dcache, 0, sizeof(ffs->dcache));
+}
+
+/*
+在目录parent(目录的第一个block)中查找name，先查找目录项缓存，不存在的结果同样缓存
+*child返回目录的第一个block(文件为0)
+return: 0-不存在,1-文件,2-目录,-1-err
+*/
+static int dir_lookup(FileFS *ffs, unsigned int parent, const char *name, unsigned int *child)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int index;
+	unsigned short offset;
+	DCacheItem *c;
+	int r;
+	
+	*child = 0;
+	if ( strlen(name) > BLOCK_NAME_MAXSIZE ) return 0;
+	c = dcache_slot(ffs, parent, name);
+	if ( c->parent == parent && strcmp(c->name, name) == 0 ) {
+		*child = c->child;
+		return c->type;
+	}
+	
+	if ( ! readblock(ffs, parent, block) ) return -1;
+	r = dir_find(ffs, parent, block, name, block, &index, &offset);
+	if ( r < 0 ) return -1;
+	if ( r == 1 ) {
+		if ( block[offset-25] & 0x01 ) r = 1; // file
+		else {
+			r = 2;
+			*child = B4toU32(block+offset-10);
+		}
+	}
+	
+	c->parent = parent;
+	c->child = *child;
+	c->type = (unsigned char)r;
+	strcpy(c->name, name);
+	return r;
+}
+
+// 将inl_data写入目录项，rec为目录项的第一个slot，state和name不变
+static void inline_pack(FFS_FILE *stream, unsigned char *rec)
+{
+	unsigned int size = (unsigned int)stream->size;
+	unsigned int k, n;
+	unsigned char *p;
+	
+	U16toB2((unsigned short)size, rec+1+BLOCK_NAME_MAXSIZE);
+	memset(rec+1+BLOCK_NAME_MAXSIZE+2, 0, INLINE_HEADSIZE);
+	n = size < INLINE_HEADSIZE ? size : INLINE_HEADSIZE;
+	memcpy(rec+1+BLOCK_NAME_MAXSIZE+2, stream->inl_data, n);
+	for (k=n, p=rec+25; k<size; k+=n, p+=25) {
+		memset(p, 0, 25);
+		p[0] = ITEM_CONT;
+		n = size - k < INLINE_CONTSIZE ? size - k : INLINE_CONTSIZE;
+		memcpy(p+2, stream->inl_data+k, n);
+	}
+}
+
+// 从目录块中读取inline文件的内容，dir_block为stream->dir_blockindex的内容
+static void inline_open(FFS_FILE *stream, unsigned char *dir_block)
+{
+	unsigned char *rec = dir_block + stream->dir_offset - 25;
+	unsigned int size, k, n;
+	unsigned char *p;
+	
+	size = B2toU16(rec+1+BLOCK_NAME_MAXSIZE);
+	if ( size > INLINE_MAXSIZE ) size = INLINE_MAXSIZE;
+	
+	stream->inl = 1;
+	stream->map = 0;
+	stream->size = size;
+	memset(stream->inl_data, 0, INLINE_MAXSIZE);
+	n = size < INLINE_HEADSIZE ? size : INLINE_HEADSIZE;
+	memcpy(stream->inl_data, rec+1+BLOCK_NAME_MAXSIZE+2, n);
+	for (k=n, p=rec+25; k<size; k+=n, p+=25) {
+		n = size - k < INLINE_CONTSIZE ? size - k : INLINE_CONTSIZE;
+		memcpy(stream->inl_data+k, p+2, n);
+	}
+}
+
+/*
+将inl_data写入目录项，org_size为目录项中原来的长度，在事务中调用
+需要更多slot时，位于目录尾部就直接延长，否则移动到目录尾部，此时dir_blockindex和dir_offset会改变
+其它打开的文件的目录项不会被移动(见dir_delslots)
+*/
+static unsigned char inline_sync(FileFS *ffs, FFS_FILE *stream, unsigned int org_size)
+{
+	unsigned char block[BLOCKSIZE], head[BLOCKSIZE];
+	unsigned char slots[INLINE_MAXSLOTS*25];
+	unsigned char *h;
+	unsigned int stop_blockindex, org_blockindex;
+	unsigned short offset, item_start, org_offset;
+	int org_n = inline_slots(org_size), n = inline_slots((unsigned int)stream->size);
+	FFS_FILE *ff;
+	
+	if ( ! readblock(ffs, stream->dir_blockindex, block) ) return 0;
+	item_start = stream->dir_offset - 25;
+	
+	if ( n > org_n ) {
+		h = block;
+		if ( stream->dir_head_blockindex != stream->dir_blockindex ) {
+			if ( ! readblock(ffs, stream->dir_head_blockindex, head) ) return 0;
+			h = head;
+		}
+		stop_blockindex = B4toU32(h+BLOCK_STOP_BLOCKINDEX);
+		offset = B2toU16(h+BLOCK_OFFSET);
+		if ( stop_blockindex == stream->dir_blockindex && item_start + 25*org_n == offset 
+			&& item_start + 25*n <= BLOCKSIZE ) {
+			inline_pack(stream, block + item_start);
+			U16toB2(item_start + 25*n, h+BLOCK_OFFSET);
+			if ( h == head ) {
+				if ( ! writeblock(ffs, stream->dir_head_blockindex, head) ) return 0;
+			}
+			return writeblock(ffs, stream->dir_blockindex, block);
+		}
+		
+		memcpy(slots, block + item_start, 25);
+		inline_pack(stream, slots);
+		org_blockindex = stream->dir_blockindex;
+		org_offset = stream->dir_offset;
+		if ( ! dir_delslots(ffs, stream->dir_head_blockindex, stream->dir_blockindex, item_start, org_n) ) return 0;
+		if ( ! dir_addslots(ffs, stream->dir_head_blockindex, slots, n, &stream->dir_blockindex, &stream->dir_offset) ) return 0;
+		// 同一个文件的其它FFS_FILE也指向新的位置
+		for (ff=ffs->open_head; ff!=NULL; ff=ff->open_next) {
+			if ( ff != stream && ff->dir_blockindex == org_blockindex && ff->dir_offset == org_offset ) {
+				ff->dir_blockindex = stream->dir_blockindex;
+				ff->dir_offset = stream->dir_offset;
+			}
+		}
+		return 1;
+	}
+	
+	inline_pack(stream, block + item_start);
+	if ( ! writeblock(ffs, stream->dir_blockindex, block) ) return 0;
+	if ( n < org_n ) {
+		return dir_delslots(ffs, stream->dir_head_blockindex, stream->dir_blockindex, item_start + 25*n, org_n - n);
+	}
+	
+	return 1;
+}
+
+// inline文件转换为块映射文件，内容写入第0个block，在事务中调用
+static unsigned char inline2map(FileFS *ffs, FFS_FILE *stream)
+{
+	unsigned char block[BLOCKSIZE];
+	unsigned int blockindex = 0;
+	int n = inline_slots((unsigned int)stream->size);
+	
+	if ( stream->size > 0 ) {
+		blockindex = genblockindex_near(ffs, stream->dir_blockindex);
+		if ( blockindex == 0 ) return 0;
+		memset(block, 0, BLOCKSIZE);
+		memcpy(block + BLOCK_HEAD, stream->inl_data, (size_t)stream->size);
+		if ( ! writeblock(ffs, blockindex, block) ) return 0;
+	}
+	// 第一个slot保留，位置不变
+	if ( n > 1 ) {
+		if ( ! dir_delslots(ffs, stream->dir_head_blockindex, stream->dir_blockindex, stream->dir_offset, n - 1) ) return 0;
+	}
+	
+	stream->inl = 0;
+	stream->map = 1;
+	stream->map_depth = 0;
+	stream->file_start_blockindex = blockindex;
+	stream->file_stop_blockindex = 0;
+	stream->file_offset = 0;
+	stream->leaf_blockindex = 0;
+	stream->pos_blockindex = 0;
+	stream->pos_offset = 0;
+	
+	return map_sync(ffs, stream);
+}
+
+/*
+截掉fp中超出block[0]中total_blocksize的部分(导入时直接写入但没有commit的block)
+否则之后新增的block会被当作fp中已有的block
+*/
+static void fp_trim(FileFS *ffs)
+{
+	unsigned char block[8];
+	unsigned long long pos;
+	
+	ffs_rewind(ffs->fp);
+	if ( 8 != ffs_fread(block, 1, 8, ffs->fp) ) return;
+	pos = B4toU32(block+4);
+	pos *= BLOCKSIZE;
+	ffs_fsetpos(ffs->fp, pos);
+	if ( 1 == ffs_fread(block, 1, 1, ffs->fp) ) ffs_fsetsize(ffs->fp, pos);
+}
+
 // =======================================
 static void j2ffs(FileFS *ffs)
 {
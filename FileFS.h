@@ -39,6 +39,24 @@ typedef struct FFS_dirent {
 	char d_name[15];
 } FFS_dirent;
 
+// FileFS_readdirplus返回的目录项，位置信息直接从目录块中得到，不需要再打开文件
+typedef struct FFS_direntplus FFS_direntplus;
+typedef struct FFS_direntplus {
+	FFS_dirent dirent;
+	
+	// 目录: 第一个block; 块映射文件: root(只有打包的尾部时为0); block链文件: 第一个和最后一个block
+	// inline文件的内容在目录项中，都为0
+	unsigned int start_blockindex;
+	unsigned int stop_blockindex;
+	// block链文件: 最后一个block的使用位置; 打包的尾部: 片段在stop_blockindex中的位置
+	unsigned short offset;
+	
+	// 文件长度，has_size为0时(目录和block链文件)size无效，需要用FileFS_filesize
+	// has_size为2时(FileFS_readdirplus返回的块映射文件)长度在root中尚未读取，需要时用FileFS_readdirsize读取
+	unsigned char has_size;
+	unsigned long long size;
+} FFS_direntplus;
+
 // =================================
 FileFS *FileFS_create();
 void FileFS_destroy(FileFS *ffs);
@@ -60,9 +78,42 @@ mode:
 都是二进制格式读写
 */
 FFS_FILE *FileFS_fopen(FileFS *ffs, const char *filename, const char *mode);
+// 返回读写的字节数，单次调用可以超过2GB，size*nmemb溢出时返回0
 size_t FileFS_fread(FileFS *ffs, void *ptr, size_t size, size_t nmemb, FFS_FILE *stream);
 size_t FileFS_fwrite(FileFS *ffs, const void *ptr, size_t size, size_t nmemb, FFS_FILE *stream);
-void FileFS_fclose(FileFS *ffs, FFS_FILE *stream);
+// 延迟分配的数据写入失败时返回0，此时stream也已关闭，return: 0-err,1-ok
+unsigned char FileFS_fclose(FileFS *ffs, FFS_FILE *stream);
+// 在offset处读写，不改变文件的当前位置，块映射文件直接定位到offset所在的block
+// return: 读写的字节数
+size_t FileFS_pread(FileFS *ffs, void *ptr, size_t size, size_t nmemb, FFS_FILE *stream, unsigned long long offset);
+size_t FileFS_pwrite(FileFS *ffs, const void *ptr, size_t size, size_t nmemb, FFS_FILE *stream, unsigned long long offset);
+
+// 分散读写(scatter-gather)
+typedef struct FFS_iovec {
+	void *iov_base;
+	size_t iov_len;
+} FFS_iovec;
+// 依次读取到iov中的缓冲区，return: 读取的字节数
+size_t FileFS_readv(FileFS *ffs, FFS_FILE *stream, const FFS_iovec *iov, int iovcnt);
+// 依次写入iov中的缓冲区，只有一个事务和一次commit，失败时全部撤销
+// return: 写入的字节数，失败时为0(已在手动事务中时为失败前写入的字节数)
+size_t FileFS_writev(FileFS *ffs, FFS_FILE *stream, const FFS_iovec *iov, int iovcnt);
+
+// 延迟分配: 写入的数据先保存在内存中，fflush/fclose/commit时才一次分配连续的block
+// 覆盖写入或打洞的数据不会分配block，delay: 0-关闭,1-打开
+// return: 0-err,1-ok
+unsigned char FileFS_setdelay(FileFS *ffs, FFS_FILE *stream, unsigned char delay);
+// 将延迟分配的数据写入
+// return: 0-err,1-ok
+unsigned char FileFS_fflush(FileFS *ffs, FFS_FILE *stream);
+// 尾部打包: 关闭可写的文件时，将最后一个不完整的block(不超过250 byte)和同一目录中其它文件的尾部存放在同一个block中
+// 再次写入时自动恢复，tailpack: 0-关闭(默认),1-打开
+void FileFS_settailpack(FileFS *ffs, unsigned char tailpack);
+// 压缩: 文件内容按extent(8000 byte)以LZ4格式压缩存储，读写和fseek与普通文件相同
+// 只能在空文件上设置(例如"w"打开后)，之后一直保存在文件中，"w"清空文件时取消
+// 压缩文件不使用延迟分配和尾部打包，compress: 0-关闭,1-打开
+// return: 0-err,1-ok
+unsigned char FileFS_setcompress(FileFS *ffs, FFS_FILE *stream, unsigned char compress);
 
 // fpos_t = int64 = long long
 // 文件指针的当前位置
@@ -72,9 +123,24 @@ void FileFS_fclose(FileFS *ffs, FFS_FILE *stream);
 // 文件的开头
 #define FFS_SEEK_SET 0
 // 如果成功，则该函数返回零，否则返回非零值。
+// 可以移动到文件尾部之后，此时写入会在中间留下空洞(不占用block，读取时为0)
+// 块映射文件只需读取索引块即可定位；旧的block链文件只读打开时仍需沿block链移动
 unsigned char FileFS_fseek(FileFS *ffs, FFS_FILE *stream, long long offset, int whence);
 unsigned long long FileFS_ftell(FileFS *ffs, FFS_FILE *stream);
 void FileFS_rewind(FileFS *ffs, FFS_FILE *stream);
+// 文件长度，不需要打开文件后移动到尾部
+// return: 0-err(不存在),1-ok
+unsigned char FileFS_filesize(FileFS *ffs, const char *filename, unsigned long long *size);
+// 将文件内容写入宿主的文件描述符fd(例如open/fileno得到的)，连续的block一次读取，payload直接写入fd
+// return: 0-err,1-ok
+unsigned char FileFS_export_fd(FileFS *ffs, const char *filename, int fd);
+// 从宿主的文件描述符fd读取到文件尾，写入filename(创建或清空)，size_hint为预计的长度(可以为0)
+// 数据直接写入container中新增的block，不经过事务的临时文件和日志，只写入一次；只有元数据在commit时写入日志
+// return: 0-err,1-ok
+unsigned char FileFS_import_fd(FileFS *ffs, const char *filename, int fd, unsigned long long size_hint);
+// 在文件中打洞: 释放[offset, offset+len)范围内的block，读取时为0，文件长度不变
+// return: 0-err,1-ok
+unsigned char FileFS_punch_hole(FileFS *ffs, FFS_FILE *stream, unsigned long long offset, unsigned long long len);
 
 // =================================
 unsigned char FileFS_file_exist(FileFS *ffs, const char *filename);
@@ -85,8 +151,21 @@ int FileFS_remove(FileFS *ffs, const char *filename);
 int FileFS_rename(FileFS *ffs, const char *old_name, const char *new_name);
 // return: 0:ok,1-err,2-from name format err,3-to path format err,4-from name not exist,5-to file exist, 6-from to format not match
 int FileFS_move(FileFS *ffs, const char *from_name, const char *to_path);
+// 块映射文件只共享block(reflink)，不复制内容，之后写入其中一个文件时才复制被修改的block
 // return: 0:ok,1-err,2-from name format err,3-to path format err,4-from name not exist,5-to file exist
 int FileFS_copy(FileFS *ffs, const char *from_filename, const char *to_filename);
+// 块去重的统计
+typedef struct FFS_dedup {
+	unsigned long long files;  // 扫描的文件数量
+	unsigned long long blocks; // 扫描的数据块数量
+	unsigned long long merged; // 合并为共享block的数据块数量
+	unsigned long long freed;  // 释放的block数量
+} FFS_dedup;
+// 块去重: 扫描pathname及其子目录中的全部文件，内容相同的数据块合并为共享的block，之后写入时才复制
+// block链文件会转换为块映射文件。调用时不能有打开的文件，progress中不能修改文件系统
+// 不在手动事务中时，每合并一批block提交一次并调用progress(可以为NULL)，stat可以为NULL
+// return: 0-err,1-ok
+unsigned char FileFS_dedup(FileFS *ffs, const char *pathname, FFS_dedup *stat, void (*progress)(const FFS_dedup *stat, void *arg), void *arg);
 // return: 0-err,1-ok
 unsigned char FileFS_chdir(FileFS *ffs, const char *pathname);
 char *FileFS_getcwd(FileFS *ffs);
@@ -102,13 +181,72 @@ unsigned char FileFS_chwork(FileFS *ffs);
 int FileFS_mkdir(FileFS *ffs, const char *pathname);
 // return: 0-ok,1-gen err,2-sub dir not empty,3-path not existed,4-name>limit(14byte)
 int FileFS_rmdir(FileFS *ffs, const char *pathname);
+// 删除目录及其中的全部文件和子目录，整个目录树在同一个事务中删除，只commit一次
+// 调用时目录树中不能有打开的文件，不能是当前目录或它的上级目录
+// return: 0-ok,1-gen err,3-path not existed,4-name>limit(14byte)
+int FileFS_rmtree(FileFS *ffs, const char *pathname);
 
 // =============================================
 FFS_DIR *FileFS_opendir(FileFS *ffs, const char *path, char **absolute_path);
 FFS_dirent *FileFS_readdir(FileFS *ffs, FFS_DIR *dir);
+// 和FileFS_readdir相同，同时返回位置和长度，只读取目录的block，可以和FileFS_readdir交替调用
+FFS_direntplus *FileFS_readdirplus(FileFS *ffs, FFS_DIR *dir);
+// 读取FileFS_readdirplus最近返回的块映射文件的长度(has_size为2时)，额外读取一次root，之后has_size为1，return: 0-err,1-ok
+unsigned char FileFS_readdirsize(FileFS *ffs, FFS_DIR *dir);
+// 一次读取最多max个目录项到buf，return: 读取的数量，0-end,-1-err
+int FileFS_getdents(FileFS *ffs, FFS_DIR *dir, FFS_dirent *buf, int max);
+// 打开目录时读取全部目录项，之后readdir按名称(strcmp)顺序返回，打开之后的修改不会反映出来
+// start不为NULL时从名称>=start的项目开始，列出前缀相同的项目时start为前缀，遇到不以前缀开头的名称即可停止
+// 目录block中的项目不按名称存放，打开时总是扫描整个目录(O(n))，start只减少保存在内存中的项目
+// 项目组成最小堆，readdir每次取出最小的一个，只读取前k个项目时为O(n + k*log n)
+FFS_DIR *FileFS_opendir_sorted(FileFS *ffs, const char *path, const char *start, char **absolute_path);
 void FileFS_closedir(FileFS *ffs, FFS_DIR *dir);
 
+// 遍历目录树，按blockindex直接进入子目录，不需要重新解析路径
+// flags: FFS_WALK_PRE-进入子目录前回调目录，FFS_WALK_POST-子目录中的项目之后回调目录，FFS_WALK_SIZE-读取块映射文件的长度
+#define FFS_WALK_PRE  1
+#define FFS_WALK_POST 2
+#define FFS_WALK_SIZE 4
+// fn的返回值: 0-继续，FFS_WALK_SKIP-跳过这个目录中的项目(前序回调目录时)，其它-停止遍历
+#define FFS_WALK_SKIP 1
+typedef struct FFS_walkent {
+	FFS_direntplus ent; // 没有FFS_WALK_SIZE时块映射文件的has_size为0
+	unsigned int dir_blockindex; // 项目所在目录的头块，和ent.dirent.d_name组成FFS_fileid
+	const char *path; // 相对于遍历起点的路径，例如"a/b/c"，只在回调中有效
+	int depth; // 起点中的项目为1
+	int post; // 1-后序回调目录
+} FFS_walkent;
+// 不包括起点本身，回调中不能修改文件系统
+// return: 0-ok,-1-err,其它-fn返回的停止值
+int FileFS_walk(FileFS *ffs, const char *path, int (*fn)(const FFS_walkent *ent, void *arg), void *arg, int flags);
+
+// *at: 相对路径从已打开的目录dir开始解析，不经过也不改变当前目录，dir为NULL时从当前目录开始
+// 以'/'或'~'开头的路径和不带at的函数相同，dir在调用期间不能被删除
+FFS_FILE *FileFS_openat(FileFS *ffs, FFS_DIR *dir, const char *filename, const char *mode);
+// return: 同FileFS_mkdir
+int FileFS_mkdirat(FileFS *ffs, FFS_DIR *dir, const char *pathname);
+// flags为FFS_AT_REMOVEDIR时删除空目录，return同FileFS_rmdir；否则删除文件，return同FileFS_remove
+#define FFS_AT_REMOVEDIR 1
+int FileFS_unlinkat(FileFS *ffs, FFS_DIR *dir, const char *name, int flags);
+// return: 同FileFS_rename
+int FileFS_renameat(FileFS *ffs, FFS_DIR *old_dir, const char *old_name, FFS_DIR *new_dir, const char *new_name);
+// 读取name的目录项到st，和FileFS_readdirplus的结果相同，块映射文件总是读取长度
+// return: 0-ok,1-gen err,2-not exist,3-path not existed,4-name>limit(14byte)
+int FileFS_statat(FileFS *ffs, FFS_DIR *dir, const char *name, FFS_direntplus *st);
+
+// 文件/目录的标识: 所在目录的头块和名称，目录的头块在目录存在期间不会改变，可以保存下来以后使用
+// 项目被改名、移动或删除后标识失效；所在目录被删除后它的头块可能被新目录重用，和inode号的重用相同
+typedef struct FFS_fileid {
+	unsigned int dir_blockindex;
+	char name[15];
+} FFS_fileid;
+// 路径的解析同FileFS_statat，return: 0-ok,1-gen err,2-not exist,3-path not existed,4-name>limit(14byte),5-name format err
+int FileFS_fileid(FileFS *ffs, FFS_DIR *dir, const char *name, FFS_fileid *id);
+// 按标识打开文件，不解析路径，只读取所在目录的头块和目录项；"w"/"a"可以在id所在目录中创建文件
+FFS_FILE *FileFS_fopen_id(FileFS *ffs, const FFS_fileid *id, const char *mode);
+
 // =================================
+// 开始手动事务，延迟分配的文件先写入，rollback只撤销事务中的修改
 unsigned char FileFS_begin(FileFS *ffs);
 unsigned char FileFS_commit(FileFS *ffs);
 void FileFS_rollback(FileFS *ffs);
@@ -47,18 +47,20 @@ static void fun_ls(FileFS *ffs, char *path)
 	
 	char *sol_path;
 	FFS_DIR *dirp;
+	FFS_direntplus *plus;
 	struct FFS_dirent *dir;
 
 	int n_dir=0, n_file = 0;
 	
-	if ( NULL == (dirp = FileFS_opendir(ffs, path, &sol_path)) ) {
+	if ( NULL == (dirp = FileFS_opendir_sorted(ffs, path, NULL, &sol_path)) ) {
 		printf("path ERR\n");
 		return;
 	}
 	printf("  [dir]: %s\n", sol_path);
 	while (1) {
-		dir = FileFS_readdir(ffs, dirp);
-		if ( dir == NULL ) break; // 当前目录为空
+		plus = FileFS_readdirplus(ffs, dirp);
+		if ( plus == NULL ) break; // 当前目录为空
+		dir = &plus->dirent;
 		
 		if (strcmp(dir->d_name, ".") == 0) {
 			if ( dir->d_type == FFS_DT_DIR ) {
@@ -79,295 +81,39 @@ static void fun_ls(FileFS *ffs, char *path)
 		}
 		
 		// file, FFS_DT_FILE
-		printf("\t\t%s\n", dir->d_name);
+		if ( plus->has_size == 2 && ! FileFS_readdirsize(ffs, dirp) ) plus->has_size = 0;
+		if ( plus->has_size ) printf("\t%llu\t%s\n", plus->size, dir->d_name);
+		else printf("\t-\t%s\n", dir->d_name);
 		n_file++;
 	}
 	FileFS_closedir(ffs, dirp);
 	printf("  dir:%d, file:%d\n", n_dir, n_file);
 }
 
-static unsigned char ffs_rmdir(FileFS *ffs, char *path)
-{
-	if (path == NULL) return 0;
-	int len = (int)strlen(path);
-	if (len < 1) return 0;
-
-	char *srcpath = NULL, *runpath = NULL;
-	int runlen = 0;
-	FFS_dirent *dir;
-	FFS_DIR *dirp;
-	char *filename = NULL;
-
-	if ( ! FileFS_chdir(ffs, path) ) return 0;
-	
-	char *rootpath;
-	char *s = FileFS_getcwd(ffs);
-	rootpath = (char*)malloc((int)strlen(s) + 1);
-	if ( rootpath == NULL ) return 0;
-	strcpy(rootpath, s);
-	
-	char *abs_path, sub_dir[20];
-	unsigned char path_empty;
-	while (1) {
-		path_empty = 1;
-		
-		dirp = FileFS_opendir(ffs, ".", &abs_path);
-		if (dirp == NULL) return 0;
-		// printf("search path:%s\n", abs_path);
-		while (1) {
-			dir = FileFS_readdir(ffs, dirp);
-			if (dir == NULL) break;
-			
-			if ( strcmp(dir->d_name, ".") == 0 ) continue;
-			if ( strcmp(dir->d_name, "..") == 0 ) continue;
-			
-			if ( path_empty > 0 ) path_empty = 2;
-			if ( dir->d_type == FFS_DT_FILE ) {
-				FileFS_remove(ffs, dir->d_name);
-				// printf("remove %s\n", dir->d_name);
-			} else {
-				// printf("rmdir %s\n", dir->d_name);
-				if ( 0 != FileFS_rmdir(ffs, dir->d_name) ) {
-					if ( path_empty > 0 ) {
-						path_empty = 0;
-						strcpy(sub_dir, dir->d_name);
-					}
-				}
-			}
-		}
-		FileFS_closedir(ffs, dirp);
-
-		if ( path_empty == 0 ) {
-			if ( ! FileFS_chdir(ffs, sub_dir) ) return 0;
-		} else if ( path_empty == 1 ) {
-			s = FileFS_getcwd(ffs);
-			if ( strcmp(s, rootpath) == 0 ) {
-				if ( ! FileFS_chdir(ffs, "..") ) return 0;
-				break;
-			} else {
-				if ( ! FileFS_chdir(ffs, "..") ) return 0;
-			}
-		}
-	}
-	
-	free(rootpath);
-	
-	int r = FileFS_rmdir(ffs, path);
-	if ( 0 == r || 3 == r/*path not exist*/ ) return 1;
-	return 0;
-}
 static void fun_forcerm(FileFS *ffs, char *path)
 {
-	if ( ! ffs_rmdir(ffs, path) ) printf("rmdir err\n");
+	int r = FileFS_rmtree(ffs, path);
+	if ( 0 != r && 3 != r/*path not exist*/ ) printf("rmdir err\n");
 }
 
-typedef struct Tree Tree;
-typedef struct Tree {
-	char name[15];
-	Tree *sub, *parent;
-	Tree *prev, *next;
-} Tree;
-static unsigned char search(FileFS *ffs, char *path, Tree *tree_parent, int *count, Tree **treehead)
+static int tree_show(const FFS_walkent *ent, void *arg)
 {
-	char *sol_path;
-	FFS_DIR *dirp;
-	struct FFS_dirent *dir;
-	Tree *tree, *tree_prev = NULL, *tree1 = NULL;
-	int dircount = 0;
-	
-	// printf("search path:%s\n", FileFS_getcwd(ffs));
-	if ( NULL == (dirp = FileFS_opendir(ffs, path, &sol_path)) ) return 0;
-	while (1) {
-		dir = FileFS_readdir(ffs, dirp);
-		if ( dir == NULL ) break; // 当前目录为空
-		
-		if (strcmp(dir->d_name, ".") == 0) {
-			continue;
-		}
-		if (strcmp(dir->d_name, "..") == 0) {
-			continue;
-		}
-		
-		// dir
-		if ( dir->d_type == FFS_DT_DIR ) {
-			// printf(" |_%s\n", dir->d_name);
-			tree = (Tree*)malloc(sizeof(Tree));
-			if ( tree == NULL ) {
-				printf("malloc err\n");
-				exit(0);
-			}
-			if ( tree1 == NULL ) tree1 = tree;
-			memset(tree, 0, sizeof(Tree));
-			strcpy(tree->name, dir->d_name);
-			tree->parent = tree_parent;
-			tree->prev = tree_prev;
-			if ( tree_prev != NULL ) tree_prev->next = tree;
-			//if ( treehead == NULL ) treehead = tree;
-			tree_prev = tree;
-			dircount++;
-			continue;
-		}
-	}
-	FileFS_closedir(ffs, dirp);
+	int i;
 	
-	*count = dircount;
-	*treehead = tree1;
-	return 1;
+	if ( ent->ent.dirent.d_type != FFS_DT_DIR ) return 0;
+	for (i=1; i<ent->depth; i++) printf("| ");
+	printf("|_%s\n", ent->ent.dirent.d_name);
+	(*(int*)arg)++;
+	return 0;
 }
 static void fun_tree(FileFS *ffs)
 {
-	char *path = FileFS_getcwd(ffs);
-	int len = (int)strlen(path);
-	if ( len < 1 ) return;
-	
-	char *path_root = strdup(path);
-	
-	Tree *treehead = NULL, *tree, *tree_parent;
-	int dircount;
-	Tree *tree_sub;
-
-	tree_parent = NULL;
-	if ( ! search(ffs, path, tree_parent, &dircount, &tree) ) {
-		free(path_root);
-		return;
-	}
-	treehead = tree;
-	unsigned char flag;
-	while (1) {
-		if ( dircount == 0 ) break;
-		FileFS_chdir(ffs, tree->name);
-		tree_parent = tree;
-		if ( ! search(ffs, ".", tree_parent, &dircount, &tree) ) {
-			free(path_root);
-			return;
-		}
-		tree_parent->sub = tree;
-		if ( dircount > 0 ) continue;
-		
-		// dircount == 0;
-		tree = tree_parent;
-		FileFS_chdir(ffs, "..");
-		flag = 0;
-		while (1) {
-			if ( tree->next != NULL ) {
-				tree = tree->next;
-				break;
-			}
-
-			if (tree->parent == NULL) {
-				flag = 1;
-				break;
-			}
-			tree = tree->parent;
-			FileFS_chdir(ffs, "..");
-		}
-		if ( flag == 1 ) break;
-		dircount = 1;
-	}
-	
-	// show tree
-	void *p;
-	char *space;
-	int space_size = 1024, space_used = 0;
-	space = (char*)malloc(space_size);
-	if ( space == NULL ) {
-		free(path_root);
-		return;
-	}
-	memset(space, 0, space_size);
-	tree = treehead;
-	if ( tree == NULL ) {
-		free(space);
-		free(path_root);
-		return;
-	}
-	tree_parent = NULL;
 	int leaf = 0;
-	while (1) {
-		if ( space_used + 16 > space_size ) {
-			p = realloc(space, space_size + 16);
-			if ( p == NULL ) {
-				free(space);
-				free(path_root);
-				return;
-			}
-			space = (char*)p;
-			memset(space + space_size, 0, 16);
-			space_size += 16;
-		}
-		printf("%s|_%s\n", space, tree->name);
-		leaf++;
-		if ( tree->sub != NULL ) {
-			tree = tree->sub;
-			strcat(space, "| ");
-			space_used += 2;
-			continue;
-		}
-		if ( tree->next != NULL ) {
-			tree = tree->next;
-			continue;
-		}
-		flag = 0;
-		while (1) {
-			if ( tree->parent == NULL ) {
-				flag = 1;
-				break;
-			}
-			tree_sub = tree;
-			tree = tree->parent;
-			if ( space[0] != 0 ) {
-				space[space_used-1] = 0;
-				space_used--;
-			}
-			if ( space[0] != 0 ) {
-				space[space_used-1] = 0;
-				space_used--;
-			}
-			if ( tree->next != NULL ) {
-				tree = tree->next;
-				break;
-			}
-		}
-		if ( flag == 1 ) break;
-	}
 	
-	// free tree
-	tree = treehead;
-	if ( tree == NULL ) {
-		free(space);
-		free(path_root);
+	if ( 0 != FileFS_walk(ffs, ".", tree_show, &leaf, FFS_WALK_PRE) ) {
+		printf("tree err\n");
 		return;
 	}
-	tree_parent = NULL;
-	while (1) {
-		if ( tree->sub != NULL ) {
-			tree = tree->sub;
-			continue;
-		}
-		if ( tree->next != NULL ) {
-			tree = tree->next;
-			continue;
-		}
-		flag = 0;
-		while (1) {
-			if ( tree->parent == NULL ) {
-				flag = 1;
-				break;
-			}
-			tree_sub = tree;
-			tree = tree->parent;
-			free(tree_sub);
-			if ( tree->next != NULL ) {
-				tree = tree->next;
-				break;
-			}
-		}
-		if ( flag == 1 ) break;
-	}
-	
-	free(space);
-	free(path_root);
-	
 	printf("leaf:%d\n", leaf);
 }
 
@@ -443,13 +189,11 @@ static void fun_bin(FileFS *ffs, char *filename)
 
 static void fun_filesize(FileFS *ffs, char *filename)
 {
-	FFS_FILE *fp = FileFS_fopen(ffs, filename, "a+");
-	if ( fp == NULL ) {
-		printf("fopen %s err, not exist\n", filename);
+	unsigned long long size;
+	if ( ! FileFS_filesize(ffs, filename, &size) ) {
+		printf("filesize %s err, not exist\n", filename);
 		return;
 	}
-	unsigned long long size = FileFS_ftell(ffs, fp);
-	FileFS_fclose(ffs, fp);
 	
 	printf("file (%s) size:%I64d\n", filename, size);
 }
@@ -480,73 +224,45 @@ static void fun_seek(FileFS *ffs, char *filename)
 static void fun_in_cp(FileFS *ffs, char *from_out, char *to_in)
 {
 	FILE *fp;
-	
-	FileFS_begin(ffs);
+	long size;
 	
 	fp = fopen(from_out, "rb");
 	if ( fp == NULL ) {
 		printf("err: can not read from_out(%s)\n", from_out);
-		FileFS_rollback(ffs);
 		return;
 	}
 	
-	FFS_FILE *ffp;
-	ffp = FileFS_fopen(ffs, to_in, "w");
-	if ( ffp == NULL ) {
-		printf("err: can not create to_in(%s)\n", to_in);
-	}
-	
-	unsigned char buf[1024];
-	int len;
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	if ( size < 0 ) size = 0;
 	
-	while (1) {
-		len = (int)fread(buf, 1, 1024, fp);
-		if ( len != 1024 ) {
-			if ( len > 0 ) {
-				FileFS_fwrite(ffs, buf, 1, len, ffp);
-				break;
-			}
-		}
-		FileFS_fwrite(ffs, buf, 1, len, ffp);
+	if ( ! FileFS_import_fd(ffs, to_in, fileno(fp), (unsigned long long)size) ) {
+		printf("err: import %s to %s\n", from_out, to_in);
 	}
 	
-	FileFS_fclose(ffs, ffp);
 	fclose(fp);
-	
-	FileFS_commit(ffs);
 }
 
 static void fun_out_cp(FileFS *ffs, char *from_in, char *to_out)
 {
-	FFS_FILE *ffp;
-	ffp = FileFS_fopen(ffs, from_in, "r");
-	if ( ffp == NULL ) {
-		printf("err: can not create from_in(%s)\n", from_in);
+	if ( ! FileFS_file_exist(ffs, from_in) ) {
+		printf("err: can not read from_in(%s)\n", from_in);
+		return;
 	}
 	
 	FILE *fp;
 	fp = fopen(to_out, "wb");
 	if ( fp == NULL ) {
-		printf("err: can not read to_out(%s)\n", to_out);
+		printf("err: can not create to_out(%s)\n", to_out);
 		return;
 	}	
 	
-	unsigned char buf[1024];
-	int len;
-	
-	while (1) {
-		len = (int)FileFS_fread(ffs, buf, 1, 1024, ffp);
-		if ( len != 1024 ) {
-			if ( len > 0 ) {
-				fwrite(buf, 1, len, fp);
-				break;
-			}
-		}
-		fwrite(buf, 1, len, fp);
+	if ( ! FileFS_export_fd(ffs, from_in, fileno(fp)) ) {
+		printf("err: export %s to %s\n", from_in, to_out);
 	}
 	
 	fclose(fp);
-	FileFS_fclose(ffs, ffp);
 }
 
 static void fun_cp(FileFS *ffs, char *from, char *to)
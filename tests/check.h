@@ -0,0 +1,88 @@
+// 测试共用: 按(seed, 位置)生成的内容写入文件，再读回比较
+#ifndef _TESTS_CHECK_H_
+#define _TESTS_CHECK_H_
+
+#include <stdio.h>
+#include <string.h>
+#include "../FileFS.h"
+
+// seed为0时内容全部为0
+static inline unsigned char pattern(int seed, unsigned long long pos)
+{
+	if ( seed == 0 ) return 0;
+	return (unsigned char)(pos * 31 + pos / 997 + seed);
+}
+
+// 在stream的当前位置写入size个byte，内容由写入的位置决定
+static inline int write_pattern(FileFS *ffs, FFS_FILE *f, int seed, unsigned long long size)
+{
+	unsigned char buf[1000];
+	unsigned long long pos = FileFS_ftell(ffs, f), k = 0;
+	size_t i, n;
+
+	while ( k < size ) {
+		n = sizeof(buf);
+		if ( n > size - k ) n = (size_t)(size - k);
+		for (i=0; i<n; i++) buf[i] = pattern(seed, pos + k + i);
+		if ( FileFS_fwrite(ffs, buf, 1, n, f) != n ) return 0;
+		k += n;
+	}
+	return 1;
+}
+
+// 创建filename并写入size个byte
+static inline int make_file(FileFS *ffs, const char *filename, int seed, unsigned long long size)
+{
+	FFS_FILE *f = FileFS_fopen(ffs, filename, "w");
+	int ok;
+
+	if ( f == NULL ) return 0;
+	ok = write_pattern(ffs, f, seed, size);
+	if ( ! FileFS_fclose(ffs, f) ) ok = 0;
+	return ok;
+}
+
+// 从offset开始的size个byte是seed的内容
+static inline int check_range(FileFS *ffs, FFS_FILE *f, int seed, unsigned long long offset, unsigned long long size)
+{
+	unsigned char buf[1000];
+	unsigned long long k = 0;
+	size_t i, n;
+
+	if ( ! FileFS_fseek(ffs, f, (long long)offset, FFS_SEEK_SET) ) return 0;
+	while ( k < size ) {
+		n = sizeof(buf);
+		if ( n > size - k ) n = (size_t)(size - k);
+		if ( FileFS_fread(ffs, buf, 1, n, f) != n ) return 0;
+		for (i=0; i<n; i++) {
+			if ( buf[i] != pattern(seed, offset + k + i) ) return 0;
+		}
+		k += n;
+	}
+	return 1;
+}
+
+// 文件长度为size，全部内容是seed的内容
+static inline int check_file(FileFS *ffs, const char *filename, int seed, unsigned long long size)
+{
+	unsigned long long n;
+	unsigned char c;
+	int ok;
+
+	if ( ! FileFS_filesize(ffs, filename, &n) || n != size ) return 0;
+	FFS_FILE *f = FileFS_fopen(ffs, filename, "r");
+	if ( f == NULL ) return 0;
+	ok = check_range(ffs, f, seed, 0, size);
+	if ( ok && FileFS_fread(ffs, &c, 1, 1, f) != 0 ) ok = 0; // 文件尾部
+	FileFS_fclose(ffs, f);
+	return ok;
+}
+
+// 重新mount，检查写入container的内容
+static inline int remount(FileFS *ffs, const char *fn)
+{
+	FileFS_umount(ffs);
+	return FileFS_mount(ffs, fn);
+}
+
+#endif
@@ -0,0 +1,63 @@
+// 压缩文件: 可以压缩的内容占用更少的block，随机读取和改写与普通文件相同
+#include "check.h"
+
+// container的block数量
+static long blocks(const char *fn)
+{
+	FILE *fp = fopen(fn, "rb");
+	long n;
+
+	if ( fp == NULL ) return -1;
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp) / 512;
+	fclose(fp);
+	return n;
+}
+
+int main()
+{
+	const char *fn = "compress.ffs";
+	static unsigned char buf[200000];
+	FFS_FILE *f;
+	long before;
+	size_t i;
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	// 重复的文本可以压缩
+	for (i=0; i<sizeof(buf); i++) buf[i] = "FileFS compress test "[i % 21];
+	before = blocks(fn);
+	f = FileFS_fopen(ffs, "/z", "w");
+	ok = f != NULL && FileFS_setcompress(ffs, f, 1) && FileFS_fwrite(ffs, buf, 1, sizeof(buf), f) == sizeof(buf);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+	ok = ok && blocks(fn) - before < (long)sizeof(buf) / 500 / 4;
+
+	// 跨越extent的改写
+	f = FileFS_fopen(ffs, "/z", "r+");
+	ok = ok && f != NULL && FileFS_fseek(ffs, f, 7000, FFS_SEEK_SET) && write_pattern(ffs, f, 10, 3000);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+	for (i=7000; i<10000; i++) buf[i] = pattern(10, i);
+
+	ok = ok && remount(ffs, fn);
+	unsigned long long size;
+	ok = ok && FileFS_filesize(ffs, "/z", &size) && size == sizeof(buf);
+	f = FileFS_fopen(ffs, "/z", "r");
+	if ( f == NULL ) ok = 0;
+	for (i=0; ok && i<sizeof(buf); i+=25000) { // 从后向前的随机位置读取
+		unsigned char c;
+		size_t pos = sizeof(buf) - 1 - i;
+		ok = FileFS_fseek(ffs, f, (long long)pos, FFS_SEEK_SET) && FileFS_fread(ffs, &c, 1, 1, f) == 1 && c == buf[pos];
+	}
+	static unsigned char out[sizeof(buf)];
+	ok = ok && FileFS_fseek(ffs, f, 0, FFS_SEEK_SET) && FileFS_fread(ffs, out, 1, sizeof(out), f) == sizeof(out);
+	ok = ok && memcmp(out, buf, sizeof(buf)) == 0;
+	if ( f != NULL ) FileFS_fclose(ffs, f);
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("compress: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
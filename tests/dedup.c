@@ -0,0 +1,35 @@
+// 块去重: 内容相同的block合并后释放，之后写入其中一个文件不影响另一个
+#include "check.h"
+
+int main()
+{
+	const char *fn = "dedup.ffs";
+	FFS_dedup stat;
+	FFS_FILE *f;
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	ok = FileFS_mkdir(ffs, "/d") == 0 && FileFS_mkdir(ffs, "/d/e") == 0;
+	ok = ok && make_file(ffs, "/d/a", 8, 60000);
+	ok = ok && make_file(ffs, "/d/e/b", 8, 60000);
+	ok = ok && FileFS_dedup(ffs, "/d", &stat, NULL, NULL);
+	ok = ok && stat.files == 2 && stat.merged > 0 && stat.freed > 0;
+
+	f = FileFS_fopen(ffs, "/d/e/b", "r+");
+	ok = ok && f != NULL && write_pattern(ffs, f, 9, 20000);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+
+	ok = ok && remount(ffs, fn);
+	ok = ok && check_file(ffs, "/d/a", 8, 60000);
+	f = FileFS_fopen(ffs, "/d/e/b", "r");
+	ok = ok && f != NULL && check_range(ffs, f, 9, 0, 20000) && check_range(ffs, f, 8, 20000, 40000);
+	if ( f != NULL ) FileFS_fclose(ffs, f);
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("dedup: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+// 延迟分配: fclose后写入container，rollback只撤销事务中写入的数据
+#include "check.h"
+
+int main()
+{
+	const char *fn = "delay.ffs";
+	FFS_FILE *f;
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	// 顺序写入，中间覆盖写入一次
+	f = FileFS_fopen(ffs, "/d", "w+");
+	ok = f != NULL && FileFS_setdelay(ffs, f, 1) && write_pattern(ffs, f, 3, 300000);
+	ok = ok && FileFS_fseek(ffs, f, 5000, FFS_SEEK_SET) && write_pattern(ffs, f, 3, 2000);
+	ok = ok && check_range(ffs, f, 3, 0, 300000); // 写入之前也能从内存中读到
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+
+	// 事务之前写入的数据保留，事务中写入的撤销
+	f = FileFS_fopen(ffs, "/r", "w");
+	ok = ok && f != NULL && FileFS_setdelay(ffs, f, 1) && write_pattern(ffs, f, 4, 3000);
+	ok = ok && FileFS_begin(ffs) && write_pattern(ffs, f, 4, 5000);
+	FileFS_rollback(ffs);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+
+	ok = ok && remount(ffs, fn);
+	ok = ok && check_file(ffs, "/d", 3, 300000);
+	ok = ok && check_file(ffs, "/r", 4, 3000);
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("delay: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
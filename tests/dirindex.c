@@ -0,0 +1,65 @@
+// 大目录的散列索引: 创建、删除、改名之后仍能按名称找到全部文件，readdir的数量正确
+#include "check.h"
+
+#define COUNT 1500
+
+// 目录中除"."和".."以外的项目数量
+static int count_items(FileFS *ffs, const char *path)
+{
+	FFS_DIR *dir;
+	FFS_dirent *e;
+	char *abs;
+	int n = 0;
+
+	dir = FileFS_opendir(ffs, path, &abs);
+	if ( dir == NULL ) return -1;
+	while ( (e = FileFS_readdir(ffs, dir)) != NULL ) {
+		if ( strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0 ) n++;
+	}
+	FileFS_closedir(ffs, dir);
+	return n;
+}
+
+int main()
+{
+	const char *fn = "dirindex.ffs";
+	char name[32], name2[32];
+	int i, ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	ok = FileFS_mkdir(ffs, "/big") == 0;
+	for (i=0; ok && i<COUNT; i++) {
+		sprintf(name, "/big/f%d", i);
+		ok = make_file(ffs, name, i % 7 + 1, (unsigned long long)(i % 5) * 300);
+	}
+	ok = ok && remount(ffs, fn);
+
+	// 删除3的倍数，改名5的倍数
+	for (i=0; ok && i<COUNT; i++) {
+		sprintf(name, "/big/f%d", i);
+		if ( i % 3 == 0 ) {
+			ok = FileFS_remove(ffs, name) == 0;
+		} else if ( i % 5 == 0 ) {
+			sprintf(name2, "/big/r%d", i);
+			ok = FileFS_rename(ffs, name, name2) == 0;
+		}
+	}
+	ok = ok && remount(ffs, fn);
+
+	for (i=0; ok && i<COUNT; i++) {
+		sprintf(name, "/big/f%d", i);
+		sprintf(name2, "/big/r%d", i);
+		if ( i % 3 == 0 ) ok = ! FileFS_file_exist(ffs, name) && ! FileFS_file_exist(ffs, name2);
+		else if ( i % 5 == 0 ) ok = ! FileFS_file_exist(ffs, name) && check_file(ffs, name2, i % 7 + 1, (unsigned long long)(i % 5) * 300);
+		else ok = check_file(ffs, name, i % 7 + 1, (unsigned long long)(i % 5) * 300);
+	}
+	ok = ok && count_items(ffs, "/big") == COUNT - (COUNT + 2) / 3;
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("dirindex: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
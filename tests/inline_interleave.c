@@ -0,0 +1,50 @@
+// 两个打开的inline文件交替写入: 一个文件的目录项变大时不能移动另一个打开的文件的目录项
+#include <stdio.h>
+#include <string.h>
+#include "../FileFS.h"
+
+static int check(FileFS *ffs, const char *filename, char c, int size)
+{
+	char buf[1024];
+	int i, n;
+
+	FFS_FILE *f = FileFS_fopen(ffs, filename, "r");
+	if ( f == NULL ) return 0;
+	n = (int)FileFS_fread(ffs, buf, 1, sizeof(buf), f);
+	FileFS_fclose(ffs, f);
+	if ( n != size ) return 0;
+	for (i=0; i<n; i++) {
+		if ( buf[i] != c ) return 0;
+	}
+	return 1;
+}
+
+int main()
+{
+	const char *fn = "inline_interleave.ffs";
+	int i, ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	FFS_FILE *a = FileFS_fopen(ffs, "/a", "w");
+	FFS_FILE *b = FileFS_fopen(ffs, "/b", "w");
+	if ( a == NULL || b == NULL ) return 1;
+	for (i=0; i<40; i++) {
+		if ( FileFS_fwrite(ffs, "aaaaaaaaaa", 1, 10, a) != 10 ) return 1;
+		if ( FileFS_fwrite(ffs, "bbbbbbb", 1, 7, b) != 7 ) return 1;
+	}
+	FileFS_fclose(ffs, a);
+	FileFS_fclose(ffs, b);
+
+	ok = check(ffs, "/a", 'a', 400) && check(ffs, "/b", 'b', 280);
+	FileFS_umount(ffs);
+	FileFS_mount(ffs, fn);
+	ok = ok && check(ffs, "/a", 'a', 400) && check(ffs, "/b", 'b', 280);
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("inline_interleave: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
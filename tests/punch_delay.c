@@ -0,0 +1,74 @@
+// 延迟分配: punch_hole丢弃全部未写入的block后文件长度不能丢失
+#include <stdio.h>
+#include <string.h>
+#include "../FileFS.h"
+
+static int check_size(FileFS *ffs, const char *filename, unsigned long long size)
+{
+	unsigned long long n;
+
+	if ( ! FileFS_filesize(ffs, filename, &n) ) return 0;
+	return n == size;
+}
+
+// 读取全部内容，全部为0
+static int check_zero(FileFS *ffs, const char *filename, unsigned long long size)
+{
+	char buf[4096];
+	unsigned long long i, n;
+
+	FFS_FILE *f = FileFS_fopen(ffs, filename, "r");
+	if ( f == NULL ) return 0;
+	n = FileFS_fread(ffs, buf, 1, sizeof(buf), f);
+	FileFS_fclose(ffs, f);
+	if ( n != size ) return 0;
+	for (i=0; i<n; i++) {
+		if ( buf[i] != 0 ) return 0;
+	}
+	return 1;
+}
+
+// delay为1时延迟分配，offset处写入len个字节后打孔[punch_offset, punch_offset+punch_len)
+static int punch(FileFS *ffs, const char *filename, unsigned char delay, long long offset, size_t len,
+	unsigned long long punch_offset, unsigned long long punch_len)
+{
+	char buf[2048];
+	int ok;
+
+	FFS_FILE *f = FileFS_fopen(ffs, filename, "w+");
+	if ( f == NULL ) return 0;
+	memset(buf, 'x', sizeof(buf));
+	ok = FileFS_setdelay(ffs, f, delay);
+	ok = ok && FileFS_fseek(ffs, f, offset, FFS_SEEK_SET);
+	ok = ok && FileFS_fwrite(ffs, buf, 1, len, f) == len;
+	ok = ok && FileFS_punch_hole(ffs, f, punch_offset, punch_len);
+	if ( ! FileFS_fclose(ffs, f) ) ok = 0;
+	return ok;
+}
+
+int main()
+{
+	const char *fn = "punch_delay.ffs";
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	ok = punch(ffs, "/a", 1, 0, 1734, 0, 2000);
+	ok = ok && punch(ffs, "/b", 1, 3000, 300, 2500, 1000);
+	ok = ok && punch(ffs, "/c", 0, 3000, 300, 2500, 1000);
+	ok = ok && check_size(ffs, "/a", 1734) && check_zero(ffs, "/a", 1734);
+	ok = ok && check_size(ffs, "/b", 3300) && check_zero(ffs, "/b", 3300);
+	ok = ok && check_size(ffs, "/c", 3300) && check_zero(ffs, "/c", 3300);
+	FileFS_umount(ffs);
+	ok = ok && FileFS_mount(ffs, fn);
+	ok = ok && check_size(ffs, "/a", 1734) && check_zero(ffs, "/a", 1734);
+	ok = ok && check_size(ffs, "/b", 3300) && check_zero(ffs, "/b", 3300);
+	ok = ok && check_size(ffs, "/c", 3300) && check_zero(ffs, "/c", 3300);
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("punch_delay: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+// reflink: FileFS_copy共享block，写入其中一个文件时只复制被修改的block，另一个文件不变
+#include "check.h"
+
+int main()
+{
+	const char *fn = "reflink.ffs";
+	FFS_FILE *f;
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	ok = make_file(ffs, "/a", 5, 150000);
+	ok = ok && FileFS_copy(ffs, "/a", "/b") == 0;
+	ok = ok && FileFS_copy(ffs, "/b", "/c") == 0;
+
+	// b的中间和c的尾部改写，a保持原来的内容
+	f = FileFS_fopen(ffs, "/b", "r+");
+	ok = ok && f != NULL && FileFS_fseek(ffs, f, 70000, FFS_SEEK_SET) && write_pattern(ffs, f, 6, 10000);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+	f = FileFS_fopen(ffs, "/c", "a");
+	ok = ok && f != NULL && write_pattern(ffs, f, 7, 600);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+	ok = ok && FileFS_remove(ffs, "/a") == 0 && make_file(ffs, "/a", 5, 150000);
+
+	ok = ok && remount(ffs, fn);
+	ok = ok && check_file(ffs, "/a", 5, 150000);
+	f = FileFS_fopen(ffs, "/b", "r");
+	ok = ok && f != NULL && check_range(ffs, f, 5, 0, 70000) && check_range(ffs, f, 6, 70000, 10000) && check_range(ffs, f, 5, 80000, 70000);
+	if ( f != NULL ) FileFS_fclose(ffs, f);
+	f = FileFS_fopen(ffs, "/c", "r");
+	ok = ok && f != NULL && check_range(ffs, f, 5, 0, 150000) && check_range(ffs, f, 7, 150000, 600);
+	if ( f != NULL ) FileFS_fclose(ffs, f);
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("reflink: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+// rmtree: 删除整个目录树，释放的block被之后的写入重用，container不会增大
+#include "check.h"
+
+// 在path中创建depth层子目录，每层有files个文件
+static int make_tree(FileFS *ffs, const char *path, int depth, int files)
+{
+	char name[256];
+	int i;
+
+	if ( FileFS_mkdir(ffs, path) != 0 ) return 0;
+	for (i=0; i<files; i++) {
+		sprintf(name, "%s/f%d", path, i);
+		if ( ! make_file(ffs, name, i + 1, (unsigned long long)i * 700) ) return 0;
+	}
+	if ( depth == 0 ) return 1;
+	for (i=0; i<2; i++) {
+		sprintf(name, "%s/d%d", path, i);
+		if ( ! make_tree(ffs, name, depth - 1, files) ) return 0;
+	}
+	return 1;
+}
+
+static long filesize(const char *fn)
+{
+	FILE *fp = fopen(fn, "rb");
+	long n;
+
+	if ( fp == NULL ) return -1;
+	fseek(fp, 0, SEEK_END);
+	n = ftell(fp);
+	fclose(fp);
+	return n;
+}
+
+int main()
+{
+	const char *fn = "rmtree.ffs";
+	long size;
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	ok = make_file(ffs, "/keep", 11, 5000);
+	ok = ok && make_tree(ffs, "/t", 3, 30);
+	size = filesize(fn);
+	ok = ok && FileFS_rmtree(ffs, "/t") == 0;
+	ok = ok && ! FileFS_dir_exist(ffs, "/t") && FileFS_rmtree(ffs, "/t") == 3;
+
+	ok = ok && remount(ffs, fn);
+	ok = ok && ! FileFS_dir_exist(ffs, "/t") && check_file(ffs, "/keep", 11, 5000);
+	// 同样的目录树只使用释放的block
+	ok = ok && make_tree(ffs, "/t", 3, 30) && filesize(fn) == size;
+	ok = ok && check_file(ffs, "/t/d1/d0/d1/f29", 30, 29 * 700);
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("rmtree: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,41 @@
+// 稀疏文件: 尾部之后写入留下空洞，punch_hole释放中间的block，重新mount后内容和长度不变
+#include "check.h"
+
+int main()
+{
+	const char *fn = "sparse.ffs";
+	FFS_FILE *f;
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	// [0, 1000)数据，[1000, 200000)空洞，[200000, 201234)数据
+	f = FileFS_fopen(ffs, "/s", "w");
+	ok = f != NULL && write_pattern(ffs, f, 1, 1000);
+	ok = ok && FileFS_fseek(ffs, f, 200000, FFS_SEEK_SET) && write_pattern(ffs, f, 1, 1234);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+
+	// [0, 100000)数据，在[3000, 90000)打洞
+	ok = ok && make_file(ffs, "/p", 2, 100000);
+	f = FileFS_fopen(ffs, "/p", "r+");
+	ok = ok && f != NULL && FileFS_punch_hole(ffs, f, 3000, 87000);
+	if ( f != NULL && ! FileFS_fclose(ffs, f) ) ok = 0;
+
+	ok = ok && remount(ffs, fn);
+	f = FileFS_fopen(ffs, "/s", "r");
+	ok = ok && f != NULL && check_range(ffs, f, 1, 0, 1000) && check_range(ffs, f, 0, 1000, 199000) && check_range(ffs, f, 1, 200000, 1234);
+	if ( f != NULL ) FileFS_fclose(ffs, f);
+	f = FileFS_fopen(ffs, "/p", "r");
+	ok = ok && f != NULL && check_range(ffs, f, 2, 0, 3000) && check_range(ffs, f, 0, 3000, 87000) && check_range(ffs, f, 2, 90000, 10000);
+	if ( f != NULL ) FileFS_fclose(ffs, f);
+	unsigned long long size;
+	ok = ok && FileFS_filesize(ffs, "/s", &size) && size == 201234;
+	ok = ok && FileFS_filesize(ffs, "/p", &size) && size == 100000;
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("sparse: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
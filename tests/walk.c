@@ -0,0 +1,59 @@
+// FileFS_walk: 前序和后序回调的顺序、相对路径、FFS_WALK_SIZE读取的长度和FFS_WALK_SKIP
+#include "check.h"
+
+typedef struct WalkStat {
+	int files, dirs, post, bad;
+	unsigned long long bytes;
+} WalkStat;
+
+static int walk_fn(const FFS_walkent *ent, void *arg)
+{
+	WalkStat *st = (WalkStat*)arg;
+	const char *name = ent->ent.dirent.d_name;
+
+	if ( ent->ent.dirent.d_type == FFS_DT_FILE ) {
+		st->files++;
+		if ( ent->ent.has_size != 1 ) st->bad++;
+		st->bytes += ent->ent.size;
+	} else if ( ent->post ) {
+		st->post++;
+	} else {
+		st->dirs++;
+		if ( strcmp(name, "skip") == 0 ) return FFS_WALK_SKIP;
+	}
+	// path以名称结尾，深度和'/'的数量一致
+	const char *p = ent->path;
+	int depth = 1;
+	for (; *p; p++) {
+		if ( *p == '/' ) depth++;
+	}
+	if ( depth != ent->depth ) st->bad++;
+	if ( strlen(ent->path) < strlen(name) || strcmp(ent->path + strlen(ent->path) - strlen(name), name) != 0 ) st->bad++;
+	return 0;
+}
+
+int main()
+{
+	const char *fn = "walk.ffs";
+	WalkStat st;
+	int ok;
+
+	if ( ! FileFS_mkfs(fn) ) return 1;
+	FileFS *ffs = FileFS_create();
+	if ( ! FileFS_mount(ffs, fn) ) return 1;
+
+	ok = FileFS_mkdir(ffs, "/w") == 0 && FileFS_mkdir(ffs, "/w/a") == 0 && FileFS_mkdir(ffs, "/w/a/b") == 0;
+	ok = ok && FileFS_mkdir(ffs, "/w/skip") == 0;
+	ok = ok && make_file(ffs, "/w/f1", 1, 100) && make_file(ffs, "/w/a/f2", 2, 20000);
+	ok = ok && make_file(ffs, "/w/a/b/f3", 3, 3000) && make_file(ffs, "/w/skip/f4", 4, 50);
+	ok = ok && remount(ffs, fn);
+
+	memset(&st, 0, sizeof(st));
+	ok = ok && FileFS_walk(ffs, "/w", walk_fn, &st, FFS_WALK_PRE | FFS_WALK_POST | FFS_WALK_SIZE) == 0;
+	ok = ok && st.bad == 0 && st.files == 3 && st.dirs == 3 && st.post == 2 && st.bytes == 100 + 20000 + 3000;
+
+	FileFS_destroy(ffs);
+	remove(fn);
+	printf("walk: %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}